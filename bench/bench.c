@@ -0,0 +1,598 @@
+/*
+ * Copyright (c) 2019 The University of Queensland
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <err.h>
+#include <stdatomic.h>
+
+#include <event.h>
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/if_ether.h>
+#include <arpa/inet.h>
+
+#include "dhcp.h"
+#include "dhcping.h"
+
+#define BENCH_ITERATIONS	1000000
+#define BENCH_LOOKUPS		65536	/* random probes to look up */
+
+/*
+ * Replies as the common servers send them, down to the option order,
+ * so parsing sees the same spread of options it does in practice.
+ * They're written out from what each server sends rather than copied
+ * from captures, so no real addresses or hostnames end up in here.
+ */
+struct bench_reply {
+	const char		*name;
+	uint8_t			type;
+	const uint8_t		*opts;
+	size_t			len;
+	const uint8_t		*file;		/* overloaded into the file */
+	size_t			filelen;
+};
+
+#define SERVERID	54, 4, 192, 0, 2, 1
+#define MASK		1, 4, 255, 255, 255, 0
+#define ROUTER		3, 4, 192, 0, 2, 254
+#define DNS		6, 8, 192, 0, 2, 53, 192, 0, 2, 54
+#define DOMAIN		15, 11, 'e', 'x', 'a', 'm', 'p', 'l', 'e', '.', \
+			    'c', 'o', 'm'
+#define HOSTNAME	12, 8, 'c', 'l', 'i', 'e', 'n', 't', '0', '1'
+
+static const uint8_t isc_offer[] = {
+	53, 1, DHCPOFFER, SERVERID, 51, 4, 0, 0, 0x0e, 0x10, MASK, ROUTER,
+	DNS, DOMAIN, DHO_END,
+};
+
+static const uint8_t isc_ack[] = {
+	53, 1, DHCPACK, SERVERID, 51, 4, 0, 0, 0x0e, 0x10, MASK, ROUTER,
+	DNS, DOMAIN, 58, 4, 0, 0, 0x07, 0x08, 59, 4, 0, 0, 0x0c, 0x4e,
+	DHO_END,
+};
+
+static const uint8_t kea_ack[] = {
+	53, 1, DHCPACK, SERVERID, 51, 4, 0, 0, 0x1c, 0x20,
+	58, 4, 0, 0, 0x0e, 0x10, 59, 4, 0, 0, 0x18, 0xb0, MASK, ROUTER,
+	6, 4, 192, 0, 2, 53, DOMAIN, HOSTNAME, DHO_END,
+};
+
+static const uint8_t dnsmasq_ack[] = {
+	53, 1, DHCPACK, SERVERID, 51, 4, 0, 0, 0xa8, 0xc0,
+	58, 4, 0, 0, 0x54, 0x60, 59, 4, 0, 0, 0x93, 0xa8, MASK,
+	28, 4, 192, 0, 2, 255, ROUTER, 6, 4, 192, 0, 2, 1, DOMAIN, HOSTNAME,
+	DHO_END,
+};
+
+static const uint8_t windows_ack[] = {
+	53, 1, DHCPACK, 58, 4, 0, 3, 0xf4, 0x80, 59, 4, 0, 6, 0x97, 0xe0,
+	51, 4, 0, 7, 0xe9, 0x00, SERVERID, MASK,
+	81, 23, 0x03, 0xff, 0xff, 'c', 'l', 'i', 'e', 'n', 't', '0', '1', '.',
+	    'e', 'x', 'a', 'm', 'p', 'l', 'e', '.', 'c', 'o', 'm',
+	ROUTER, DNS, DOMAIN, DHO_END,
+};
+
+static const uint8_t relay_ack[] = {
+	53, 1, DHCPACK, SERVERID, 51, 4, 0, 0, 0x0e, 0x10, MASK, ROUTER,
+	82, 14, 1, 6, 'p', 'o', 'r', 't', '0', '1', 2, 4, 0, 1, 2, 3,
+	DHO_END,
+};
+
+static const uint8_t pxe_ack[] = {
+	53, 1, DHCPACK, SERVERID, 51, 4, 0, 0, 0x0e, 0x10,
+	58, 4, 0, 0, 0x07, 0x08, 59, 4, 0, 0, 0x0c, 0x4e, MASK, ROUTER,
+	6, 12, 192, 0, 2, 53, 192, 0, 2, 54, 192, 0, 2, 55, DOMAIN,
+	119, 13, 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0,
+	121, 13, 24, 10, 0, 0, 192, 0, 2, 1, 0, 192, 0, 2, 254,
+	42, 8, 192, 0, 2, 123, 192, 0, 2, 124, 44, 4, 192, 0, 2, 137,
+	66, 9, 't', 'f', 't', 'p', '.', 'h', 'o', 's', 't',
+	67, 10, 'p', 'x', 'e', 'l', 'i', 'n', 'u', 'x', '.', '0',
+	DHO_END,
+};
+
+static const uint8_t overload_offer[] = {
+	53, 1, DHCPOFFER, 52, 1, 1, SERVERID, DHO_END,
+};
+
+static const uint8_t overload_file[] = {
+	51, 4, 0, 0, 0x0e, 0x10, MASK, ROUTER, DNS, DHO_END,
+};
+
+static const uint8_t nak[] = {
+	53, 1, DHCPNAK, SERVERID, 56, 13, 'w', 'r', 'o', 'n', 'g', ' ',
+	    'n', 'e', 't', 'w', 'o', 'r', 'k',
+	DHO_END,
+};
+
+#define REPLY(_n, _t, _o)	{ _n, _t, _o, sizeof(_o), NULL, 0 }
+
+static const struct bench_reply bench_corpus[] = {
+	REPLY("isc offer", DHCPOFFER, isc_offer),
+	REPLY("isc ack", DHCPACK, isc_ack),
+	REPLY("kea ack", DHCPACK, kea_ack),
+	REPLY("dnsmasq ack", DHCPACK, dnsmasq_ack),
+	REPLY("windows ack", DHCPACK, windows_ack),
+	REPLY("relayed ack", DHCPACK, relay_ack),
+	REPLY("pxe ack", DHCPACK, pxe_ack),
+	{ "overloaded offer", DHCPOFFER, overload_offer,
+	    sizeof(overload_offer), overload_file, sizeof(overload_file) },
+	REPLY("nak", DHCPNAK, nak),
+};
+
+static const unsigned int bench_sizes[] = { 1000, 100000, 1000000 };
+
+unsigned long bench_allocs;
+static volatile uintptr_t bench_sink;
+
+__dead static void usage(void);
+
+static void	bench_init(struct dhcping *, struct event_base *);
+static void	bench_start(struct timespec *, unsigned long *);
+static void	bench_end(const char *, unsigned long,
+		    const struct timespec *, unsigned long);
+static void	bench_reply(struct dhcping_rx *, const struct bench_reply *,
+		    uint32_t);
+static void	bench_packet(struct event_base *, unsigned long);
+static void	bench_packet_build(struct dhcping_probe *, uint32_t);
+static void	bench_parse(unsigned long);
+static void	bench_demux(struct event_base *, unsigned int,
+		    unsigned long);
+static void	bench_timers(struct event_base *, unsigned int,
+		    unsigned long);
+static void	bench_expired(void *);
+static void	bench_evtimer(int, short, void *);
+
+__dead static void
+usage(void)
+{
+	extern char *__progname;
+
+	fprintf(stderr, "usage: %s [-n iterations]\n", __progname);
+
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct event_base *base;
+	unsigned long n = BENCH_ITERATIONS;
+	const char *errstr;
+	size_t i;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n':
+			n = strtonum(optarg, 1, 1000000000, &errstr);
+			if (errstr != NULL)
+				errx(1, "iterations %s: %s", optarg, errstr);
+			break;
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+
+	argc -= optind;
+	if (argc != 0)
+		usage();
+
+	/* the probe pool sets its timers up on a base */
+	base = event_init();
+
+	printf("%-28s %10s %12s %10s\n", "BENCHMARK", "OPS", "NS/OP",
+	    "ALLOCS/OP");
+
+	bench_packet(base, n);
+	bench_parse(n);
+	for (i = 0; i < sizeof(bench_sizes) / sizeof(bench_sizes[0]); i++)
+		bench_demux(base, bench_sizes[i], n);
+	for (i = 0; i < sizeof(bench_sizes) / sizeof(bench_sizes[0]); i++)
+		bench_timers(base, bench_sizes[i], n);
+
+	return (0);
+}
+
+static void
+bench_init(struct dhcping *dhcping, struct event_base *base)
+{
+	memset(dhcping, 0, sizeof(*dhcping));
+	dhcping->base = base;
+	dhcping->xid_mask = 0xffffffff;
+	dhcping->xid_key = arc4random();
+	TAILQ_INIT(&dhcping->servers);
+	TAILQ_INIT(&dhcping->templates);
+	TAILQ_INIT(&dhcping->optsets);
+	TAILQ_INIT(&dhcping->idle);
+	TAILQ_INIT(&dhcping->probes);
+	TAILQ_INIT(&dhcping->txq);
+
+	dhcping->optset = dhcping_optset_get(dhcping, NULL, 0);
+	if (dhcping->optset == NULL) {
+		/* error printed by dhcping_optset_get */
+		exit(1);
+	}
+}
+
+static void
+bench_start(struct timespec *start, unsigned long *allocs)
+{
+	*allocs = bench_allocs;
+	if (clock_gettime(CLOCK_MONOTONIC, start) == -1)
+		err(1, "clock_gettime");
+}
+
+static void
+bench_end(const char *name, unsigned long n, const struct timespec *start,
+    unsigned long allocs)
+{
+	struct timespec now, diff;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+		err(1, "clock_gettime");
+	allocs = bench_allocs - allocs;
+
+	timespecsub(&now, start, &diff);
+	printf("%-28s %10lu %12.1f %10.2f\n", name, n,
+	    ((double)diff.tv_sec * 1000000000.0 + diff.tv_nsec) / n,
+	    (double)allocs / n);
+}
+
+static void
+bench_reply(struct dhcping_rx *rx, const struct bench_reply *r, uint32_t xid)
+{
+	static const uint8_t cookie[DHCP_OPTIONS_COOKIE_LEN] =
+	    DHCP_OPTIONS_COOKIE;
+	struct dhcp_packet *p = &rx->u.packet;
+
+	memset(rx, 0, sizeof(*rx));
+	rx->sin.sin_family = AF_INET;
+	rx->sin.sin_addr.s_addr = htonl(0xc0000201);	/* 192.0.2.1 */
+
+	p->op = BOOTREPLY;
+	p->htype = HTYPE_ETHER;
+	p->hlen = ETHER_ADDR_LEN;
+	p->xid = xid;
+	p->yiaddr.s_addr = htonl(0xc0000264);
+	memcpy(p->cookie, cookie, sizeof(cookie));
+	memcpy(p + 1, r->opts, r->len);
+	if (r->file != NULL)
+		memcpy(p->file, r->file, r->filelen);
+
+	/* servers pad replies out to the BOOTP minimum */
+	rx->len = MAX(sizeof(*p) + r->len, BOOTP_MIN_LEN);
+}
+
+/* building a template from scratch, against copying one for each check */
+static void
+bench_packet(struct event_base *base, unsigned long n)
+{
+	struct dhcping dhcping;
+	struct dhcping_template *tmpl;
+	struct dhcping_server server;
+	struct dhcping_probe *probe;
+	struct timespec start;
+	unsigned long allocs;
+	struct in_addr giaddr;
+	unsigned long i;
+
+	bench_init(&dhcping, base);
+	giaddr.s_addr = htonl(0xc0000202);
+	tmpl = dhcping_template_get(&dhcping, giaddr, dhcping.optset);
+	if (tmpl == NULL)
+		err(1, "template");
+
+	memset(&server, 0, sizeof(server));
+	server.dhcping = &dhcping;
+	server.tmpl = tmpl;
+	if (dhcping_pool_init(&dhcping, 1) == -1)
+		err(1, "probe pool");
+	probe = dhcping_probe_get(&dhcping, &server, NULL);
+
+	bench_start(&start, &allocs);
+	for (i = 0; i < n; i++) {
+		probe->ea.ether_addr_octet[5] = i;
+		bench_packet_build(probe, i);
+	}
+	bench_end("packet build", n, &start, allocs);
+
+	bench_start(&start, &allocs);
+	for (i = 0; i < n; i++) {
+		probe->ea.ether_addr_octet[5] = i;
+		dhcping_packet_copy(probe, i);
+	}
+	bench_end("packet copy", n, &start, allocs);
+	bench_sink = probe->len;
+}
+
+/*
+ * What every check did before there were templates: the whole packet
+ * built from nothing in the probe's own buffer.
+ */
+static void
+bench_packet_build(struct dhcping_probe *probe, uint32_t xid)
+{
+	static const uint8_t cookie[DHCP_OPTIONS_COOKIE_LEN] =
+	    DHCP_OPTIONS_COOKIE;
+	const struct dhcping_template *tmpl = probe->tmpl;
+	struct dhcp_packet *p = dhcping_packet(probe);
+	uint8_t *dho;
+
+	memset(probe->packet, 0, sizeof(probe->packet));
+
+	p->op = BOOTREQUEST;
+	p->htype = HTYPE_ETHER;
+	p->hlen = ETHER_ADDR_LEN;
+	p->hops = 1;
+	p->xid = probe->xid = xid;
+	p->giaddr = tmpl->giaddr;
+	memcpy(p->chaddr, &probe->ea, sizeof(probe->ea));
+	memcpy(p->cookie, cookie, sizeof(cookie));
+
+	dho = (uint8_t *)(p + 1);
+
+	*dho++ = DHO_DHCP_MESSAGE_TYPE;
+	*dho++ = 1;
+	*dho++ = DHCPDISCOVER;
+
+	memcpy(dho, tmpl->optset->buf, tmpl->optset->len);
+	dho += tmpl->optset->len;
+
+	*dho++ = DHO_END;
+	probe->len = dhcping_packet_len(probe->packet, dho);
+}
+
+static void
+bench_parse(unsigned long n)
+{
+	struct dhcping_rx *rxs;
+	struct timespec start;
+	unsigned long allocs;
+	const uint8_t *dho;
+	uint8_t len;
+	char name[64];
+	size_t c, nc = sizeof(bench_corpus) / sizeof(bench_corpus[0]);
+	unsigned long i;
+
+	rxs = calloc(nc, sizeof(*rxs));
+	if (rxs == NULL)
+		err(1, "corpus");
+	for (c = 0; c < nc; c++) {
+		bench_reply(&rxs[c], &bench_corpus[c], c);
+		if (dhcping_parse(&rxs[c]) == -1 ||
+		    dhcping_message_type(&rxs[c]) != bench_corpus[c].type)
+			errx(1, "%s doesn't parse", bench_corpus[c].name);
+	}
+
+	for (c = 0; c < nc; c++) {
+		snprintf(name, sizeof(name), "parse %s", bench_corpus[c].name);
+		bench_start(&start, &allocs);
+		for (i = 0; i < n; i++) {
+			dhcping_parse(&rxs[c]);
+			bench_sink += dhcping_message_type(&rxs[c]);
+		}
+		bench_end(name, n, &start, allocs);
+	}
+
+	/* what dhcping_reply and dhcping_offer look at */
+	bench_start(&start, &allocs);
+	for (i = 0; i < n; i++) {
+		struct dhcping_rx *rx = &rxs[i % nc];
+
+		dhcping_parse(rx);
+		bench_sink += dhcping_message_type(rx);
+		dho = dhcping_option(rx, DHO_DHCP_SERVER_IDENTIFIER, &len);
+		bench_sink += (uintptr_t)dho;
+		dho = dhcping_option(rx, DHO_DHCP_LEASE_TIME, &len);
+		bench_sink += (uintptr_t)dho;
+	}
+	bench_end("parse corpus", n, &start, allocs);
+
+	free(rxs);
+}
+
+/* looking replies up among this many probes in flight */
+static void
+bench_demux(struct event_base *base, unsigned int nprobes, unsigned long n)
+{
+	struct dhcping dhcping;
+	struct dhcping_server server;
+	struct dhcping_probe *probe;
+	struct dhcping_rx *rx;
+	struct ether_addr ea;
+	struct timespec start;
+	unsigned long allocs;
+	uint32_t *xids, *lookups;
+	char name[64];
+	unsigned long i;
+	unsigned int p;
+
+	bench_init(&dhcping, base);
+	memset(&server, 0, sizeof(server));
+	server.dhcping = &dhcping;
+	server.sin.sin_family = AF_INET;
+	server.sin.sin_addr.s_addr = htonl(0xc0000201);
+	server.giaddr.s_addr = htonl(0xc0000202);
+	server.tmpl = dhcping_template_get(&dhcping, server.giaddr,
+	    dhcping.optset);
+	if (server.tmpl == NULL)
+		err(1, "template");
+
+	if (dhcping_pool_init(&dhcping, nprobes) == -1)
+		err(1, "probe pool");
+	if (dhcping_hash_init(&dhcping, nprobes) == -1)
+		err(1, "hash");
+
+	xids = calloc(nprobes, sizeof(*xids));
+	lookups = calloc(BENCH_LOOKUPS, sizeof(*lookups));
+	rx = calloc(1, sizeof(*rx));
+	if (xids == NULL || lookups == NULL || rx == NULL)
+		err(1, "demux");
+
+	memset(&ea, 0, sizeof(ea));
+	for (p = 0; p < nprobes; p++) {
+		dhcping_ea_set(&ea, p);
+		probe = dhcping_probe_get(&dhcping, &server, &ea);
+
+		/* the same xids dhcping_check would make */
+		xids[p] = htonl(dhcping_permute(p, (uint64_t)1 << 32,
+		    dhcping.xid_key));
+		dhcping_packet_copy(probe, xids[p]);
+		probe->sin = server.sin;
+		dhcping_hash_add(probe);
+	}
+	for (i = 0; i < BENCH_LOOKUPS; i++)
+		lookups[i] = xids[arc4random_uniform(nprobes)];
+
+	bench_reply(rx, &bench_corpus[0], 0);
+	rx->u.packet.giaddr = server.giaddr;
+
+	snprintf(name, sizeof(name), "demux %u", nprobes);
+	bench_start(&start, &allocs);
+	for (i = 0; i < n; i++) {
+		rx->u.packet.xid = lookups[i % BENCH_LOOKUPS];
+		probe = dhcping_match(&dhcping, rx);
+		if (probe == NULL)
+			errx(1, "%s lost a probe", name);
+		bench_sink += (uintptr_t)probe;
+	}
+	bench_end(name, n, &start, allocs);
+
+	/* stray replies for xids that aren't in flight */
+	snprintf(name, sizeof(name), "demux %u miss", nprobes);
+	bench_start(&start, &allocs);
+	for (i = 0; i < n; i++) {
+		rx->u.packet.xid = ~lookups[i % BENCH_LOOKUPS];
+		bench_sink += (uintptr_t)dhcping_match(&dhcping, rx);
+	}
+	bench_end(name, n, &start, allocs);
+
+	free(rx);
+	free(lookups);
+	free(xids);
+	for (i = 0; i < dhcping.npools; i++)
+		free(dhcping.pools[i]);
+	free(dhcping.pools);
+	free(dhcping.hash);
+}
+
+/*
+ * Each reply cancels a probe's timer and each new check arms one, with
+ * the rest of the probes' timers still pending. libevent's own timers
+ * are timed doing the same thing to compare against.
+ */
+static void
+bench_timers(struct event_base *base, unsigned int ntimers, unsigned long n)
+{
+	struct dhcping dhcping;
+	struct dhcping_timer *timers;
+	struct event *events;
+	struct timespec start;
+	struct timeval tv;
+	unsigned long allocs;
+	uint32_t *delays, *lookups;
+	char name[64];
+	unsigned long i;
+	unsigned int t;
+
+	bench_init(&dhcping, base);
+	dhcping.wait = DHCP_MAXWAIT_DEFAULT;
+	if (dhcping_wheel_init(&dhcping) == -1)
+		err(1, "timer wheel");
+
+	timers = calloc(ntimers, sizeof(*timers));
+	events = calloc(ntimers, sizeof(*events));
+	delays = calloc(BENCH_LOOKUPS, sizeof(*delays));
+	lookups = calloc(BENCH_LOOKUPS, sizeof(*lookups));
+	if (timers == NULL || events == NULL || delays == NULL ||
+	    lookups == NULL)
+		err(1, "timers");
+
+	/* spread over the wait like the probes in flight would be */
+	for (i = 0; i < BENCH_LOOKUPS; i++) {
+		delays[i] = 1 + arc4random_uniform(DHCP_MAXWAIT_DEFAULT * 1000);
+		lookups[i] = arc4random_uniform(ntimers);
+	}
+
+	for (t = 0; t < ntimers; t++) {
+		dhcping_timer_set(&timers[t], bench_expired, NULL);
+		dhcping_timer_add(&dhcping.wheel, &timers[t],
+		    delays[t % BENCH_LOOKUPS]);
+	}
+
+	snprintf(name, sizeof(name), "timer wheel %u", ntimers);
+	bench_start(&start, &allocs);
+	for (i = 0; i < n; i++) {
+		t = lookups[i % BENCH_LOOKUPS];
+		dhcping_timer_del(&dhcping.wheel, &timers[t]);
+		dhcping_timer_add(&dhcping.wheel, &timers[t],
+		    delays[i % BENCH_LOOKUPS]);
+	}
+	bench_end(name, n, &start, allocs);
+
+	for (t = 0; t < ntimers; t++)
+		dhcping_timer_del(&dhcping.wheel, &timers[t]);
+
+	for (t = 0; t < ntimers; t++) {
+		evtimer_set(&events[t], bench_evtimer, NULL);
+		event_base_set(base, &events[t]);
+		dhcping_tv_ms(&tv, delays[t % BENCH_LOOKUPS] / 1000);
+		evtimer_add(&events[t], &tv);
+	}
+
+	snprintf(name, sizeof(name), "timer heap %u", ntimers);
+	bench_start(&start, &allocs);
+	for (i = 0; i < n; i++) {
+		t = lookups[i % BENCH_LOOKUPS];
+		evtimer_del(&events[t]);
+		dhcping_tv_ms(&tv, delays[i % BENCH_LOOKUPS] / 1000);
+		evtimer_add(&events[t], &tv);
+	}
+	bench_end(name, n, &start, allocs);
+
+	for (t = 0; t < ntimers; t++)
+		evtimer_del(&events[t]);
+
+	free(lookups);
+	free(delays);
+	free(events);
+	free(timers);
+	free(dhcping.wheel.buckets);
+}
+
+/* nothing runs the event loop, so these never go off */
+static void
+bench_expired(void *arg)
+{
+	abort();
+}
+
+static void
+bench_evtimer(int fd, short revents, void *arg)
+{
+	abort();
+}
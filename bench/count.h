@@ -0,0 +1,18 @@
+/*
+ * Included ahead of everything the benchmark is built from, so the
+ * allocations dhcping makes itself can be counted. What libc and
+ * libevent allocate on their own isn't seen.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+extern unsigned long bench_allocs;
+
+#undef strdup
+
+#define malloc(n)		(bench_allocs++, malloc(n))
+#define calloc(n, s)		(bench_allocs++, calloc(n, s))
+#define realloc(p, n)		(bench_allocs++, realloc(p, n))
+#define reallocarray(p, n, s)	(bench_allocs++, reallocarray(p, n, s))
+#define strdup(s)		(bench_allocs++, strdup(s))
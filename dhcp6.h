@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2019 The University of Queensland
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* The bits of DHCPv6 (RFC 8415) a relay needs to know */
+
+#define DHCP6_SERVER_PORT	547
+
+/* Message types */
+#define DHCP6_SOLICIT		1
+#define DHCP6_ADVERTISE		2
+#define DHCP6_REPLY		7
+#define DHCP6_RELAY_FORW	12
+#define DHCP6_RELAY_REPL	13
+
+/*
+ * Relay messages have a type, a hop count, and the link and peer
+ * addresses, then options. Client and server messages have a type
+ * and a 24 bit transaction id, then options. Options have a 16 bit
+ * code and length, all in network byte order.
+ */
+#define DHCP6_RELAY_LINK	2
+#define DHCP6_RELAY_PEER	18
+#define DHCP6_RELAY_LEN		34
+#define DHCP6_MSG_LEN		4
+#define DHCP6_OPT_HDR_LEN	4
+
+/* Option codes */
+#define DHCP6_OPT_CLIENTID	1
+#define DHCP6_OPT_IA_NA		3
+#define DHCP6_OPT_ORO		6
+#define DHCP6_OPT_ELAPSED_TIME	8
+#define DHCP6_OPT_RELAY_MSG	9
+#define DHCP6_OPT_STATUS_CODE	13
+#define DHCP6_OPT_DNS_SERVERS	23
+#define DHCP6_OPT_DOMAIN_LIST	24
+
+/* Status codes */
+#define DHCP6_STATUS_SUCCESS	0
+#define DHCP6_STATUS_NOADDRS	2
+
+/* DUID types */
+#define DHCP6_DUID_LL		3
+
+/*
+ * Where things are in the Relay-Forw dhcping sends: the SOLICIT, its
+ * elapsed time value, the client DUID, and the IAID.
+ */
+#define DHCP6_PROBE_MSG		(DHCP6_RELAY_LEN + DHCP6_OPT_HDR_LEN)
+#define DHCP6_PROBE_ELAPSED	(DHCP6_PROBE_MSG + DHCP6_MSG_LEN + \
+				    DHCP6_OPT_HDR_LEN)
+#define DHCP6_PROBE_DUID	(DHCP6_PROBE_ELAPSED + 2 + DHCP6_OPT_HDR_LEN)
+#define DHCP6_PROBE_IAID	(DHCP6_PROBE_DUID + 4 + 6 + DHCP6_OPT_HDR_LEN)
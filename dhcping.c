@@ -1,4 +1,3 @@
-
 /*
  * Copyright (c) 2019 The University of Queensland
  *
@@ -15,179 +14,234 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include <pwd.h>
 #include <errno.h>
 #include <err.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 
 #include <event.h>
+#include <evdns.h>
 
 #include <sys/types.h>
+#include <sys/param.h>
+#include <sys/queue.h>
 #include <sys/socket.h>
-#include <net/if.h>
+#include <sys/file.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/if_ether.h>
+#include <arpa/inet.h>
 #include <netdb.h>
 
-#include "dhcp.h"
-
-#define DHCP_USER "_dhcp"
-#define DHCP_PORT "bootps"
-
-/* number of packets to try sending */
-#define DHCP_TRIES_MIN		1
-#define DHCP_TRIES_MAX		32
-#define DHCP_TRIES_DEFAULT	3
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
 
-/* how long between packet sends */
-#define DHCP_IVAL_MIN		1
-#define DHCP_IVAL_MAX		10
-#define DHCP_IVAL_DEFAULT	2
+#include "dhcp.h"
+#include "dhcping.h"
+
+/* how many times to check each target */
+#define DHCP_COUNT_MIN		1
+#define DHCP_COUNT_MAX		1000000
+#define DHCP_COUNT_DEFAULT	1
+
+/* benchmark duration, rate, and how many probes can be in flight */
+#define DHCP_BENCH_MIN		1
+#define DHCP_BENCH_MAX		3600
+#define DHCP_RATE_MIN		1
+#define DHCP_RATE_MAX		10000000
+#define DHCP_WINDOW_MIN		1
+#define DHCP_WINDOW_MAX		1048576
+#define DHCP_WINDOW_DEFAULT	256
+
+/* how often the benchmark paces out new probes in msec */
+#define DHCP_BENCH_TICK		1
+
+/* how many checks a verdict can be made from */
+#define DHCP_VERDICT_MAX	64
+
+/* how often monitor mode checks each target */
+#define DHCP_PERIOD_MIN		1
+#define DHCP_PERIOD_MAX		86400
+#define DHCP_PERIOD_DEFAULT	10
+
+/* limits on the metrics endpoint's clients */
+#define DHCP_HTTP_TIMEOUT	10
+#define DHCP_HTTP_HEADERS	8192
+
+/* -F records are written out once there's this much, or a second later */
+#define DHCP_OUTPUT_CHUNK	65536
+#define DHCP_OUTPUT_DELAY	1
+
+/* options that can be given to a target in a targets file */
+#define DHCP_FIELDS		16
+
+/* worker threads, and how much can be queued between them */
+#define DHCP_THREADS_MIN	1
+#define DHCP_THREADS_MAX	16
+#define DHCP_HANDOFF_SLOTS	32
+#define DHCP_RESULT_SLOTS	4096
+
+/* how often the thread reporter collects results in msec */
+#define DHCP_REPORT_TICK	10
+
+static const uint64_t dhcping_bounds[DHCPING_BUCKETS] = {	/* nsec */
+	250000, 500000, 1000000, 2500000, 5000000, 10000000,
+	25000000, 50000000, 100000000, 250000000, 500000000, 1000000000,
+};
 
-/* maximum wait time */
-#define DHCP_MAXWAIT_MIN	3
-#define DHCP_MAXWAIT_MAX	60
-#define DHCP_MAXWAIT_DEFAULT	8
+static const char *dhcping_ignores[DHCPING_I_MAX] = {
+	[DHCPING_I_SHORT] =	"short",
+	[DHCPING_I_OP] =	"not_bootreply",
+	[DHCPING_I_XID] =	"unknown_xid",
+	[DHCPING_I_OPTIONS] =	"malformed_options",
+	[DHCPING_I_OFFER] =	"not_offer",
+	[DHCPING_I_INCOMPLETE] = "incomplete_offer",
+	[DHCPING_I_ACK] =	"not_ack",
+	[DHCPING_I_HANDOFF] =	"handoff_full",
+};
 
 __dead static void
 usage(void)
 {
 	extern char *__progname;
 
-	fprintf(stderr, "usage: %s [-i interval] [-t tries] [-w wait]"
-	    " -h mac -s server\n", __progname);
+	fprintf(stderr, "usage: %s [-AadkTvx] [-B duration] [-C circuit] [-c count]"
+	    " [-E remote]\n"
+	    "\t[-F json | csv] [-f file] [-g giaddr] [-H delay | pN]"
+	    " [-i interval]\n"
+	    "\t[-j threads] [-K leases] [-L rate] [-M [address:]port]"
+	    " [-m type]\n"
+	    "\t[-O option=value] [-o option] [-P rate] [-p period] [-y prefix]\n"
+	    "\t[-l address] [-n window] [-R latency[:loss]] [-r rate]\n"
+	    "\t[-S seed] [-t tries] [-u user] [-V need/of[:rtt]] [-w wait]\n"
+	    "\t[-h mac ...] -s server ...\n",
+	    __progname);
 
 	exit(1);
 }
 
-struct dhcping {
-	uint8_t			packet[BOOTP_MIN_LEN];
-
-	int			s;
-	struct timeval		interval;
-	unsigned int		retries;
-	unsigned short		secs;
-
-	struct event		input;
-	struct event		retry;
-	struct event		maxwait;
-
-	unsigned int		verbose;
-};
-
-static void	dhcping_packet_init(struct dhcping *, int,
-		    const struct ether_addr *);
-
-static void	dhcping_maxwait(int, short, void *);
-static void	dhcping_retry(int, short, void *);
-static void	dhcping_input(int, short, void *);
-
-static struct dhcp_packet *
-dhcping_packet(struct dhcping *dhcping)
-{
-	return ((struct dhcp_packet *)dhcping->packet);
-}
-
-static int
-dhcping_bind_connect(int s, const struct addrinfo *lres, const char *remote,
-    const char **errstr)
-{
-	struct addrinfo *res, *res0;
-	int serrno;
-	int error;
-	struct addrinfo hints = {
-		.ai_family = lres->ai_family,
-		.ai_socktype = lres->ai_socktype,
-		.ai_protocol = lres->ai_protocol,
-	};
-
-	*errstr = NULL;
-
-	error = getaddrinfo(remote, DHCP_PORT, &hints, &res0);
-	if (error != 0) {
-		*errstr = gai_strerror(error);
-		return (-1);
-	}
-
-	error = -1;
-	for (res = res0; res != NULL; res = res->ai_next) {
-		if (connect(s, res->ai_addr, res->ai_addrlen) == -1) {
-			serrno = errno;
-			continue;
-		}
-
-		error = 0;
-		break;
-	}
-
-	if (error == -1)
-		*errstr = strerror(serrno);
+static int	dhcping_servers_add(struct dhcping *, const char *,
+		    const struct in_addr *, const struct dhcping_optset *,
+		    const struct ether_addr *, size_t);
+static void	dhcping_target_add(struct dhcping *, struct dhcping_server *,
+		    struct dhcping_template *, const struct ether_addr *);
+static int	dhcping_targets(struct dhcping *);
+
+static int	dhcping_mac_range(const char *, uint64_t *, uint64_t *);
+static void	dhcping_tally(struct dhcping_probe *);
+static void	dhcping_finish(struct dhcping_probe *, const struct timespec *);
+static void	dhcping_stats_add(struct dhcping_stats *, int,
+		    const struct timespec *);
+static void	dhcping_print_header(const struct dhcping *);
+static void	dhcping_print(const struct dhcping_probe *);
+static int	dhcping_exit(const struct dhcping *);
+static void	dhcping_report(struct dhcping *);
+static int	dhcping_stats_sum(struct dhcping_stats *, double *);
+
+static void	dhcping_output_init(struct dhcping *);
+static void	dhcping_output(struct dhcping *);
+static void	dhcping_output_timer(int, short, void *);
+static void	dhcping_output_flush(struct dhcping *);
+static void	dhcping_output_str(struct dhcping *, const char *);
+static void	dhcping_record(const struct dhcping_probe *);
+static const char *
+		dhcping_relay(const struct dhcping_server *);
+static void	dhcping_summary(struct dhcping *, const double *);
+
+static double	dhcping_trace_ms(const struct dhcping_probe *,
+		    const struct timespec *);
+static void	dhcping_trace_json(const struct dhcping_probe *);
+static void	dhcping_trace_print(const struct dhcping_probe *);
+
+static void	dhcping_bench(struct dhcping *);
+static void	dhcping_bench_pump(struct dhcping *);
+static void	dhcping_bench_tick(int, short, void *);
+static void	dhcping_bench_end(int, short, void *);
+static void	dhcping_bench_report(struct dhcping *);
+
+static uint32_t	dhcping_msec(const char *, uint32_t, uint32_t, const char **);
+
+static void	dhcping_shards_init(struct dhcping *, unsigned int);
+static void	dhcping_shards_start(struct dhcping *);
+static void	*dhcping_worker(void *);
+static void	dhcping_worker_done(struct dhcping_probe *);
+static void	dhcping_collect(int, short, void *);
+
+static void	dhcping_hedge(struct dhcping *);
+static void	dhcping_hedge_round(struct dhcping *);
+static void	dhcping_hedge_next(int, short, void *);
+static void	dhcping_hedge_delay(struct dhcping *, struct timeval *);
+static void	dhcping_hedge_done(struct dhcping_probe *,
+		    const struct timespec *);
+static void	dhcping_hedge_end(struct dhcping *, struct dhcping_probe *,
+		    const struct timespec *);
+
+static void	dhcping_verdict_targets(struct dhcping *);
+static void	dhcping_verdict_done(struct dhcping_probe *);
+static void	dhcping_verdict_end(struct dhcping *, int);
+
+static void	dhcping_monitor(struct dhcping *);
+static void	dhcping_monitor_add(struct dhcping *,
+		    const struct dhcping_target *);
+static void	dhcping_monitor_del(struct dhcping *, struct dhcping_probe *);
+static void	dhcping_monitor_check(int, short, void *);
+static void	dhcping_monitor_done(struct dhcping_probe *, int);
+static void	dhcping_reload(int, short, void *);
+static int	dhcping_reload_cmp(const void *, const void *);
+static struct dhcping_probe *
+		dhcping_reload_find(struct dhcping_probe **, size_t,
+		    const struct dhcping_target *);
+static void	dhcping_histogram_add(struct dhcping_histogram *,
+		    const struct timespec *);
+static int	dhcping_metrics_bind(const char *);
+static void	dhcping_metrics_accept(int, short, void *);
+static void	dhcping_metrics(struct dhcping *, struct evbuffer *);
+static void	dhcping_histogram_print(struct evbuffer *, const char *,
+		    const struct dhcping_server *,
+		    const struct dhcping_histogram *);
+static void	dhcping_http_read(struct bufferevent *, void *);
+static void	dhcping_http_write(struct bufferevent *, void *);
+static void	dhcping_http_error(struct bufferevent *, short, void *);
+static void	dhcping_http_reply(struct dhcping_http *);
+static void	dhcping_http_close(struct dhcping_http *);
+
+static void	dhcping_daemon(struct dhcping *);
+static void	dhcping_ctl_next(int, short, void *);
+static void	dhcping_ctl_read(struct bufferevent *, void *);
+static void	dhcping_ctl_error(struct bufferevent *, short, void *);
 
-	freeaddrinfo(res0);
-	return (error);
-}
 
+/*
+ * dhcping_bind leaves errno at 0 when the address itself is no good,
+ * otherwise errstr says which step on the socket failed.
+ */
 static int
-dhcping_connect(const char *local, const char *remote)
+dhcping_listen(const char *local, int reuseport)
 {
-	struct addrinfo *res, *res0;
-	int serrno;
-	int error;
+	const char *errstr;
 	int s;
-	const char *cause;
-	const char *errstr = NULL;
-	struct addrinfo hints = {
-		.ai_family = AF_INET,
-		.ai_socktype = SOCK_DGRAM,
-		.ai_flags = AI_PASSIVE,
-	};
-
-	error = getaddrinfo(local, DHCP_PORT, &hints, &res0);
-	if (error) {
-		errx(1, "local address %s: %s", (local == NULL) ? "*" : local,
-		    gai_strerror(error));
-	}
-
-	for (res = res0; res != NULL; res = res->ai_next) {
-		errstr = NULL;
-
-		s = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK,
-		    res->ai_protocol);
-		if (s == -1) {
-			serrno = errno;
-			cause = "socket";
-			continue;
-		}
 
-		if (bind(s, res->ai_addr, res->ai_addrlen) == -1) {
-			serrno = errno;
-			cause = "bind";
-			close(s);
-			s = -1;
-			continue;
-		}
-
-		if (dhcping_bind_connect(s, res, remote, &errstr) == -1) {
-			close(s);
-			s = -1;
-			continue;
+	s = dhcping_bind(local, reuseport, &errstr);
+	if (s == -1) {
+		if (errno == 0) {
+			errx(1, "local address %s: %s",
+			    (local == NULL) ? "*" : local, errstr);
 		}
-
-		break;  /* okay we got one */
-	}
-
-	if (errstr != NULL)
-		errx(1, "server %s: %s", remote, errstr);
-	else if (s == -1) {
-		errc(1, serrno, "local address %s port %s %s",
-		    (local == NULL) ? "*" : local, DHCP_PORT, cause);
+		err(1, "local address %s port %s %s",
+		    (local == NULL) ? "*" : local, DHCP_PORT, errstr);
 	}
 
-	freeaddrinfo(res0);
-
 	return (s);
 }
 
@@ -196,54 +250,333 @@ main(int argc, char *argv[])
 {
 	struct dhcping dhcping = {
 		.verbose = 0,
-		.interval = { .tv_sec = DHCP_IVAL_DEFAULT },
-		.retries = DHCP_TRIES_DEFAULT,
+		.interval = DHCP_IVAL_DEFAULT,
+		.wait = DHCP_MAXWAIT_DEFAULT,
+		.tries = DHCP_TRIES_DEFAULT,
+		.count = DHCP_COUNT_DEFAULT,
+		.xid_mask = 0xffffffff,
+		.period = { .tv_sec = DHCP_PERIOD_DEFAULT },
+		.bench = {
+			.window = DHCP_WINDOW_DEFAULT,
+		},
+		.s6 = -1,
+		.filedir = AT_FDCWD,
+		.done = dhcping_finish,
 	};
-	struct timeval maxwait = { .tv_sec = DHCP_MAXWAIT_DEFAULT };
 	const struct ether_addr *ea;
-	const char *mac = NULL;
-	const char *self = NULL;
-	const char *server = NULL;
+	struct ether_addr *macs = NULL;
+	size_t nmacs = 0;
+	const char **servers = NULL;
+	size_t nservers = 0;
+	const char *file = NULL;
+	const char *dir;
+	const char *metrics = NULL;
+	const char *leasefile = NULL;
 	const char *user = DHCP_USER;
 	const char *errstr;
+	int bits, code;
+	uint32_t rate;
+	struct in_addr relay;
+	struct dhcping_opt opt;
+	size_t raimax, circuitmax = 0, remotemax = 0;
+	struct dhcping_target *target;
+	struct dhcping_probe *probe;
 	struct passwd *pw;
+	struct sockaddr_in sin;
+	socklen_t sinlen = sizeof(sin);
+	struct timespec start;
+	size_t i;
+	unsigned int threads = 1;
+	int dflag = 0;
+	int Hflag = 0;
+	int Rflag = 0;
+	int Vflag = 0;
+	char *loss, *of, *rtt;
+	int tflag = 0;
+	int on = 1;
 	int ch;
 
-	while ((ch = getopt(argc, argv, "h:l:s:t:u:w:v")) != -1) {
+	TAILQ_INIT(&dhcping.servers);
+	TAILQ_INIT(&dhcping.templates);
+	TAILQ_INIT(&dhcping.optsets);
+	TAILQ_INIT(&dhcping.idle);
+	TAILQ_INIT(&dhcping.probes);
+	TAILQ_INIT(&dhcping.txq);
+
+	while ((ch = getopt(argc, argv, "AaB:C:c:dE:F:f:g:H:h:i:j:K:kL:l:"
+	    "M:m:n:O:o:P:p:R:r:S:s:Tt:u:V:w:vxy:")) != -1) {
 		switch (ch) {
+		case 'A':
+			dhcping.adaptive = 1;
+			break;
+		case 'a':
+			dhcping.dora = 1;
+			break;
+		case 'B': /* benchmark duration */
+			dhcping.bench.duration.tv_sec = strtonum(optarg,
+			    DHCP_BENCH_MIN, DHCP_BENCH_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "duration %s s: %s", optarg, errstr);
+			break;
+		case 'C': /* relay agent circuit id */
+			if (dhcping_rai_parse(optarg, &raimax) == -1)
+				errx(1, "invalid circuit id %s", optarg);
+			circuitmax = MAX(circuitmax, raimax);
+
+			dhcping.circuits = reallocarray(dhcping.circuits,
+			    dhcping.ncircuits + 1, sizeof(*dhcping.circuits));
+			if (dhcping.circuits == NULL)
+				err(1, "circuit ids");
+			dhcping.circuits[dhcping.ncircuits++] = optarg;
+			break;
+		case 'c':
+			dhcping.count = strtonum(optarg,
+			    DHCP_COUNT_MIN, DHCP_COUNT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "count %s: %s", optarg, errstr);
+			break;
+		case 'd':
+			dflag = 1;
+			break;
+		case 'E': /* relay agent remote id */
+			if (dhcping_rai_parse(optarg, &raimax) == -1)
+				errx(1, "invalid remote id %s", optarg);
+			remotemax = MAX(remotemax, raimax);
+
+			dhcping.remotes = reallocarray(dhcping.remotes,
+			    dhcping.nremotes + 1, sizeof(*dhcping.remotes));
+			if (dhcping.remotes == NULL)
+				err(1, "remote ids");
+			dhcping.remotes[dhcping.nremotes++] = optarg;
+			break;
+		case 'F': /* output format */
+			if (strcasecmp(optarg, "json") == 0)
+				dhcping.format = DHCPING_F_JSON;
+			else if (strcasecmp(optarg, "csv") == 0)
+				dhcping.format = DHCPING_F_CSV;
+			else
+				errx(1, "unknown output format %s", optarg);
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'g': /* relay address to send as */
+			if (inet_pton(AF_INET, optarg, &relay) != 1)
+				errx(1, "invalid giaddr %s", optarg);
+
+			dhcping.relays = reallocarray(dhcping.relays,
+			    dhcping.nrelays + 1, sizeof(*dhcping.relays));
+			if (dhcping.relays == NULL)
+				err(1, "relays");
+			dhcping.relays[dhcping.nrelays++] = relay;
+			dhcping.raw = 1;
+			break;
+		case 'H': /* hedge delay, or an rtt percentile */
+			if (optarg[0] == 'p') {
+				dhcping.hedge_pct = strtonum(optarg + 1,
+				    1, 100, &errstr);
+			} else {
+				dhcping.hedge = dhcping_msec(optarg,
+				    DHCP_IVAL_MIN, DHCP_IVAL_MAX, &errstr);
+			}
+			if (errstr != NULL)
+				errx(1, "hedge %s: %s", optarg, errstr);
+			Hflag = 1;
+			break;
 		case 'h':
-			mac = optarg;
+			/* benchmarks can take a range of macs instead */
+			if (strpbrk(optarg, "-/") != NULL) {
+				if (dhcping.bench.range)
+					errx(1, "only one mac range can be used");
+				if (dhcping_mac_range(optarg,
+				    &dhcping.bench.base,
+				    &dhcping.bench.size) == -1)
+					errx(1, "invalid mac range %s", optarg);
+				dhcping.bench.range = 1;
+				break;
+			}
+
+			ea = ether_aton(optarg);
+			if (ea == NULL)
+				errx(1, "invalid mac %s", optarg);
+
+			macs = reallocarray(macs, nmacs + 1, sizeof(*macs));
+			if (macs == NULL)
+				err(1, "macs");
+			macs[nmacs++] = *ea;
 			break;
 		case 'i': /* interval between tries */
-			dhcping.interval.tv_sec = strtonum(optarg,
+			dhcping.interval = dhcping_msec(optarg,
 			    DHCP_IVAL_MIN, DHCP_IVAL_MAX, &errstr);
 			if (errstr != NULL)
-				errx(1, "interval %s s: %s", optarg, errstr);
+				errx(1, "interval %s: %s", optarg, errstr);
+			break;
+		case 'j': /* worker threads */
+			threads = strtonum(optarg,
+			    DHCP_THREADS_MIN, DHCP_THREADS_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "threads %s: %s", optarg, errstr);
+			break;
+		case 'K': /* where to keep leases */
+			leasefile = optarg;
+			dhcping.keep = 1;
+			break;
+		case 'k':
+			dhcping.keep = 1;
 			break;
 		case 'l':
-			self = optarg;
+			dhcping.local = optarg;
+			break;
+		case 'M': /* metrics listener */
+			metrics = optarg;
+			break;
+		case 'm': /* required message type */
+			dhcping.type = dhcping_type_parse(optarg);
+			if (dhcping.type == -1)
+				errx(1, "unknown message type %s", optarg);
+			break;
+		case 'O': /* option to send */
+			if (dhcping_opt_parse(optarg, &opt) == -1)
+				errx(1, "invalid option %s", optarg);
+
+			dhcping.opts = reallocarray(dhcping.opts,
+			    dhcping.nopts + 1, sizeof(*dhcping.opts));
+			if (dhcping.opts == NULL)
+				err(1, "options");
+			dhcping.opts[dhcping.nopts++] = opt;
+			break;
+		case 'o': /* required option */
+			code = dhcping_option_parse(optarg);
+			if (code == -1)
+				errx(1, "unknown option %s", optarg);
+
+			dhcping.required = reallocarray(dhcping.required,
+			    dhcping.nrequired + 1, sizeof(*dhcping.required));
+			if (dhcping.required == NULL)
+				err(1, "required options");
+			dhcping.required[dhcping.nrequired++] = code;
+			break;
+		case 'n': /* probes in flight */
+			dhcping.bench.window = strtonum(optarg,
+			    DHCP_WINDOW_MIN, DHCP_WINDOW_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "window %s: %s", optarg, errstr);
+			break;
+		case 'p': /* monitor period */
+			dhcping.period.tv_sec = strtonum(optarg,
+			    DHCP_PERIOD_MIN, DHCP_PERIOD_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "period %s s: %s", optarg, errstr);
+			break;
+		case 'L': /* packets per second to all servers */
+			rate = strtonum(optarg, DHCP_RATE_MIN, DHCP_RATE_MAX,
+			    &errstr);
+			if (errstr != NULL)
+				errx(1, "rate %s: %s", optarg, errstr);
+			dhcping_limit_init(&dhcping.limit, rate);
+			break;
+		case 'P': /* packets per second to each server */
+			dhcping.server_rate = strtonum(optarg,
+			    DHCP_RATE_MIN, DHCP_RATE_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "rate %s: %s", optarg, errstr);
+			break;
+		case 'R': /* answer requests after latency[:loss%] */
+			loss = strchr(optarg, ':');
+			if (loss != NULL)
+				*loss++ = '\0';
+			dhcping.respond.latency = dhcping_msec(optarg,
+			    0, DHCP_MAXWAIT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "latency %s: %s", optarg, errstr);
+			if (loss != NULL) {
+				dhcping.respond.loss = strtonum(loss, 0, 100,
+				    &errstr);
+				if (errstr != NULL)
+					errx(1, "loss %s%%: %s", loss, errstr);
+			}
+			Rflag = 1;
+			break;
+		case 'S': /* shuffle the macs and xids reproducibly */
+			dhcping.bench.key = strtonum(optarg, 0, UINT32_MAX,
+			    &errstr);
+			if (errstr != NULL)
+				errx(1, "seed %s: %s", optarg, errstr);
+			dhcping.bench.shuffle = 1;
+			break;
+		case 'r': /* probes per second */
+			dhcping.bench.rate = strtonum(optarg,
+			    DHCP_RATE_MIN, DHCP_RATE_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "rate %s: %s", optarg, errstr);
+			break;
+		case 'T': /* time each step of every check */
+			dhcping.trace = 1;
 			break;
 		case 't': /* number of tries */
-			dhcping.retries = strtonum(optarg,
+			dhcping.tries = strtonum(optarg,
 			    DHCP_TRIES_MIN, DHCP_TRIES_MAX, &errstr);
 			if (errstr != NULL)
 				errx(1, "tries %s: %s", optarg, errstr);
+			tflag = 1;
 			break;
 		case 's':
-			server = optarg;
+			servers = reallocarray(servers, nservers + 1,
+			    sizeof(*servers));
+			if (servers == NULL)
+				err(1, "servers");
+			servers[nservers++] = optarg;
 			break;
 		case 'u':
 			user = optarg;
 			break;
+		case 'V': /* healthy once need of the checks are up */
+			rtt = strchr(optarg, ':');
+			if (rtt != NULL)
+				*rtt++ = '\0';
+			of = strchr(optarg, '/');
+			if (of == NULL)
+				errx(1, "verdict %s: needs a count of checks", optarg);
+			*of++ = '\0';
+			dhcping.verdict_of = strtonum(of, 1, DHCP_VERDICT_MAX,
+			    &errstr);
+			if (errstr != NULL)
+				errx(1, "verdict of %s checks: %s", of, errstr);
+			dhcping.verdict_need = strtonum(optarg,
+			    1, dhcping.verdict_of, &errstr);
+			if (errstr != NULL)
+				errx(1, "verdict needing %s: %s", optarg, errstr);
+			if (rtt != NULL) {
+				dhcping.verdict_rtt = dhcping_msec(rtt,
+				    1, DHCP_MAXWAIT_MAX, &errstr);
+				if (errstr != NULL)
+					errx(1, "verdict rtt %s: %s", rtt, errstr);
+			}
+			Vflag = 1;
+			break;
 		case 'w': /* maximum wait time */
-			maxwait.tv_sec = strtonum(optarg,
+			dhcping.wait = dhcping_msec(optarg,
 			    DHCP_MAXWAIT_MIN, DHCP_MAXWAIT_MAX, &errstr);
 			if (errstr != NULL)
-				errx(1, "wait %s s: %s", optarg, errstr);
+				errx(1, "wait %s: %s", optarg, errstr);
 			break;
 		case 'v':
 			dhcping.verbose = 1;
 			break;
+		case 'x':
+			dhcping.release = 1;
+			break;
+		case 'y': /* prefix the offered address must be in */
+			bits = inet_net_pton(AF_INET, optarg, &dhcping.net,
+			    sizeof(dhcping.net));
+			if (bits == -1)
+				errx(1, "invalid prefix %s", optarg);
+
+			dhcping.mask.s_addr = bits == 0 ? 0 :
+			    htonl(0xffffffffU << (32 - bits));
+			dhcping.net.s_addr &= dhcping.mask.s_addr;
+			dhcping.net_set = 1;
+			break;
 		default:
 			usage();
 			/* NOTREACHED */
@@ -253,195 +586,2578 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
-	if (argc > 0 || mac == NULL || server == NULL) {
+	if (dflag + timerisset(&dhcping.bench.duration) +
+	    (metrics != NULL) + Hflag + Rflag + Vflag > 1)
 		usage();
+	if (dhcping.release && !dhcping.dora)
+		errx(1, "releasing a lease requires -a");
+	if (dhcping.keep && !dhcping.dora)
+		errx(1, "keeping a lease requires -a");
+	if (dhcping.keep && dhcping.release)
+		errx(1, "a lease can't be both kept and released");
+	if (dhcping.type != 0 && dhcping.dora)
+		errx(1, "-a already requires an OFFER and an ACK");
+	if (dflag)
+		dhcping.mode = DHCPING_M_DAEMON;
+	else if (timerisset(&dhcping.bench.duration))
+		dhcping.mode = DHCPING_M_BENCH;
+	else if (metrics != NULL)
+		dhcping.mode = DHCPING_M_MONITOR;
+	else if (Hflag)
+		dhcping.mode = DHCPING_M_HEDGE;
+	else if (Rflag)
+		dhcping.mode = DHCPING_M_RESPOND;
+	else if (Vflag)
+		dhcping.mode = DHCPING_M_VERDICT;
+	if (dhcping.bench.range && dhcping.mode != DHCPING_M_BENCH)
+		errx(1, "mac ranges are only for benchmarks");
+	if (dhcping.keep && dhcping.mode != DHCPING_M_CHECK &&
+	    dhcping.mode != DHCPING_M_MONITOR)
+		errx(1, "leases are only kept by checks and monitor mode");
+
+	if (dhcping.mode == DHCPING_M_RESPOND) {
+		if (nservers > 0 || file != NULL)
+			errx(1, "-R answers requests, it doesn't send them");
+		if (dhcping.raw)
+			errx(1, "-R answers from a bound socket, not as -g");
+		if (dhcping.local == NULL)
+			errx(1, "-R needs a -l address to answer from");
 	}
-
-	if (dhcping.retries * dhcping.interval.tv_sec > maxwait.tv_sec) {
-		errx(1, "tries %u by interval %lld s > wait %lld s",
-		    dhcping.retries, dhcping.interval.tv_sec, maxwait.tv_sec);
+	if (argc > 0 || (nservers == 0 && file == NULL &&
+	    dhcping.mode != DHCPING_M_RESPOND) ||
+	    (nservers > 0 && nmacs == 0 && (dhcping.mode == DHCPING_M_CHECK ||
+	    dhcping.mode == DHCPING_M_MONITOR ||
+	    dhcping.mode == DHCPING_M_HEDGE ||
+	    dhcping.mode == DHCPING_M_VERDICT))) {
+		usage();
+	}
+	if (dhcping.mode == DHCPING_M_MONITOR && dhcping.count > 1)
+		errx(1, "monitor mode checks forever");
+	if (dhcping.mode == DHCPING_M_VERDICT && dhcping.count > 1)
+		errx(1, "a verdict is already made from more than one check");
+	if (dhcping.mode == DHCPING_M_DAEMON &&
+	    dhcping.format != DHCPING_F_TABLE)
+		errx(1, "the daemon already answers in its own format");
+	if (threads > 1 && dhcping.mode != DHCPING_M_CHECK)
+		errx(1, "only normal checks can be split between threads");
+	if (dhcping.trace && threads > 1)
+		errx(1, "traces aren't passed back from other threads");
+	if (dhcping.trace && dhcping.format == DHCPING_F_CSV)
+		errx(1, "traces don't fit in CSV, use -F json");
+	/* both sub-options have to fit in the one option */
+	raimax = (dhcping.ncircuits > 0 ? 2 + circuitmax : 0) +
+	    (dhcping.nremotes > 0 ? 2 + remotemax : 0);
+	if (raimax > DHCP_OPTION_MAXLEN)
+		errx(1, "circuit and remote ids are too long");
+	if (raimax > 0)
+		dhcping.railen = 2 + raimax;
+	dhcping.optset = dhcping_optset_get(&dhcping, NULL, 0);
+	if (dhcping.optset == NULL) {
+		/* error printed by dhcping_optset_get */
+		exit(1);
+	}
+	if (dhcping.raw && threads > 1)
+		errx(1, "raw sockets can't be split between threads");
+	if (dhcping.raw && dhcping.local != NULL)
+		errx(1, "-g sends from raw sockets, there's nothing to bind");
+
+	/* loss is only meaningful if a benchmark sends each probe once */
+	if (dhcping.mode == DHCPING_M_BENCH && !tflag)
+		dhcping.tries = 1;
+
+	/* backing off can take as long as it likes, maxwait stops it */
+	if (!dhcping.adaptive &&
+	    dhcping.tries * dhcping.interval > dhcping.wait) {
+		errx(1, "tries %u by interval %u ms > wait %u ms",
+		    dhcping.tries, dhcping.interval, dhcping.wait);
 	}
 
-	ea = ether_aton(mac);
-	if (ea == NULL)
-		errx(1, "invalid mac %s", mac);
+	/*
+	 * The daemon uses the first -h mac when a check doesn't name one,
+	 * and the benchmark counts up from it.
+	 */
+	if (nmacs > 0) {
+		dhcping.ea = macs[0];
+		dhcping.ea_set = 1;
+	}
+	dhcping.xid_key = dhcping.bench.shuffle ?
+	    dhcping.bench.key : arc4random();
 
 	pw = getpwnam(user);
 	if (pw == NULL)
 		errx(1, "no %s user", DHCP_USER);
 
-	dhcping.s = dhcping_connect(self, server);
-	/* error printed by dhcping_connect */
+	dhcping.base = event_init();
+
+	/*
+	 * The daemon and monitor mode run for long enough that server
+	 * names are worth looking up again, and the resolver has to read
+	 * resolv.conf before the chroot. The bpf interface was picked for
+	 * the addresses the servers had, so they stay put with -g.
+	 */
+	if ((dhcping.mode == DHCPING_M_DAEMON ||
+	    dhcping.mode == DHCPING_M_MONITOR) && !dhcping.raw) {
+		if (evdns_init() == 0)
+			dhcping.dns = 1;
+		else
+			warnx("resolver: server names can't be looked up again");
+	}
+
+	if (!dhcping.raw) {
+		if (clock_gettime(CLOCK_MONOTONIC, &start) == -1)
+			err(1, "clock_gettime");
+		dhcping.s = dhcping_listen(dhcping.local, threads > 1);
+		/* error printed by dhcping_listen */
+		dhcping_took(&start, &dhcping.bind);
+		DHCPING_USDT2(bind, dhcping.local == NULL ? "*" : dhcping.local,
+		    dhcping_ns(&dhcping.bind));
+		dhcping.rs = dhcping.s;
+
+		if (getsockname(dhcping.s, (struct sockaddr *)&sin,
+		    &sinlen) == -1)
+			err(1, "getsockname");
+		if (sin.sin_family != AF_INET)
+			errx(1, "unexpected sockname af %d", sin.sin_family);
+		dhcping.laddr = sin.sin_addr;
+
+#ifdef SO_TIMESTAMP
+		/* let the kernel say when replies actually arrived */
+		if (setsockopt(dhcping.s, SOL_SOCKET, SO_TIMESTAMP,
+		    &on, sizeof(on)) == -1)
+			err(1, "timestamps");
+#endif
+	}
+
+	/* names have to be resolved before the chroot */
+	for (i = 0; i < nservers; i++) {
+		if (dhcping_servers_add(&dhcping, servers[i], NULL,
+		    dhcping.optset, macs, nmacs) == -1) {
+			/* error printed by dhcping_servers_add */
+			exit(1);
+		}
+	}
+
+	if (file != NULL) {
+		dhcping.file = dhcping.filename = file;
+
+		/* monitor mode can read it again from inside the chroot */
+		if (dhcping.mode == DHCPING_M_MONITOR) {
+			dhcping.filename = strrchr(file, '/');
+			if (dhcping.filename == NULL) {
+				dir = ".";
+				dhcping.filename = file;
+			} else {
+				dir = dhcping.filename == file ? "/" :
+				    strndup(file, dhcping.filename - file);
+				if (dir == NULL)
+					err(1, "%s", file);
+				dhcping.filename++;
+			}
+
+			dhcping.filedir = open(dir,
+			    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (dhcping.filedir == -1)
+				err(1, "%s", dir);
+		}
+
+		if (dhcping_targets(&dhcping) == -1) {
+			/* error printed by dhcping_targets */
+			exit(1);
+		}
+	}
+
+	if (dhcping.mode == DHCPING_M_VERDICT)
+		dhcping_verdict_targets(&dhcping);
+
+	/* the bpf interface depends on where the servers are */
+	if (dhcping.raw)
+		dhcping_raw_open(&dhcping);
+
+	dhcping_pacing(dhcping.s, dhcping.limit.rate);
+
+	if (metrics != NULL)
+		dhcping.ms = dhcping_metrics_bind(metrics);
+		/* error printed by dhcping_metrics_bind */
+
+	switch (dhcping.mode) {
+	case DHCPING_M_CHECK:
+	case DHCPING_M_MONITOR:
+	case DHCPING_M_HEDGE:
+	case DHCPING_M_VERDICT:
+		if (dhcping.ntargets == 0)
+			errx(1, "no targets to check");
+		if (dhcping_pool_init(&dhcping, dhcping.ntargets) == -1)
+			err(1, "probe pool");
+		break;
+	case DHCPING_M_DAEMON:
+		/* the daemon only runs one check at a time */
+		if (dhcping_pool_init(&dhcping, 1) == -1)
+			err(1, "probe pool");
+		break;
+	case DHCPING_M_BENCH:
+		if (dhcping_pool_init(&dhcping, dhcping.bench.window) == -1)
+			err(1, "probe pool");
+		break;
+	case DHCPING_M_RESPOND:
+		/* there's nothing to probe */
+		break;
+	}
+
+	for (i = 0; i < dhcping.ntargets; i++) {
+		target = &dhcping.targets[i];
+		probe = dhcping_probe_get(&dhcping, target->server,
+		    &target->ea);
+		probe->tmpl = target->tmpl;
+		probe->period = target->period;
+		probe->file = target->file;
+
+		probe->index = dhcping.nindex++;
+		TAILQ_INSERT_TAIL(&dhcping.probes, probe, entry);
+		dhcping.nprobes++;
+	}
+	free(dhcping.targets);
+	dhcping.targets = NULL;
+	dhcping.ntargets = 0;
+
+	if (leasefile != NULL)
+		dhcping_leases_init(&dhcping, leasefile);
+
+	dhcping.table = dhcping.format == DHCPING_F_TABLE &&
+	    ((dhcping.mode == DHCPING_M_CHECK &&
+	    (dhcping.nprobes > 1 || dhcping.count > 1)) ||
+	    dhcping.mode == DHCPING_M_HEDGE ||
+	    dhcping.mode == DHCPING_M_VERDICT);
+
+	/* the workers need their sockets bound before the chroot too */
+	if (threads > 1 && dhcping.nprobes > 1)
+		dhcping_shards_init(&dhcping, MIN(threads, dhcping.nprobes));
 
 	if (chroot(pw->pw_dir) == -1)
 		err(1, "chroot %s", pw->pw_dir);
 	if (chdir("/") == -1)
 		err(1, "chdir %s", pw->pw_dir);
+	/* there's no resolv.conf in here, and lookups would block */
+	dhcping.numeric = 1;
 
 	if (setgroups(1, &pw->pw_gid) ||
 	    setresgid(pw->pw_gid, pw->pw_gid, pw->pw_gid) ||
 	    setresuid(pw->pw_uid, pw->pw_uid, pw->pw_uid))
 		errx(1, "can't drop privileges");
 
-	dhcping_packet_init(&dhcping, dhcping.s, ea);
+	/* with workers this thread only reports */
+	if (dhcping.shards == NULL) {
+		if (dhcping_hash_init(&dhcping, dhcping.poolsize) == -1)
+			err(1, "hash");
+		if (dhcping_wheel_init(&dhcping) == -1)
+			err(1, "timer wheel");
+		if (dhcping_io_init(&dhcping) == -1)
+			err(1, "receive ring");
+		if (dhcping.mode != DHCPING_M_RESPOND)
+			dhcping_events(&dhcping);
+	}
+
+	if (dhcping.format != DHCPING_F_TABLE)
+		dhcping_output_init(&dhcping);
 
-	event_init();
+	switch (dhcping.mode) {
+	case DHCPING_M_CHECK:
+		if (dhcping.table)
+			dhcping_print_header(&dhcping);
 
-	event_set(&dhcping.input, dhcping.s, EV_READ|EV_PERSIST,
-	    dhcping_input, &dhcping);
+		/* results are printed as they come in when repeating */
+		if (dhcping.table && dhcping.count > 1)
+			setvbuf(stdout, NULL, _IOLBF, 0);
 
-	evtimer_set(&dhcping.maxwait, dhcping_maxwait, &dhcping);
-	evtimer_set(&dhcping.retry, dhcping_retry, &dhcping);
+		if (dhcping.shards != NULL) {
+			dhcping_shards_start(&dhcping);
+			break;
+		}
+
+		TAILQ_FOREACH(probe, &dhcping.probes, entry)
+			dhcping_check(probe);
+		break;
+	case DHCPING_M_DAEMON:
+		dhcping_daemon(&dhcping);
+		break;
+	case DHCPING_M_BENCH:
+		dhcping_bench(&dhcping);
+		break;
+	case DHCPING_M_MONITOR:
+		dhcping_monitor(&dhcping);
+		break;
+	case DHCPING_M_HEDGE:
+		if (dhcping.table) {
+			dhcping_print_header(&dhcping);
+			setvbuf(stdout, NULL, _IOLBF, 0);
+		}
+		dhcping_hedge(&dhcping);
+		break;
+	case DHCPING_M_VERDICT:
+		if (dhcping.table)
+			dhcping_print_header(&dhcping);
 
-	event_add(&dhcping.input, NULL);
-	evtimer_add(&dhcping.maxwait, &maxwait);
-	dhcping_retry(0, EV_TIMEOUT, &dhcping);
+		TAILQ_FOREACH(probe, &dhcping.probes, entry)
+			dhcping_check(probe);
+		break;
+	case DHCPING_M_RESPOND:
+		dhcping_respond(&dhcping);
+		break;
+	}
 
 	event_dispatch();
 
 	return (0);
 }
 
-static const uint8_t dhcping_requested[] = {
-	DHO_SUBNET_MASK,
-	DHO_BROADCAST_ADDRESS,
-	DHO_TIME_OFFSET,
-	DHO_CLASSLESS_STATIC_ROUTES,
-	DHO_ROUTERS,
-	DHO_DOMAIN_NAME,
-	DHO_DOMAIN_SEARCH,
-	DHO_DOMAIN_NAME_SERVERS,
-	DHO_HOST_NAME,
-	DHO_BOOTFILE_NAME,
-	DHO_TFTP_SERVER,
-};
+/*
+ * Add a server from each of the -g relays, or from the address the
+ * kernel picks if there aren't any, and a target for each mac.
+ */
+static int
+dhcping_servers_add(struct dhcping *dhcping, const char *name,
+    const struct in_addr *giaddr, const struct dhcping_optset *optset,
+    const struct ether_addr *macs, size_t nmacs)
+{
+	struct dhcping_server *server;
+	struct dhcping_template *tmpl;
+	const char *errstr;
+	size_t i, j;
+
+	for (i = 0; i < MAX(dhcping->nrelays, 1); i++) {
+		if (giaddr == NULL && dhcping->nrelays > 0)
+			server = dhcping_server_get(dhcping, name,
+			    &dhcping->relays[i], &errstr);
+		else {
+			server = dhcping_server_get(dhcping, name, giaddr,
+			    &errstr);
+		}
+		if (server == NULL) {
+			warnx("server %s: %s", name, errstr);
+			return (-1);
+		}
+
+		if (server->af == AF_INET6 && optset != dhcping->optset) {
+			warnx("server %s: DHCPv6 checks don't take options",
+			    name);
+			return (-1);
+		}
+
+		if (dhcping->mode != DHCPING_M_DAEMON &&
+		    dhcping->mode != DHCPING_M_BENCH) {
+			if (server->af == AF_INET6)
+				tmpl = server->tmpl;
+			else {
+				tmpl = dhcping_template_get(dhcping,
+				    server->giaddr, optset);
+			}
+			if (tmpl == NULL)
+				err(1, "template");
+			for (j = 0; j < nmacs; j++) {
+				dhcping_target_add(dhcping, server, tmpl,
+				    &macs[j]);
+			}
+		}
+
+		/* a server with its own relay is only added once */
+		if (giaddr != NULL)
+			break;
+	}
+
+	return (0);
+}
 
 static void
-dhcping_packet_init(struct dhcping *dhcping, int s, const struct ether_addr *ea)
+dhcping_target_add(struct dhcping *dhcping, struct dhcping_server *server,
+    struct dhcping_template *tmpl, const struct ether_addr *ea)
 {
-	static const uint8_t cookie[DHCP_OPTIONS_COOKIE_LEN] =
-	    DHCP_OPTIONS_COOKIE;
-	struct dhcp_packet *p = dhcping_packet(dhcping);
-	struct sockaddr_in sin;
-	socklen_t sinlen = sizeof(sin);
-	uint8_t *dho;
+	struct dhcping_target *target;
+
+	dhcping->targets = reallocarray(dhcping->targets,
+	    dhcping->ntargets + 1, sizeof(*dhcping->targets));
+	if (dhcping->targets == NULL)
+		err(1, "targets");
+
+	target = &dhcping->targets[dhcping->ntargets++];
+	target->server = server;
+	target->tmpl = tmpl;
+	target->ea = *ea;
+	target->period = dhcping->period.tv_sec * 1000;
+	target->file = 0;
+}
+
+/*
+ * A targets file has a server and a mac address on each line, and
+ * optionally the relay address to check the server from. Fields like
+ * -O arguments add to the options sent to that target, and period=
+ * sets how often monitor mode checks it. Blank lines and everything
+ * after a # are ignored.
+ */
+static int
+dhcping_targets(struct dhcping *dhcping)
+{
+	const char *file = dhcping->file;
+	const struct ether_addr *ea;
+	struct in_addr giaddr;
+	struct dhcping_opt opts[DHCP_FIELDS];
+	const struct dhcping_optset *optset;
+	FILE *f;
+	int fd;
+	char *line = NULL;
+	size_t linesize = 0;
+	size_t lineno = 0;
+	char *s, *word;
+	char *words[3];
+	size_t i, n, nopts, ntargets;
+	uint32_t period;
+	const char *errstr;
+	int rv = -1;
+
+	fd = openat(dhcping->filedir, dhcping->filename, O_RDONLY | O_CLOEXEC);
+	if (fd == -1 || (f = fdopen(fd, "r")) == NULL) {
+		warn("%s", file);
+		if (fd != -1)
+			close(fd);
+		return (-1);
+	}
+
+	while (getline(&line, &linesize, f) != -1) {
+		lineno++;
+
+		line[strcspn(line, "#\n")] = '\0';
+
+		n = nopts = 0;
+		period = dhcping->period.tv_sec * 1000;
+		s = line;
+		while ((word = strsep(&s, " \t\r")) != NULL) {
+			if (*word == '\0')
+				continue;
+			if (strncmp(word, "period=", 7) == 0) {
+				period = strtonum(word + 7, DHCP_PERIOD_MIN,
+				    DHCP_PERIOD_MAX, &errstr) * 1000;
+				if (errstr != NULL) {
+					warnx("%s:%zu: period %s s: %s", file,
+					    lineno, word + 7, errstr);
+					goto done;
+				}
+				continue;
+			}
+			if (strchr(word, '=') != NULL) {
+				if (nopts == sizeof(opts) / sizeof(opts[0])) {
+					warnx("%s:%zu: too many options",
+					    file, lineno);
+					goto done;
+				}
+				if (dhcping_opt_parse(word,
+				    &opts[nopts++]) == -1) {
+					warnx("%s:%zu: invalid option %s",
+					    file, lineno, word);
+					goto done;
+				}
+				continue;
+			}
+			if (n == sizeof(words) / sizeof(words[0])) {
+				warnx("%s:%zu: too many fields", file, lineno);
+				goto done;
+			}
+			words[n++] = word;
+		}
+
+		if (n == 0)
+			continue;
+		if (n == 1) {
+			warnx("%s:%zu: missing mac", file, lineno);
+			goto done;
+		}
 
-	if (getsockname(s, (struct sockaddr *)&sin, &sinlen) == -1)
-		err(1, "getsockname");
-	if (sin.sin_family != AF_INET)
-		errx(1, "unexpected sockname af %d", sin.sin_family);
+		ea = ether_aton(words[1]);
+		if (ea == NULL) {
+			warnx("%s:%zu: invalid mac %s", file, lineno,
+			    words[1]);
+			goto done;
+		}
+
+		if (n == 3) {
+			if (!dhcping->raw) {
+				warnx("%s:%zu: relay addresses need -g",
+				    file, lineno);
+				goto done;
+			}
+			if (inet_pton(AF_INET, words[2], &giaddr) != 1) {
+				warnx("%s:%zu: invalid giaddr %s", file,
+				    lineno, words[2]);
+				goto done;
+			}
+		}
+
+		optset = nopts == 0 ? dhcping->optset :
+		    dhcping_optset_get(dhcping, opts, nopts);
+		if (optset == NULL) {
+			warnx("%s:%zu: invalid options", file, lineno);
+			goto done;
+		}
+
+		ntargets = dhcping->ntargets;
+		if (dhcping_servers_add(dhcping, words[0],
+		    n == 3 ? &giaddr : NULL, optset, ea, 1) == -1) {
+			warnx("%s:%zu: invalid server", file, lineno);
+			goto done;
+		}
+
+		for (i = ntargets; i < dhcping->ntargets; i++) {
+			dhcping->targets[i].period = period;
+			dhcping->targets[i].file = 1;
+		}
+	}
+	if (ferror(f)) {
+		warn("%s", file);
+		goto done;
+	}
+
+	rv = 0;
+done:
+	free(line);
+	fclose(f);
 
-	p->op = BOOTREQUEST;
-	p->htype = HTYPE_ETHER;
-	p->hlen = sizeof(*ea);
-	p->hops = 1;
-	p->xid = htonl(getpid());
-	p->secs = 0;
-	p->flags = 0;
-	p->giaddr = sin.sin_addr;
-	memcpy(p->chaddr, ea, sizeof(*ea));
-	memcpy(p->cookie, cookie, sizeof(cookie));
+	return (rv);
+}
 
-	dho = (uint8_t *)(p + 1);
+/*
+ * Times are seconds like they always were, unless they're given in
+ * milliseconds with an "ms" suffix.
+ */
+static uint32_t
+dhcping_msec(const char *arg, uint32_t min, uint32_t max,
+    const char **errstr)
+{
+	char buf[32];
+	size_t len;
+	uint32_t scale = 1000;
+	long long v;
+
+	if (strlcpy(buf, arg, sizeof(buf)) >= sizeof(buf)) {
+		*errstr = "too long";
+		return (0);
+	}
 
-	*dho++ = DHO_DHCP_MESSAGE_TYPE;
-	*dho++ = 1;
-	*dho++ = DHCPDISCOVER;
+	len = strlen(buf);
+	if (len > 2 && strcmp(buf + len - 2, "ms") == 0) {
+		buf[len - 2] = '\0';
+		scale = 1;
+	} else if (len > 1 && buf[len - 1] == 's')
+		buf[len - 1] = '\0';
 
-	*dho++ = DHO_DHCP_PARAMETER_REQUEST_LIST;
-	*dho++ = sizeof(dhcping_requested);
-	memcpy(dho, dhcping_requested, sizeof(dhcping_requested));
-	dho += sizeof(dhcping_requested);
+	v = strtonum(buf, (min + scale - 1) / scale, max / scale, errstr);
 
-	*dho++ = DHO_END;
+	return (v * scale);
 }
 
+/*
+ * The one shot mode gives the result to relayd via the exit code once
+ * every probe is done, the daemon prints a line.
+ */
 static void
-dhcping_input(int s, short revents, void *arg)
+dhcping_finish(struct dhcping_probe *probe, const struct timespec *reply)
 {
-	struct dhcping *dhcping = arg;
-	struct dhcp_packet *p = dhcping_packet(dhcping);
-	struct dhcp_packet reply;
-	ssize_t rv;
+	static const struct timeval now = { 0, 0 };
+	struct dhcping *dhcping = probe->dhcping;
+	enum dhcping_state state = probe->state;
+	int dora;
+
+	/* nothing else can be checked once the socket itself is gone */
+	if (dhcping->error != 0) {
+		errc(1, probe->error, "%s %s", probe->server->name,
+		    probe->cause);
+	}
 
-	rv = read(s, &reply, sizeof(reply));
-	if (rv == -1) {
-		switch (errno) {
-		case EAGAIN:
-		case EINTR:
-			return; /* try again later */
-		default:
-			break;
-		}
-		err(1, "input");
+	/* otherwise it's just this check that couldn't be made */
+	if (probe->error != 0 && probe == dhcping->ctl_probe) {
+		printf("error %s: %s\n", probe->cause,
+		    strerror(probe->error));
+		evtimer_add(&dhcping->ctl_next, &now);
+		return;
+	}
+	if (probe->error != 0 && dhcping->mode != DHCPING_M_MONITOR) {
+		warnc(probe->error, "%s %s", probe->server->name,
+		    probe->cause);
 	}
 
-	if ((size_t)rv < sizeof(reply)) {
-		if (dhcping->verbose)
-			warnx("ignoring short packet on input");
+	if (dhcping->trace && dhcping->format == DHCPING_F_TABLE)
+		dhcping_trace_print(probe);
+
+	/* did a DORA check get as far as a REQUEST? */
+	dora = dhcping->dora && probe->phase == DHCPING_P_REQUEST;
+
+	if (probe == dhcping->ctl_probe) {
+		if (state == DHCPING_S_UP && dora) {
+			printf("up %.3f %.3f\n", dhcping_ms(&probe->rtt),
+			    dhcping_ms(&probe->commit));
+		} else if (state == DHCPING_S_UP)
+			printf("up %.3f\n", dhcping_ms(&probe->rtt));
+		else if (state == DHCPING_S_DOWN)
+			printf("down\n");
+		else
+			printf("down %s\n", dhcping_states[state]);
+
+		/* don't start the next check from inside this one */
+		evtimer_add(&dhcping->ctl_next, &now);
 		return;
 	}
 
-	if (reply.op != BOOTREPLY) {
-		if (dhcping->verbose)
-			warnx("ignoring non-BOOTREPLY packet");
+	if (dhcping->mode == DHCPING_M_MONITOR) {
+		dhcping_monitor_done(probe, dora);
+		return;
+	}
+	if (dhcping->mode == DHCPING_M_HEDGE) {
+		dhcping_hedge_done(probe, reply);
+		return;
+	}
+	if (dhcping->mode == DHCPING_M_VERDICT) {
+		dhcping_verdict_done(probe);
+		return;
+	}
+	if (dhcping->shards != NULL) {
+		dhcping_worker_done(probe);
 		return;
 	}
 
-	if (reply.giaddr.s_addr != p->giaddr.s_addr) {
-		if (dhcping->verbose)
-			warnx("ignoring packet with different giaddr");
+	dhcping_tally(probe);
+
+	if (dhcping->mode == DHCPING_M_BENCH) {
+		if (dhcping->format != DHCPING_F_TABLE)
+			dhcping_record(probe);
+		dhcping_probe_put(dhcping, probe);
+
+		if (dhcping->bench.stopping) {
+			if (dhcping->pending == 0)
+				dhcping_bench_report(dhcping);
+		} else if (dhcping->bench.rate == 0)
+			dhcping_bench_pump(dhcping);
 		return;
 	}
 
-	if (reply.xid != p->xid) {
-		if (dhcping->verbose)
-			warnx("ignoring packet with different xid");
+	if (dhcping->format != DHCPING_F_TABLE)
+		dhcping_record(probe);
+	else if (dhcping->count > 1)
+		dhcping_print(probe);
+
+	if (++probe->rounds < dhcping->count) {
+		dhcping_check(probe);
 		return;
 	}
 
-	/* all good */
+	if (dhcping->pending == 0)
+		dhcping_report(dhcping);
+}
 
-	exit(0);
+static void
+dhcping_tally(struct dhcping_probe *probe)
+{
+	struct dhcping *dhcping = probe->dhcping;
+	enum dhcping_state state = probe->state;
+	int dora = dhcping->dora && probe->phase == DHCPING_P_REQUEST;
+	int rtt = dora || (state == DHCPING_S_UP &&
+	    probe->phase == DHCPING_P_DISCOVER);
+
+	dhcping->failed[state]++;
+	dhcping_stats_add(&dhcping->stats, state == DHCPING_S_UP,
+	    rtt ? &probe->rtt : NULL);
+
+	/* renewing a kept lease skips the OFFER */
+	if (dhcping->dora && probe->phase != DHCPING_P_DISCOVER) {
+		dhcping_stats_add(&dhcping->commit, state == DHCPING_S_UP,
+		    (state != DHCPING_S_DOWN) ? &probe->commit : NULL);
+	}
 }
 
+/*
+ * Count a check as up or down, and keep the round trip time if there
+ * is one.
+ */
 static void
-dhcping_retry(int thing, short revents, void *arg)
+dhcping_stats_add(struct dhcping_stats *stats, int up,
+    const struct timespec *ts)
 {
-	struct dhcping *dhcping = arg;
-	struct dhcp_packet *p = dhcping_packet(dhcping);
-	ssize_t rv;
+	size_t size;
+	uint64_t *rtt;
 
-	p->secs = htons(dhcping->secs);
+	stats->checks++;
+	if (up)
+		stats->up++;
+	else
+		stats->down++;
 
-retry:
-	rv = write(dhcping->s, dhcping->packet, sizeof(dhcping->packet));
-	if (rv == -1) {
-		switch (errno) {
+	if (ts == NULL)
+		return;
+
+	if (stats->nrtt == stats->rttsize) {
+		size = stats->rttsize ? stats->rttsize * 2 : 64;
+		rtt = reallocarray(stats->rtt, size, sizeof(*rtt));
+		if (rtt == NULL)
+			err(1, "rtt stats");
+
+		stats->rtt = rtt;
+		stats->rttsize = size;
+	}
+
+	stats->rtt[stats->nrtt++] = (uint64_t)ts->tv_sec * 1000000000 +
+	    ts->tv_nsec;
+}
+
+static int
+dhcping_rtt_cmp(const void *a, const void *b)
+{
+	const uint64_t *x = a, *y = b;
+
+	return ((*x > *y) - (*x < *y));
+}
+
+/* nearest rank, the list has to be sorted */
+static double
+dhcping_rtt_pct(const struct dhcping_stats *stats, unsigned int pct)
+{
+	size_t rank;
+
+	rank = (stats->nrtt * pct + 99) / 100;
+	if (rank > 0)
+		rank--;
+
+	return (stats->rtt[rank] / 1000000.0);
+}
+
+/* min, avg, p50, p99, and max in msec */
+static int
+dhcping_stats_sum(struct dhcping_stats *stats, double *v)
+{
+	uint64_t sum = 0;
+	size_t i;
+
+	if (stats->nrtt == 0)
+		return (-1);
+
+	qsort(stats->rtt, stats->nrtt, sizeof(*stats->rtt), dhcping_rtt_cmp);
+	for (i = 0; i < stats->nrtt; i++)
+		sum += stats->rtt[i];
+
+	v[0] = stats->rtt[0] / 1000000.0;
+	v[1] = sum / stats->nrtt / 1000000.0;
+	v[2] = dhcping_rtt_pct(stats, 50);
+	v[3] = dhcping_rtt_pct(stats, 99);
+	v[4] = stats->rtt[stats->nrtt - 1] / 1000000.0;
+
+	return (0);
+}
+
+static void
+dhcping_stats_rtt(struct dhcping_stats *stats, const char *label)
+{
+	double v[5];
+
+	if (dhcping_stats_sum(stats, v) == -1)
+		return;
+
+	printf("%s min/avg/p50/p99/max %.3f/%.3f/%.3f/%.3f/%.3f ms\n",
+	    label, v[0], v[1], v[2], v[3], v[4]);
+}
+
+static void
+dhcping_stats_print(struct dhcping *dhcping)
+{
+	struct dhcping_stats *stats = &dhcping->stats;
+
+	if (dhcping->dora) {
+		dhcping_stats_rtt(stats, "offer rtt");
+		dhcping_stats_rtt(&dhcping->commit, "ack rtt");
+	} else
+		dhcping_stats_rtt(stats, "rtt");
+}
+
+static void
+dhcping_print_header(const struct dhcping *dhcping)
+{
+	printf("%-23s ", "SERVER");
+	if (dhcping->raw)
+		printf("%-15s ", "RELAY");
+
+	if (dhcping->dora) {
+		printf("%-17s %-5s %-15s %s\n",
+		    "MAC", "STATE", "ADDRESS", "OFFER ACK");
+	} else {
+		printf("%-17s %-5s %3s %s\n",
+		    "MAC", "STATE", "TRY", "RTT");
+	}
+}
+
+static void
+dhcping_print(const struct dhcping_probe *probe)
+{
+	const char *state = dhcping_states[probe->state];
+
+	printf("%-23s ", probe->server->name);
+	if (probe->dhcping->raw)
+		printf("%-15s ", inet_ntoa(probe->server->giaddr));
+	printf("%-17s ", ether_ntoa(&probe->ea));
+
+	if (probe->dhcping->dora) {
+		if (probe->phase == DHCPING_P_DISCOVER &&
+		    probe->answered == 0) {
+			printf("%-5s %-15s - -\n", state, "-");
+			return;
+		}
+
+		printf("%-5s %-15s ", state, inet_ntoa(probe->yiaddr));
+		if (probe->phase == DHCPING_P_DISCOVER ||
+		    probe->phase == DHCPING_P_REQUEST)
+			printf("%.3f ", dhcping_ms(&probe->rtt));
+		else
+			printf("- ");
+		if (probe->phase == DHCPING_P_DISCOVER ||
+		    (probe->state != DHCPING_S_UP &&
+		    probe->state != DHCPING_S_NAK))
+			printf("-\n");
+		else
+			printf("%.3f\n", dhcping_ms(&probe->commit));
+		return;
+	}
+
+	if (probe->answered > 0) {
+		printf("%-5s %3u %.3f\n", state, probe->answered,
+		    dhcping_ms(&probe->rtt));
+	} else
+		printf("%-5s %3u -\n", state, probe->attempts);
+}
+
+static void
+dhcping_report(struct dhcping *dhcping)
+{
+	struct dhcping_probe *probe;
+
+	if (dhcping->table) {
+		/* repeated checks have already been printed */
+		if (dhcping->count == 1) {
+			TAILQ_FOREACH(probe, &dhcping->probes, entry)
+				dhcping_print(probe);
+		}
+
+		printf("\n%u checks, %u up, %u down\n", dhcping->stats.checks,
+		    dhcping->stats.up, dhcping->stats.down);
+		dhcping_stats_print(dhcping);
+	} else if (dhcping->format != DHCPING_F_TABLE)
+		dhcping_summary(dhcping, NULL);
+
+	exit(dhcping_exit(dhcping));
+}
+
+/*
+ * Records are collected in a buffer and written out in big chunks so
+ * a slow reader doesn't hold up the checks with a write per record.
+ * Nothing sits in the buffer for longer than DHCP_OUTPUT_DELAY though.
+ */
+static void
+dhcping_output_init(struct dhcping *dhcping)
+{
+	dhcping->out = evbuffer_new();
+	if (dhcping->out == NULL)
+		errx(1, "output buffer");
+
+	evtimer_set(&dhcping->outflush, dhcping_output_timer, dhcping);
+	event_base_set(dhcping->base, &dhcping->outflush);
+
+	if (dhcping->format == DHCPING_F_CSV) {
+		evbuffer_add_printf(dhcping->out,
+		    "record,server,giaddr,mac,xid,state,attempts,answered,"
+		    "rtt,ack_rtt,type,yiaddr,checks,up,down,"
+		    "rtt_min,rtt_avg,rtt_p50,rtt_p99,rtt_max,"
+		    "ack_min,ack_avg,ack_p50,ack_p99,ack_max,seconds\n");
+	}
+}
+
+static void
+dhcping_output(struct dhcping *dhcping)
+{
+	static const struct timeval delay = { DHCP_OUTPUT_DELAY, 0 };
+
+	if (EVBUFFER_LENGTH(dhcping->out) >= DHCP_OUTPUT_CHUNK) {
+		evtimer_del(&dhcping->outflush);
+		dhcping_output_flush(dhcping);
+	} else if (!evtimer_pending(&dhcping->outflush, NULL))
+		evtimer_add(&dhcping->outflush, &delay);
+}
+
+static void
+dhcping_output_timer(int fd, short revents, void *arg)
+{
+	dhcping_output_flush(arg);
+}
+
+static void
+dhcping_output_flush(struct dhcping *dhcping)
+{
+	while (EVBUFFER_LENGTH(dhcping->out) > 0) {
+		if (evbuffer_write(dhcping->out, STDOUT_FILENO) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "output");
+		}
+	}
+}
+
+/* a string in whichever quoting the format uses */
+static void
+dhcping_output_str(struct dhcping *dhcping, const char *s)
+{
+	struct evbuffer *out = dhcping->out;
+
+	if (dhcping->format == DHCPING_F_CSV) {
+		if (strpbrk(s, ",\"\r\n") == NULL) {
+			evbuffer_add_printf(out, "%s", s);
+			return;
+		}
+
+		evbuffer_add_printf(out, "\"");
+		for (; *s != '\0'; s++) {
+			evbuffer_add_printf(out, "%s%c",
+			    *s == '"' ? "\"" : "", *s);
+		}
+		evbuffer_add_printf(out, "\"");
+		return;
+	}
+
+	evbuffer_add_printf(out, "\"");
+	for (; *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\')
+			evbuffer_add_printf(out, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			evbuffer_add_printf(out, "\\u%04x", *s);
+		else
+			evbuffer_add_printf(out, "%c", *s);
+	}
+	evbuffer_add_printf(out, "\"");
+}
+
+/*
+ * A record has the same fields in both formats. Ones that don't apply
+ * to a check are left out of JSON and left empty in CSV.
+ */
+/* the giaddr, or the link address DHCPv6 servers are relayed from */
+static const char *
+dhcping_relay(const struct dhcping_server *server)
+{
+	static char buf[INET6_ADDRSTRLEN];
+
+	if (server->af == AF_INET6) {
+		return (inet_ntop(AF_INET6, &server->linkaddr,
+		    buf, sizeof(buf)));
+	}
+
+	return (inet_ntoa(server->giaddr));
+}
+
+static void
+dhcping_record(const struct dhcping_probe *probe)
+{
+	struct dhcping *dhcping = probe->dhcping;
+	struct evbuffer *out = dhcping->out;
+	int csv = dhcping->format == DHCPING_F_CSV;
+	int dora = dhcping->dora && probe->phase == DHCPING_P_REQUEST;
+	int rtt = dora || (probe->answered > 0 &&
+	    probe->phase == DHCPING_P_DISCOVER);
+	int ack = dhcping->dora && probe->phase != DHCPING_P_DISCOVER &&
+	    probe->state != DHCPING_S_DOWN;
+	const char *type = NULL;
+
+	if (probe->type > 0 && probe->type < DHCPING_T_MAX)
+		type = dhcping_types[probe->type];
+
+	evbuffer_add_printf(out, csv ? "check," : "{\"server\":");
+	dhcping_output_str(dhcping, probe->server->name);
+	evbuffer_add_printf(out, csv ? ",%s," : ",\"giaddr\":\"%s\"",
+	    dhcping_relay(probe->server));
+	evbuffer_add_printf(out, csv ? "%s,0x%08x,%s,%u,%u," :
+	    ",\"mac\":\"%s\",\"xid\":\"0x%08x\",\"state\":\"%s\","
+	    "\"attempts\":%u,\"answered\":%u",
+	    ether_ntoa(&probe->ea), ntohl(probe->xid),
+	    dhcping_states[probe->state], probe->attempts, probe->answered);
+
+	if (rtt) {
+		evbuffer_add_printf(out, csv ? "%.3f" : ",\"rtt\":%.3f",
+		    dhcping_ms(&probe->rtt));
+	}
+	if (csv)
+		evbuffer_add_printf(out, ",");
+	if (ack) {
+		evbuffer_add_printf(out, csv ? "%.3f" : ",\"ack_rtt\":%.3f",
+		    dhcping_ms(&probe->commit));
+	}
+	if (csv)
+		evbuffer_add_printf(out, ",");
+	if (type != NULL)
+		evbuffer_add_printf(out, csv ? "%s" : ",\"type\":\"%s\"", type);
+	if (csv)
+		evbuffer_add_printf(out, ",");
+	if (probe->yiaddr.s_addr != htonl(INADDR_ANY)) {
+		evbuffer_add_printf(out, csv ? "%s" : ",\"yiaddr\":\"%s\"",
+		    inet_ntoa(probe->yiaddr));
+	}
+	if (dhcping->trace)
+		dhcping_trace_json(probe);
+
+	evbuffer_add_printf(out, csv ? ",,,,,,,,,,,,,,\n" : "}\n");
+	dhcping_output(dhcping);
+}
+
+/* -T steps are in msec since the check started */
+static double
+dhcping_trace_ms(const struct dhcping_probe *probe, const struct timespec *ts)
+{
+	struct timespec diff;
+
+	timespecsub(ts, &probe->trace.start, &diff);
+	return (dhcping_ms(&diff));
+}
+
+/*
+ * Setting up the server and the socket happened once, before any
+ * check, so those are how long they took instead.
+ */
+static void
+dhcping_trace_json(const struct dhcping_probe *probe)
+{
+	const struct dhcping_trace *trace = &probe->trace;
+	struct dhcping *dhcping = probe->dhcping;
+	struct evbuffer *out = dhcping->out;
+	unsigned int i;
+
+	evbuffer_add_printf(out, ",\"trace\":{\"resolve\":%.3f,"
+	    "\"connect\":%.3f,\"bind\":%.3f,\"tx\":[",
+	    dhcping_ms(&probe->server->resolve),
+	    dhcping_ms(&probe->server->connect), dhcping_ms(&dhcping->bind));
+	for (i = 0; i < MIN(trace->ntx, DHCP_TRACE_TX); i++) {
+		evbuffer_add_printf(out, "%s%.3f", i > 0 ? "," : "",
+		    dhcping_trace_ms(probe, &trace->tx[i]));
+	}
+	evbuffer_add_printf(out, "]");
+
+	if (trace->ntx > 0) {
+		evbuffer_add_printf(out, ",\"sent\":%.3f",
+		    dhcping_trace_ms(probe, &trace->sent));
+	}
+	if (timespecisset(&trace->rx)) {
+		evbuffer_add_printf(out, ",\"rx\":%.3f",
+		    dhcping_trace_ms(probe, &trace->rx));
+	}
+	if (timespecisset(&trace->valid)) {
+		evbuffer_add_printf(out, ",\"valid\":%.3f",
+		    dhcping_trace_ms(probe, &trace->valid));
+	}
+	evbuffer_add_printf(out, "}");
+}
+
+/* without -F the steps go to stderr so they don't get in the table */
+static void
+dhcping_trace_print(const struct dhcping_probe *probe)
+{
+	const struct dhcping_trace *trace = &probe->trace;
+	const struct dhcping *dhcping = probe->dhcping;
+	char buf[512];
+	size_t len;
+	unsigned int i;
+
+	len = snprintf(buf, sizeof(buf), "resolve %.3f connect %.3f "
+	    "bind %.3f, tx", dhcping_ms(&probe->server->resolve),
+	    dhcping_ms(&probe->server->connect), dhcping_ms(&dhcping->bind));
+	for (i = 0; i < MIN(trace->ntx, DHCP_TRACE_TX); i++) {
+		len += snprintf(buf + len, sizeof(buf) - len, " %.3f",
+		    dhcping_trace_ms(probe, &trace->tx[i]));
+	}
+	if (trace->ntx > 0) {
+		len += snprintf(buf + len, sizeof(buf) - len, ", sent %.3f",
+		    dhcping_trace_ms(probe, &trace->sent));
+	}
+	if (timespecisset(&trace->rx)) {
+		len += snprintf(buf + len, sizeof(buf) - len, ", rx %.3f",
+		    dhcping_trace_ms(probe, &trace->rx));
+	}
+	if (timespecisset(&trace->valid)) {
+		snprintf(buf + len, sizeof(buf) - len, ", valid %.3f",
+		    dhcping_trace_ms(probe, &trace->valid));
+	}
+
+	warnx("%s %s: %s ms", probe->server->name, ether_ntoa(&probe->ea),
+	    buf);
+}
+
+/* the last record has the totals, and how long a benchmark ran */
+static void
+dhcping_summary(struct dhcping *dhcping, const double *secs)
+{
+	struct evbuffer *out = dhcping->out;
+	int csv = dhcping->format == DHCPING_F_CSV;
+	double v[5];
+
+	evbuffer_add_printf(out, csv ? "summary,,,,,,,,,,,,%u,%u,%u" :
+	    "{\"summary\":true,\"checks\":%u,\"up\":%u,\"down\":%u",
+	    dhcping->stats.checks, dhcping->stats.up, dhcping->stats.down);
+
+	if (dhcping_stats_sum(&dhcping->stats, v) == 0) {
+		evbuffer_add_printf(out, csv ? ",%.3f,%.3f,%.3f,%.3f,%.3f" :
+		    ",\"rtt\":{\"min\":%.3f,\"avg\":%.3f,\"p50\":%.3f,"
+		    "\"p99\":%.3f,\"max\":%.3f}",
+		    v[0], v[1], v[2], v[3], v[4]);
+	} else if (csv)
+		evbuffer_add_printf(out, ",,,,,");
+
+	if (dhcping->dora && dhcping_stats_sum(&dhcping->commit, v) == 0) {
+		evbuffer_add_printf(out, csv ? ",%.3f,%.3f,%.3f,%.3f,%.3f" :
+		    ",\"ack_rtt\":{\"min\":%.3f,\"avg\":%.3f,\"p50\":%.3f,"
+		    "\"p99\":%.3f,\"max\":%.3f}",
+		    v[0], v[1], v[2], v[3], v[4]);
+	} else if (csv)
+		evbuffer_add_printf(out, ",,,,,");
+
+	if (secs != NULL)
+		evbuffer_add_printf(out, csv ? ",%.3f" : ",\"seconds\":%.3f",
+		    *secs);
+	else if (csv)
+		evbuffer_add_printf(out, ",");
+
+	evbuffer_add_printf(out, csv ? "\n" : "}\n");
+
+	/* this is about to exit */
+	dhcping_output_flush(dhcping);
+}
+
+/*
+ * Servers that didn't answer at all are the worst news, followed by
+ * ones that said no, gave out the wrong addresses, or left out options.
+ */
+static int
+dhcping_exit(const struct dhcping *dhcping)
+{
+	const unsigned int *failed = dhcping->failed;
+
+	if (failed[DHCPING_S_DOWN] > 0)
+		return (2);
+	if (failed[DHCPING_S_NAK] > 0 || failed[DHCPING_S_TYPE] > 0)
+		return (3);
+	if (failed[DHCPING_S_ADDR] > 0)
+		return (4);
+	if (failed[DHCPING_S_OPTS] > 0)
+		return (5);
+
+	return (0);
+}
+
+/*
+ * A -h range for a benchmark is either first-last or a mac and a prefix
+ * length, which leaves the bits after the prefix for the clients.
+ */
+static int
+dhcping_mac_range(const char *spec, uint64_t *base, uint64_t *size)
+{
+	const struct ether_addr *ea;
+	char buf[64];
+	const char *errstr;
+	char *sep;
+	uint64_t last;
+	unsigned int bits;
+	int prefix;
+
+	if (strlcpy(buf, spec, sizeof(buf)) >= sizeof(buf))
+		return (-1);
+
+	sep = strpbrk(buf, "-/");
+	prefix = *sep == '/';
+	*sep++ = '\0';
+
+	ea = ether_aton(buf);
+	if (ea == NULL)
+		return (-1);
+	*base = dhcping_ea_num(ea);
+
+	if (prefix) {
+		bits = strtonum(sep, 0, 48, &errstr);
+		if (errstr != NULL)
+			return (-1);
+		*size = 1ULL << (48 - bits);
+		*base &= ~(*size - 1);
+		return (0);
+	}
+
+	ea = ether_aton(sep);
+	if (ea == NULL)
+		return (-1);
+	last = dhcping_ea_num(ea);
+	if (last < *base)
+		return (-1);
+	*size = last - *base + 1;
+
+	return (0);
+}
+
+/*
+ * Benchmark mode uses the same packets and reply checks as a normal
+ * check, but against a population of macs counting up from the -h
+ * argument or taken from a -h range, and shuffled with -S. Every probe
+ * gets its own xid. Each probe is only sent once unless -t says
+ * otherwise, so anything that doesn't get a reply within the wait time
+ * is counted as lost.
+ */
+static void
+dhcping_bench(struct dhcping *dhcping)
+{
+	static const struct ether_addr base = {
+		{ 0x02, 0x00, 0x00, 0x00, 0x00, 0x00 }
+	};
+	struct dhcping_bench *bench = &dhcping->bench;
+
+	/* without a range, count up from -h until the addresses run out */
+	if (!bench->range) {
+		bench->base = dhcping_ea_num(dhcping->ea_set ?
+		    &dhcping->ea : &base);
+		bench->size = (1ULL << 48) - bench->base;
+	}
+
+	bench->next = TAILQ_FIRST(&dhcping->servers);
+	if (bench->next == NULL)
+		errx(1, "no servers to check");
+
+	if (clock_gettime(CLOCK_MONOTONIC, &bench->start) == -1)
+		err(1, "clock_gettime");
+
+	evtimer_set(&bench->tick, dhcping_bench_tick, dhcping);
+	evtimer_set(&bench->end, dhcping_bench_end, dhcping);
+	evtimer_add(&bench->end, &bench->duration);
+
+	dhcping_bench_tick(0, EV_TIMEOUT, dhcping);
+}
+
+static void
+dhcping_bench_probe(struct dhcping *dhcping)
+{
+	struct dhcping_bench *bench = &dhcping->bench;
+	struct dhcping_server *server = bench->next;
+	struct dhcping_probe *probe;
+	struct ether_addr ea;
+	uint64_t seq, off;
+
+	/* clients start again from the beginning after the last mac */
+	seq = bench->started++;
+	off = seq % bench->size;
+	if (bench->shuffle)
+		off = dhcping_permute(off, bench->size, bench->key);
+	dhcping_ea_set(&ea, bench->base + off);
+
+	/* spread the load over all the servers */
+	bench->next = TAILQ_NEXT(server, entry);
+	if (bench->next == NULL)
+		bench->next = TAILQ_FIRST(&dhcping->servers);
+
+	probe = dhcping_probe_get(dhcping, server, &ea);
+	probe->index = seq;
+	dhcping_check(probe);
+}
+
+static void
+dhcping_bench_pump(struct dhcping *dhcping)
+{
+	struct dhcping_bench *bench = &dhcping->bench;
+	struct timespec now, elapsed;
+	uint64_t due;
+	int held;
+
+	/* packets still waiting on -L or -P, don't pile up more */
+	held = !TAILQ_EMPTY(&dhcping->txq);
+
+	if (bench->rate == 0) {
+		/* flat out, keep the window full */
+		while (!held && !TAILQ_EMPTY(&dhcping->idle))
+			dhcping_bench_probe(dhcping);
+		return;
+	}
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+		err(1, "clock_gettime");
+	timespecsub(&now, &bench->start, &elapsed);
+
+	due = ((uint64_t)elapsed.tv_sec * 1000000000 + elapsed.tv_nsec) *
+	    bench->rate / 1000000000 + 1;
+
+	while (bench->started < due) {
+		if (held || TAILQ_EMPTY(&dhcping->idle)) {
+			/* the window is full, don't burst to catch up */
+			bench->started = due;
+			break;
+		}
+
+		dhcping_bench_probe(dhcping);
+	}
+}
+
+static void
+dhcping_bench_tick(int fd, short revents, void *arg)
+{
+	static const struct timeval tick = { 0, DHCP_BENCH_TICK * 1000 };
+	struct dhcping *dhcping = arg;
+
+	dhcping_bench_pump(dhcping);
+
+	if (dhcping->bench.rate != 0)
+		evtimer_add(&dhcping->bench.tick, &tick);
+}
+
+static void
+dhcping_bench_end(int fd, short revents, void *arg)
+{
+	struct dhcping *dhcping = arg;
+	struct dhcping_bench *bench = &dhcping->bench;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &bench->stop) == -1)
+		err(1, "clock_gettime");
+
+	bench->stopping = 1;
+	evtimer_del(&bench->tick);
+
+	/* wait for the probes still in flight to finish */
+	if (dhcping->pending == 0)
+		dhcping_bench_report(dhcping);
+}
+
+static void
+dhcping_bench_report(struct dhcping *dhcping)
+{
+	struct dhcping_bench *bench = &dhcping->bench;
+	struct dhcping_stats *stats = &dhcping->stats;
+	unsigned int lost = dhcping->failed[DHCPING_S_DOWN];
+	unsigned int replies = stats->checks - lost;
+	struct timespec elapsed;
+	double secs;
+
+	timespecsub(&bench->stop, &bench->start, &elapsed);
+	secs = elapsed.tv_sec + elapsed.tv_nsec / 1000000000.0;
+
+	if (dhcping->format != DHCPING_F_TABLE) {
+		dhcping_summary(dhcping, &secs);
+		exit(0);
+	}
+
+	printf("%u probes in %.3f s, %.1f/s\n", stats->checks, secs,
+	    stats->checks / secs);
+	printf("%u replies, %.1f/s, %u lost (%.2f%%)\n", replies,
+	    replies / secs, lost,
+	    stats->checks ? lost * 100.0 / stats->checks : 0.0);
+	if (stats->down > lost)
+		printf("%u replies failed checks\n", stats->down - lost);
+	dhcping_stats_print(dhcping);
+
+	exit(0);
+}
+
+/*
+ * Split the targets between the workers. This runs before the chroot
+ * since every worker binds its own socket, the first one takes over
+ * the socket that's already been bound. The reporter keeps its own
+ * probes so results can be shown the same way as without -j.
+ */
+static void
+dhcping_shards_init(struct dhcping *dhcping, unsigned int n)
+{
+	struct dhcping_shards *shards;
+	struct dhcping *worker;
+	struct dhcping_server *server, *copy;
+	struct dhcping_probe *probe, *wp;
+	unsigned int bits = 0;
+	unsigned int i, w;
+	int on = 1;
+
+	/* DHCPv6 transaction ids don't have room for the worker's bits */
+	TAILQ_FOREACH(server, &dhcping->servers, entry) {
+		if (server->af == AF_INET6)
+			errx(1, "DHCPv6 checks can't be split between threads");
+	}
+
+	while ((1U << bits) < n)
+		bits++;
+
+	shards = calloc(1, sizeof(*shards));
+	if (shards == NULL)
+		err(1, "shards");
+	shards->n = n;
+	shards->shift = 32 - bits;
+	atomic_init(&shards->running, n);
+
+	shards->workers = calloc(n, sizeof(*shards->workers));
+	shards->handoff = calloc(n * n, sizeof(*shards->handoff));
+	shards->results = calloc(n, sizeof(*shards->results));
+	shards->probes = calloc(dhcping->nprobes, sizeof(*shards->probes));
+	if (shards->workers == NULL || shards->handoff == NULL ||
+	    shards->results == NULL || shards->probes == NULL)
+		err(1, "shards");
+
+	for (i = 0; i < n * n; i++) {
+		dhcping_ring_init(&shards->handoff[i], DHCP_HANDOFF_SLOTS,
+		    sizeof(struct dhcping_handoff));
+	}
+
+	for (w = 0; w < n; w++) {
+		worker = calloc(1, sizeof(*worker));
+		if (worker == NULL)
+			err(1, "worker");
+
+		/* start from the same settings */
+		*worker = *dhcping;
+		TAILQ_INIT(&worker->servers);
+		TAILQ_INIT(&worker->idle);
+		TAILQ_INIT(&worker->probes);
+		TAILQ_INIT(&worker->txq);
+		worker->nprobes = 0;
+		worker->poolsize = 0;
+
+		worker->shards = shards;
+		worker->shard = w;
+		worker->xid_base = w << shards->shift;
+		worker->xid_mask = (1U << shards->shift) - 1;
+		worker->kick = 0;
+
+		worker->base = event_base_new();
+		if (worker->base == NULL)
+			errx(1, "worker event base");
+
+		/* the limits are shared out between the workers */
+		if (dhcping->limit.rate != 0)
+			dhcping_limit_init(&worker->limit,
+			    MAX(dhcping->limit.rate / n, 1));
+
+		if (w == 0)
+			worker->s = dhcping->s;
+		else {
+			worker->s = dhcping_listen(dhcping->local, 1);
+			/* error printed by dhcping_listen */
+			worker->rs = worker->s;
+			dhcping_pacing(worker->s, worker->limit.rate);
+#ifdef SO_TIMESTAMP
+			if (setsockopt(worker->s, SOL_SOCKET, SO_TIMESTAMP,
+			    &on, sizeof(on)) == -1)
+				err(1, "timestamps");
+#endif
+		}
+
+		if (pipe2(worker->wake, O_NONBLOCK) == -1)
+			err(1, "worker pipe");
+
+		/* the hot path writes to the servers, so each has its own */
+		TAILQ_FOREACH(server, &dhcping->servers, entry) {
+			copy = malloc(sizeof(*copy));
+			if (copy == NULL)
+				err(1, "server %s", server->name);
+			*copy = *server;
+			copy->dhcping = worker;
+			if (server->limit.rate != 0)
+				dhcping_limit_init(&copy->limit,
+				    MAX(server->limit.rate / n, 1));
+			TAILQ_INSERT_TAIL(&worker->servers, copy, entry);
+		}
+
+		if (dhcping_pool_init(worker,
+		    (dhcping->nprobes - w + n - 1) / n) == -1)
+			err(1, "probe pool");
+		dhcping_ring_init(&shards->results[w], DHCP_RESULT_SLOTS,
+		    sizeof(struct dhcping_result));
+
+		shards->workers[w] = worker;
+	}
+
+	/* deal the targets out like cards */
+	TAILQ_FOREACH(probe, &dhcping->probes, entry) {
+		worker = shards->workers[probe->index % n];
+		server = dhcping_server_find(worker, probe->server->name,
+		    &probe->server->giaddr);
+
+		wp = dhcping_probe_get(worker, server, &probe->ea);
+		wp->index = probe->index;
+		wp->tmpl = probe->tmpl;
+		wp->lease = probe->lease;
+		TAILQ_INSERT_TAIL(&worker->probes, wp, entry);
+		worker->nprobes++;
+
+		shards->probes[probe->index] = probe;
+	}
+
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+	{
+		/*
+		 * Let the kernel pick the socket by the worker number in
+		 * the xid, which is also the socket's place in the group.
+		 * Anything it gets wrong is still handed off.
+		 */
+		struct sock_filter code[] = {
+			BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+			    offsetof(struct dhcp_packet, xid)),
+			BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, shards->shift),
+			BPF_STMT(BPF_RET | BPF_A, 0),
+		};
+		struct sock_fprog prog = {
+			.len = sizeof(code) / sizeof(code[0]),
+			.filter = code,
+		};
+
+		if (setsockopt(dhcping->s, SOL_SOCKET,
+		    SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1 &&
+		    dhcping->verbose)
+			warn("reuseport steering");
+	}
+#endif
+
+	dhcping->shards = shards;
+}
+
+static void
+dhcping_shards_start(struct dhcping *dhcping)
+{
+	static const struct timeval tick = { 0, DHCP_REPORT_TICK * 1000 };
+	struct dhcping_shards *shards = dhcping->shards;
+	struct dhcping *worker;
+	pthread_t thread;
+	unsigned int w;
+	int error;
+
+	for (w = 0; w < shards->n; w++) {
+		worker = shards->workers[w];
+
+		if (dhcping_hash_init(worker, worker->poolsize) == -1)
+			err(1, "hash");
+		if (dhcping_wheel_init(worker) == -1)
+			err(1, "timer wheel");
+		if (dhcping_io_init(worker) == -1)
+			err(1, "receive ring");
+		dhcping_events(worker);
+
+		event_set(&worker->wakeup, worker->wake[0], EV_READ|EV_PERSIST,
+		    dhcping_wakeup, worker);
+		event_base_set(worker->base, &worker->wakeup);
+		event_add(&worker->wakeup, NULL);
+
+		error = pthread_create(&thread, NULL, dhcping_worker, worker);
+		if (error != 0)
+			errc(1, error, "worker %u", w);
+	}
+
+	evtimer_set(&shards->tick, dhcping_collect, dhcping);
+	evtimer_add(&shards->tick, &tick);
+}
+
+/*
+ * Workers keep running after their own checks are done because the
+ * kernel might still be delivering other workers' replies to them.
+ * The reporter ends the process.
+ */
+static void *
+dhcping_worker(void *arg)
+{
+	struct dhcping *worker = arg;
+	struct dhcping_probe *probe;
+
+	TAILQ_FOREACH(probe, &worker->probes, entry)
+		dhcping_check(probe);
+
+	event_base_dispatch(worker->base);
+	errx(1, "worker %u stopped", worker->shard);
+	/* NOTREACHED */
+}
+
+static void
+dhcping_worker_done(struct dhcping_probe *probe)
+{
+	struct dhcping *worker = probe->dhcping;
+	struct dhcping_shards *shards = worker->shards;
+	struct dhcping_ring *ring = &shards->results[worker->shard];
+	struct dhcping_result *res;
+
+	/* the reporter drains the ring often, so it won't be full long */
+	while ((res = dhcping_ring_reserve(ring)) == NULL)
+		sched_yield();
+
+	res->index = probe->index;
+	res->state = probe->state;
+	res->phase = probe->phase;
+	res->attempts = probe->attempts;
+	res->answered = probe->answered;
+	res->rtt = probe->rtt;
+	res->commit = probe->commit;
+	res->yiaddr = probe->yiaddr;
+	res->xid = probe->xid;
+	res->type = probe->type;
+	dhcping_ring_commit(ring);
+
+	if (++probe->rounds < worker->count) {
+		dhcping_check(probe);
+		return;
+	}
+
+	if (worker->pending == 0)
+		atomic_fetch_sub_explicit(&shards->running, 1,
+		    memory_order_release);
+}
+
+/*
+ * The reporter picks up results from the workers and counts and
+ * prints them with its own copy of each probe.
+ */
+static void
+dhcping_collect(int fd, short revents, void *arg)
+{
+	static const struct timeval tick = { 0, DHCP_REPORT_TICK * 1000 };
+	struct dhcping *dhcping = arg;
+	struct dhcping_shards *shards = dhcping->shards;
+	struct dhcping_result *res;
+	struct dhcping_probe *probe;
+	unsigned int running;
+	unsigned int w;
+
+	/* anything reported before a worker finished is in the rings */
+	running = atomic_load_explicit(&shards->running, memory_order_acquire);
+
+	for (w = 0; w < shards->n; w++) {
+		while ((res = dhcping_ring_peek(&shards->results[w])) != NULL) {
+			probe = shards->probes[res->index];
+			probe->state = res->state;
+			probe->phase = res->phase;
+			probe->attempts = res->attempts;
+			probe->answered = res->answered;
+			probe->rtt = res->rtt;
+			probe->commit = res->commit;
+			probe->yiaddr = res->yiaddr;
+			probe->xid = res->xid;
+			probe->type = res->type;
+			dhcping_ring_consume(&shards->results[w]);
+
+			dhcping_tally(probe);
+			if (dhcping->format != DHCPING_F_TABLE)
+				dhcping_record(probe);
+			else if (dhcping->count > 1)
+				dhcping_print(probe);
+		}
+	}
+
+	if (running == 0)
+		dhcping_report(dhcping);
+
+	evtimer_add(&shards->tick, &tick);
+}
+
+/*
+ * Hedge mode checks the targets in the order they were given, but
+ * only moves on to the next one if the previous one hasn't answered
+ * within the hedge delay, or has already failed. The first target to
+ * pass decides the round and the rest are abandoned, so a dead primary
+ * only costs the hedge delay rather than the whole wait time.
+ */
+static void
+dhcping_hedge(struct dhcping *dhcping)
+{
+	evtimer_set(&dhcping->hedge_ev, dhcping_hedge_next, dhcping);
+	dhcping_hedge_round(dhcping);
+}
+
+static void
+dhcping_hedge_round(struct dhcping *dhcping)
+{
+	struct dhcping_probe *probe;
+
+	TAILQ_FOREACH(probe, &dhcping->probes, entry)
+		probe->state = DHCPING_S_IDLE;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &dhcping->hedge_start) == -1)
+		err(1, "clock_gettime");
+
+	dhcping->hedge_next = TAILQ_FIRST(&dhcping->probes);
+	dhcping_hedge_next(0, EV_TIMEOUT, dhcping);
+}
+
+static void
+dhcping_hedge_next(int fd, short revents, void *arg)
+{
+	struct dhcping *dhcping = arg;
+	struct dhcping_probe *probe = dhcping->hedge_next;
+	struct timeval tv;
+
+	if (probe == NULL)
+		return;
+
+	dhcping->hedge_next = TAILQ_NEXT(probe, entry);
+	dhcping_check(probe);
+
+	if (dhcping->hedge_next != NULL) {
+		dhcping_hedge_delay(dhcping, &tv);
+		evtimer_add(&dhcping->hedge_ev, &tv);
+	}
+}
+
+/*
+ * A percentile needs earlier rounds to go on, so the first round with
+ * -H pN waits the -i interval instead.
+ */
+static void
+dhcping_hedge_delay(struct dhcping *dhcping, struct timeval *tv)
+{
+	struct dhcping_stats *stats = &dhcping->stats;
+	double ms;
+
+	if (dhcping->hedge_pct == 0) {
+		dhcping_tv_ms(tv, dhcping->hedge);
+		return;
+	}
+	if (stats->nrtt == 0) {
+		dhcping_tv_ms(tv, dhcping->interval);
+		return;
+	}
+
+	qsort(stats->rtt, stats->nrtt, sizeof(*stats->rtt), dhcping_rtt_cmp);
+	ms = dhcping_rtt_pct(stats, dhcping->hedge_pct);
+	tv->tv_sec = ms / 1000;
+	tv->tv_usec = (ms - tv->tv_sec * 1000) * 1000;
+}
+
+static void
+dhcping_hedge_done(struct dhcping_probe *probe, const struct timespec *reply)
+{
+	struct dhcping *dhcping = probe->dhcping;
+
+	if (probe->state == DHCPING_S_UP) {
+		dhcping_hedge_end(dhcping, probe, reply);
+		return;
+	}
+
+	/* there's no point waiting out the delay after a failure */
+	if (dhcping->hedge_next != NULL) {
+		evtimer_del(&dhcping->hedge_ev);
+		dhcping_hedge_next(0, EV_TIMEOUT, dhcping);
+	} else if (dhcping->pending == 0)
+		dhcping_hedge_end(dhcping, NULL, NULL);
+}
+
+static void
+dhcping_hedge_end(struct dhcping *dhcping, struct dhcping_probe *winner,
+    const struct timespec *reply)
+{
+	struct dhcping_probe *probe;
+	struct timespec elapsed;
+
+	evtimer_del(&dhcping->hedge_ev);
+
+	/* the slower targets don't matter any more, and aren't shown */
+	TAILQ_FOREACH(probe, &dhcping->probes, entry) {
+		if (probe->state == DHCPING_S_WAIT) {
+			dhcping_stop(probe);
+			probe->state = DHCPING_S_IDLE;
+		}
+	}
+
+	/* show the targets that were tried in this round */
+	TAILQ_FOREACH(probe, &dhcping->probes, entry) {
+		if (probe->state == DHCPING_S_IDLE)
+			continue;
+		/* a round is only a failure if nothing answered */
+		if (winner == NULL)
+			dhcping->failed[probe->state]++;
+		if (dhcping->table)
+			dhcping_print(probe);
+		else
+			dhcping_record(probe);
+	}
+
+	if (winner != NULL) {
+		timespecsub(reply, &dhcping->hedge_start, &elapsed);
+		if (dhcping->table) {
+			printf("answered by %s in %.3f ms\n",
+			    winner->server->name, dhcping_ms(&elapsed));
+		}
+
+		dhcping_stats_add(&dhcping->stats, 1, &winner->rtt);
+		if (dhcping->dora)
+			dhcping_stats_add(&dhcping->commit, 1, &winner->commit);
+	} else {
+		if (dhcping->table)
+			printf("no answer\n");
+		dhcping_stats_add(&dhcping->stats, 0, NULL);
+	}
+
+	if (++dhcping->hedge_rounds < dhcping->count) {
+		dhcping_hedge_round(dhcping);
+		return;
+	}
+
+	if (!dhcping->table)
+		dhcping_summary(dhcping, NULL);
+	else if (dhcping->count > 1) {
+		printf("\n%u checks, %u up, %u down\n", dhcping->stats.checks,
+		    dhcping->stats.up, dhcping->stats.down);
+		dhcping_stats_print(dhcping);
+	}
+
+	exit(dhcping_exit(dhcping));
+}
+
+/*
+ * Verdict mode checks the one target with a run of macs counting up
+ * from its own, all at once, so a single lost packet doesn't decide
+ * whether the server is up. Every check gets its own xid anyway.
+ */
+static void
+dhcping_verdict_targets(struct dhcping *dhcping)
+{
+	struct dhcping_target target;
+	uint64_t base;
+	unsigned int i;
+
+	if (dhcping->ntargets != 1)
+		errx(1, "a verdict is made about one server and mac");
+
+	target = dhcping->targets[0];
+	base = dhcping_ea_num(&target.ea);
+	for (i = 1; i < dhcping->verdict_of; i++) {
+		dhcping_ea_set(&target.ea, base + i);
+		dhcping_target_add(dhcping, target.server, target.tmpl,
+		    &target.ea);
+	}
+}
+
+/*
+ * The server is healthy once enough checks are up, or once the p90
+ * rtt is under the -V threshold, counting checks that didn't pass as
+ * infinitely slow. It's down as soon as neither can happen with the
+ * checks that are left, so relayd gets an answer without waiting for
+ * the stragglers.
+ */
+static void
+dhcping_verdict_done(struct dhcping_probe *probe)
+{
+	struct dhcping *dhcping = probe->dhcping;
+	unsigned int fast = (dhcping->verdict_of * 9 + 9) / 10;
+	unsigned int up;
+
+	dhcping_tally(probe);
+
+	if (dhcping->verdict_rtt != 0 && probe->state == DHCPING_S_UP &&
+	    dhcping_ms(&probe->rtt) <= dhcping->verdict_rtt)
+		dhcping->verdict_fast++;
+
+	up = dhcping->stats.up;
+	if (up >= dhcping->verdict_need ||
+	    (dhcping->verdict_rtt != 0 && dhcping->verdict_fast >= fast)) {
+		dhcping_verdict_end(dhcping, 1);
+		return;
+	}
+
+	if (up + dhcping->pending < dhcping->verdict_need &&
+	    (dhcping->verdict_rtt == 0 ||
+	    dhcping->verdict_fast + dhcping->pending < fast))
+		dhcping_verdict_end(dhcping, 0);
+}
+
+static void
+dhcping_verdict_end(struct dhcping *dhcping, int healthy)
+{
+	struct dhcping_probe *probe;
+
+	/* the rest can't change the verdict */
+	TAILQ_FOREACH(probe, &dhcping->probes, entry) {
+		if (probe->state == DHCPING_S_WAIT)
+			dhcping_stop(probe);
+	}
+
+	TAILQ_FOREACH(probe, &dhcping->probes, entry) {
+		if (probe->state == DHCPING_S_WAIT ||
+		    probe->state == DHCPING_S_IDLE)
+			continue;
+		if (dhcping->table)
+			dhcping_print(probe);
+		else
+			dhcping_record(probe);
+	}
+
+	if (dhcping->table) {
+		printf("\n%u checks, %u up, %u down, %s\n",
+		    dhcping->stats.checks, dhcping->stats.up,
+		    dhcping->stats.down, healthy ? "healthy" : "unhealthy");
+		dhcping_stats_print(dhcping);
+	} else
+		dhcping_summary(dhcping, NULL);
+
+	exit(healthy ? 0 : dhcping_exit(dhcping));
+}
+
+/*
+ * Monitor mode checks every target forever, once a period. The first
+ * checks are spread out over a whole period and every one after that
+ * is moved by up to a tenth of the period either way, so the targets
+ * don't all end up being checked at the same instant.
+ */
+static void
+dhcping_monitor(struct dhcping *dhcping)
+{
+	struct dhcping_probe *probe;
+	struct timeval tv;
+
+	TAILQ_FOREACH(probe, &dhcping->probes, entry) {
+		probe->last = DHCPING_S_IDLE;
+
+		evtimer_set(&probe->next, dhcping_monitor_check, probe);
+		event_base_set(dhcping->base, &probe->next);
+		dhcping_tv_ms(&tv, arc4random_uniform(probe->period));
+		evtimer_add(&probe->next, &tv);
+	}
+
+	event_set(&dhcping->metrics, dhcping->ms, EV_READ|EV_PERSIST,
+	    dhcping_metrics_accept, dhcping);
+	event_add(&dhcping->metrics, NULL);
+
+	if (dhcping->file != NULL) {
+		signal_set(&dhcping->reload, SIGHUP, dhcping_reload, dhcping);
+		event_base_set(dhcping->base, &dhcping->reload);
+		signal_add(&dhcping->reload, NULL);
+	}
+}
+
+/* a target that's new starts somewhere in its first period too */
+static void
+dhcping_monitor_add(struct dhcping *dhcping,
+    const struct dhcping_target *target)
+{
+	struct dhcping_probe *probe;
+	struct timeval tv;
+
+	if (TAILQ_EMPTY(&dhcping->idle) &&
+	    dhcping_pool_init(dhcping, dhcping->ntargets) == -1)
+		err(1, "probe pool");
+
+	probe = dhcping_probe_get(dhcping, target->server, &target->ea);
+	probe->tmpl = target->tmpl;
+	probe->period = target->period;
+	probe->file = target->file;
+	probe->last = DHCPING_S_IDLE;
+
+	probe->index = dhcping->nindex++;
+	TAILQ_INSERT_TAIL(&dhcping->probes, probe, entry);
+	dhcping->nprobes++;
+
+	evtimer_set(&probe->next, dhcping_monitor_check, probe);
+	event_base_set(dhcping->base, &probe->next);
+	dhcping_tv_ms(&tv, arc4random_uniform(probe->period));
+	evtimer_add(&probe->next, &tv);
+}
+
+static void
+dhcping_monitor_del(struct dhcping *dhcping, struct dhcping_probe *probe)
+{
+	/* the server is kept, its counters are still good */
+	if (probe->state == DHCPING_S_WAIT)
+		dhcping_stop(probe);
+	evtimer_del(&probe->next);
+
+	TAILQ_REMOVE(&dhcping->probes, probe, entry);
+	dhcping->nprobes--;
+	dhcping_probe_put(dhcping, probe);
+}
+
+static void
+dhcping_monitor_check(int fd, short revents, void *arg)
+{
+	struct dhcping_probe *probe = arg;
+
+	dhcping_check(probe);
+}
+
+static void
+dhcping_monitor_done(struct dhcping_probe *probe, int dora)
+{
+	struct dhcping *dhcping = probe->dhcping;
+	struct dhcping_server *server = probe->server;
+	enum dhcping_state state = probe->state;
+	uint32_t period;
+	struct timeval tv;
+
+	server->results[state]++;
+	if (dora || (state == DHCPING_S_UP &&
+	    probe->phase == DHCPING_P_DISCOVER))
+		dhcping_histogram_add(&server->rtt, &probe->rtt);
+	if (dhcping->dora && probe->phase != DHCPING_P_DISCOVER &&
+	    state != DHCPING_S_DOWN)
+		dhcping_histogram_add(&server->commit, &probe->commit);
+	probe->last = state;
+
+	if (dhcping->format != DHCPING_F_TABLE)
+		dhcping_record(probe);
+
+	period = probe->period;
+	dhcping_tv_ms(&tv, period - period / 10 +
+	    arc4random_uniform(period / 5 + 1));
+	evtimer_add(&probe->next, &tv);
+}
+
+/*
+ * SIGHUP reads the targets file again. The targets that are still in
+ * it keep their probes, along with their timers and results, and only
+ * pick up new options or periods for their next check. Probes are only
+ * started for targets that are new and stopped for ones that are gone,
+ * so the rest don't all get checked again at once. If the file can't
+ * be used the old targets stay as they are.
+ */
+static void
+dhcping_reload(int sig, short revents, void *arg)
+{
+	struct dhcping *dhcping = arg;
+	struct dhcping_probe **probes, *probe;
+	struct dhcping_target *target;
+	unsigned int added = 0, removed = 0;
+	size_t i, n = 0;
+
+	if (dhcping_targets(dhcping) == -1) {
+		warnx("%s: keeping the old targets", dhcping->file);
+		goto done;
+	}
+
+	/* sorted so each target can find its probe quickly */
+	probes = reallocarray(NULL, dhcping->nprobes, sizeof(*probes));
+	if (probes == NULL)
+		err(1, "reload");
+	TAILQ_FOREACH(probe, &dhcping->probes, entry) {
+		if (!probe->file)
+			continue;
+		probe->stale = 1;
+		probes[n++] = probe;
+	}
+	qsort(probes, n, sizeof(*probes), dhcping_reload_cmp);
+
+	for (i = 0; i < dhcping->ntargets; i++) {
+		target = &dhcping->targets[i];
+
+		probe = dhcping_reload_find(probes, n, target);
+		if (probe == NULL) {
+			dhcping_monitor_add(dhcping, target);
+			added++;
+			continue;
+		}
+
+		probe->stale = 0;
+		probe->tmpl = target->tmpl;
+		probe->period = target->period;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (probes[i]->stale) {
+			dhcping_monitor_del(dhcping, probes[i]);
+			removed++;
+		}
+	}
+	free(probes);
+
+	if (dhcping->verbose) {
+		warnx("%s: %u targets added, %u removed", dhcping->file,
+		    added, removed);
+	}
+
+done:
+	free(dhcping->targets);
+	dhcping->targets = NULL;
+	dhcping->ntargets = 0;
+}
+
+static int
+dhcping_reload_cmp(const void *a, const void *b)
+{
+	const struct dhcping_probe *pa = *(struct dhcping_probe * const *)a;
+	const struct dhcping_probe *pb = *(struct dhcping_probe * const *)b;
+
+	if (pa->server != pb->server)
+		return ((uintptr_t)pa->server < (uintptr_t)pb->server ? -1 : 1);
+
+	return (memcmp(&pa->ea, &pb->ea, sizeof(pa->ea)));
+}
+
+/* the same target can be listed more than once, so skip probes in use */
+static struct dhcping_probe *
+dhcping_reload_find(struct dhcping_probe **probes, size_t n,
+    const struct dhcping_target *target)
+{
+	struct dhcping_probe key, *pkey = &key;
+	size_t lo = 0, hi = n, mid;
+
+	key.server = target->server;
+	key.ea = target->ea;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (dhcping_reload_cmp(&probes[mid], &pkey) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < n && dhcping_reload_cmp(&probes[lo], &pkey) == 0; lo++) {
+		if (probes[lo]->stale)
+			return (probes[lo]);
+	}
+
+	return (NULL);
+}
+
+static void
+dhcping_histogram_add(struct dhcping_histogram *hist,
+    const struct timespec *ts)
+{
+	uint64_t ns;
+	unsigned int i;
+
+	ns = (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+	for (i = 0; i < DHCPING_BUCKETS; i++) {
+		if (ns <= dhcping_bounds[i])
+			break;
+	}
+
+	hist->buckets[i]++;
+	hist->count++;
+	hist->sum += ns;
+}
+
+/*
+ * The metrics listener is given as [address:]port. It's bound before
+ * the chroot like the DHCP socket.
+ */
+static int
+dhcping_metrics_bind(const char *metrics)
+{
+	struct addrinfo *res, *res0;
+	char *host, *port;
+	int serrno;
+	int error;
+	int s = -1;
+	int on = 1;
+	const char *cause;
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE,
+	};
+
+	host = strdup(metrics);
+	if (host == NULL)
+		err(1, "metrics address");
+
+	port = strrchr(host, ':');
+	if (port == NULL) {
+		port = host;
+		host = NULL;
+	} else {
+		*port++ = '\0';
+		if (*host == '\0' || strcmp(host, "*") == 0)
+			host = NULL;
+	}
+
+	error = getaddrinfo(host, port, &hints, &res0);
+	if (error) {
+		errx(1, "metrics address %s: %s", metrics,
+		    gai_strerror(error));
+	}
+
+	for (res = res0; res != NULL; res = res->ai_next) {
+		s = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK,
+		    res->ai_protocol);
+		if (s == -1) {
+			serrno = errno;
+			cause = "socket";
+			continue;
+		}
+
+		if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR,
+		    &on, sizeof(on)) == -1)
+			err(1, "metrics reuseaddr");
+
+		if (bind(s, res->ai_addr, res->ai_addrlen) == -1) {
+			serrno = errno;
+			cause = "bind";
+			close(s);
+			s = -1;
+			continue;
+		}
+
+		if (listen(s, 5) == -1) {
+			serrno = errno;
+			cause = "listen";
+			close(s);
+			s = -1;
+			continue;
+		}
+
+		break;  /* okay we got one */
+	}
+
+	if (s == -1)
+		errc(1, serrno, "metrics address %s %s", metrics, cause);
+
+	freeaddrinfo(res0);
+
+	return (s);
+}
+
+static void
+dhcping_metrics_accept(int fd, short revents, void *arg)
+{
+	struct dhcping *dhcping = arg;
+	struct dhcping_http *conn;
+	int s;
+
+	s = accept4(fd, NULL, NULL, SOCK_NONBLOCK);
+	if (s == -1) {
+		switch (errno) {
 		case EINTR:
 		case EAGAIN:
-			goto retry;
+		case ECONNABORTED:
+			return;
+		case EMFILE:
+		case ENFILE:
+			warn("metrics accept");
+			return;
 		default:
-			break;
+			err(1, "metrics accept");
+		}
+	}
+
+	conn = calloc(1, sizeof(*conn));
+	if (conn == NULL) {
+		warn("metrics connection");
+		close(s);
+		return;
+	}
+	conn->dhcping = dhcping;
+	conn->s = s;
+
+	conn->bev = bufferevent_new(s, dhcping_http_read,
+	    dhcping_http_write, dhcping_http_error, conn);
+	if (conn->bev == NULL) {
+		warn("metrics connection");
+		close(s);
+		free(conn);
+		return;
+	}
+
+	bufferevent_settimeout(conn->bev,
+	    DHCP_HTTP_TIMEOUT, DHCP_HTTP_TIMEOUT);
+	bufferevent_enable(conn->bev, EV_READ);
+}
+
+/*
+ * This is only enough HTTP for a scraper. The request line picks the
+ * page, the headers are skipped, and the connection is closed once
+ * the reply has been written.
+ */
+static void
+dhcping_http_read(struct bufferevent *bev, void *arg)
+{
+	struct dhcping_http *conn = arg;
+	struct evbuffer *input = EVBUFFER_INPUT(bev);
+	char *line, *method, *path;
+
+	while ((line = evbuffer_readln(input, NULL,
+	    EVBUFFER_EOL_CRLF)) != NULL) {
+		if (conn->lines++ == 0) {
+			path = line;
+			method = strsep(&path, " ");
+			if (path != NULL)
+				path = strsep(&path, " ");
+
+			conn->found = strcmp(method, "GET") == 0 &&
+			    path != NULL && strcmp(path, "/metrics") == 0;
+		} else if (*line == '\0') {
+			free(line);
+			dhcping_http_reply(conn);
+			return;
 		}
 
-		err(1, "transmit");
+		free(line);
 	}
 
-	if (--dhcping->retries == 0)
+	if (EVBUFFER_LENGTH(input) > DHCP_HTTP_HEADERS)
+		dhcping_http_close(conn);
+}
+
+static void
+dhcping_http_reply(struct dhcping_http *conn)
+{
+	struct evbuffer *body;
+	const char *status = "200 OK";
+
+	body = evbuffer_new();
+	if (body == NULL) {
+		dhcping_http_close(conn);
 		return;
+	}
+
+	if (conn->found)
+		dhcping_metrics(conn->dhcping, body);
+	else {
+		status = "404 Not Found";
+		evbuffer_add_printf(body, "not found\n");
+	}
+
+	bufferevent_disable(conn->bev, EV_READ);
+	evbuffer_add_printf(EVBUFFER_OUTPUT(conn->bev),
+	    "HTTP/1.0 %s\r\n"
+	    "Content-Type: text/plain; version=0.0.4\r\n"
+	    "Content-Length: %zu\r\n"
+	    "Connection: close\r\n"
+	    "\r\n", status, EVBUFFER_LENGTH(body));
+	bufferevent_write_buffer(conn->bev, body);
+	evbuffer_free(body);
+
+	conn->replied = 1;
+}
+
+static void
+dhcping_http_write(struct bufferevent *bev, void *arg)
+{
+	struct dhcping_http *conn = arg;
+
+	if (conn->replied)
+		dhcping_http_close(conn);
+}
+
+static void
+dhcping_http_error(struct bufferevent *bev, short what, void *arg)
+{
+	struct dhcping_http *conn = arg;
+
+	dhcping_http_close(conn);
+}
+
+static void
+dhcping_http_close(struct dhcping_http *conn)
+{
+	bufferevent_free(conn->bev);
+	close(conn->s);
+	free(conn);
+}
+
+/*
+ * Write out the totals in the Prometheus text format.
+ */
+static void
+dhcping_metrics(struct dhcping *dhcping, struct evbuffer *buf)
+{
+	struct dhcping_server *server;
+	struct dhcping_probe *probe;
+	unsigned int i;
+
+	evbuffer_add_printf(buf,
+	    "# HELP dhcping_packets_sent_total DHCP packets sent.\n"
+	    "# TYPE dhcping_packets_sent_total counter\n");
+	TAILQ_FOREACH(server, &dhcping->servers, entry) {
+		evbuffer_add_printf(buf,
+		    "dhcping_packets_sent_total{%s} %llu\n",
+		    server->labels, (unsigned long long)server->sent);
+	}
+
+	evbuffer_add_printf(buf,
+	    "# HELP dhcping_replies_total Replies matched to a check.\n"
+	    "# TYPE dhcping_replies_total counter\n");
+	TAILQ_FOREACH(server, &dhcping->servers, entry) {
+		evbuffer_add_printf(buf,
+		    "dhcping_replies_total{%s} %llu\n",
+		    server->labels, (unsigned long long)server->replies);
+	}
+
+	evbuffer_add_printf(buf,
+	    "# HELP dhcping_timeouts_total Checks that got no reply.\n"
+	    "# TYPE dhcping_timeouts_total counter\n");
+	TAILQ_FOREACH(server, &dhcping->servers, entry) {
+		evbuffer_add_printf(buf,
+		    "dhcping_timeouts_total{%s} %llu\n",
+		    server->labels,
+		    (unsigned long long)server->results[DHCPING_S_DOWN]);
+	}
+
+	evbuffer_add_printf(buf,
+	    "# HELP dhcping_checks_total Finished checks by result.\n"
+	    "# TYPE dhcping_checks_total counter\n");
+	TAILQ_FOREACH(server, &dhcping->servers, entry) {
+		for (i = DHCPING_S_UP; i < DHCPING_S_MAX; i++) {
+			evbuffer_add_printf(buf, "dhcping_checks_total"
+			    "{%s,result=\"%s\"} %llu\n",
+			    server->labels, dhcping_states[i],
+			    (unsigned long long)server->results[i]);
+		}
+	}
+
+	evbuffer_add_printf(buf,
+	    "# HELP dhcping_ignored_total Packets that weren't used.\n"
+	    "# TYPE dhcping_ignored_total counter\n");
+	for (i = 0; i < DHCPING_I_MAX; i++) {
+		evbuffer_add_printf(buf,
+		    "dhcping_ignored_total{reason=\"%s\"} %llu\n",
+		    dhcping_ignores[i],
+		    (unsigned long long)dhcping->ignored[i]);
+	}
+
+	evbuffer_add_printf(buf,
+	    "# HELP dhcping_up Whether the last check of a target passed.\n"
+	    "# TYPE dhcping_up gauge\n");
+	TAILQ_FOREACH(probe, &dhcping->probes, entry) {
+		/* targets that haven't been checked yet aren't known */
+		if (probe->last == DHCPING_S_IDLE)
+			continue;
+
+		evbuffer_add_printf(buf,
+		    "dhcping_up{%s,mac=\"%s\"} %d\n",
+		    probe->server->labels, ether_ntoa(&probe->ea),
+		    probe->last == DHCPING_S_UP);
+	}
+
+	if (dhcping->dora) {
+		evbuffer_add_printf(buf, "# HELP dhcping_rtt_seconds "
+		    "Time from a DISCOVER to its OFFER.\n");
+	} else {
+		evbuffer_add_printf(buf, "# HELP dhcping_rtt_seconds "
+		    "Round trip time of a check.\n");
+	}
+	evbuffer_add_printf(buf, "# TYPE dhcping_rtt_seconds histogram\n");
+	TAILQ_FOREACH(server, &dhcping->servers, entry) {
+		dhcping_histogram_print(buf, "dhcping_rtt_seconds",
+		    server, &server->rtt);
+	}
+
+	if (dhcping->dora) {
+		evbuffer_add_printf(buf,
+		    "# HELP dhcping_ack_rtt_seconds "
+		    "Time from a REQUEST to its ACK.\n"
+		    "# TYPE dhcping_ack_rtt_seconds histogram\n");
+		TAILQ_FOREACH(server, &dhcping->servers, entry) {
+			dhcping_histogram_print(buf,
+			    "dhcping_ack_rtt_seconds", server,
+			    &server->commit);
+		}
+	}
+}
+
+static void
+dhcping_histogram_print(struct evbuffer *buf, const char *name,
+    const struct dhcping_server *server, const struct dhcping_histogram *hist)
+{
+	uint64_t count = 0;
+	unsigned int i;
+
+	for (i = 0; i < DHCPING_BUCKETS; i++) {
+		count += hist->buckets[i];
+		evbuffer_add_printf(buf,
+		    "%s_bucket{%s,le=\"%g\"} %llu\n",
+		    name, server->labels, dhcping_bounds[i] / 1000000000.0,
+		    (unsigned long long)count);
+	}
+
+	evbuffer_add_printf(buf,
+	    "%s_bucket{%s,le=\"+Inf\"} %llu\n"
+	    "%s_sum{%s} %.9f\n"
+	    "%s_count{%s} %llu\n",
+	    name, server->labels, (unsigned long long)hist->count,
+	    name, server->labels, hist->sum / 1000000000.0,
+	    name, server->labels, (unsigned long long)hist->count);
+}
+
+/*
+ * Daemon mode keeps the socket from the setup above and runs a check
+ * for every line read on stdin. A line may contain a mac address to
+ * use instead of the first -h argument, and then the name of the server
+ * to check if it's not the first one. Each check is answered on stdout
+ * with "up <rtt ms>", "down" and why if a reply didn't pass, or
+ * "error <reason>", in order.
+ */
+static void
+dhcping_daemon(struct dhcping *dhcping)
+{
+	struct dhcping_server *server;
+
+	server = TAILQ_FIRST(&dhcping->servers);
+	if (server == NULL)
+		errx(1, "no servers to check");
+
+	dhcping->ctl_probe = dhcping_probe_get(dhcping, server,
+	    dhcping->ea_set ? &dhcping->ea : NULL);
+
+	/* answers are short, let stdio push each one out as it's made */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	dhcping->ctl = bufferevent_new(STDIN_FILENO,
+	    dhcping_ctl_read, NULL, dhcping_ctl_error, dhcping);
+	if (dhcping->ctl == NULL)
+		err(1, "control input");
+
+	evtimer_set(&dhcping->ctl_next, dhcping_ctl_next, dhcping);
+	bufferevent_enable(dhcping->ctl, EV_READ);
+}
+
+static void
+dhcping_ctl_next(int fd, short revents, void *arg)
+{
+	struct dhcping *dhcping = arg;
+
+	dhcping_ctl_read(dhcping->ctl, dhcping);
+}
+
+static void
+dhcping_ctl_read(struct bufferevent *bev, void *arg)
+{
+	struct dhcping *dhcping = arg;
+	struct dhcping_probe *probe = dhcping->ctl_probe;
+	struct dhcping_server *server;
+	const struct ether_addr *ea;
+	char *line, *s, *word;
+	char *words[2];
+	size_t n;
+
+	while (probe->state != DHCPING_S_WAIT &&
+	    (line = evbuffer_readln(EVBUFFER_INPUT(bev), NULL,
+	    EVBUFFER_EOL_LF)) != NULL) {
+		n = 0;
+		s = line;
+		while ((word = strsep(&s, " \t\r")) != NULL) {
+			if (*word == '\0')
+				continue;
+			if (n == sizeof(words) / sizeof(words[0]))
+				break;
+			words[n++] = word;
+		}
+
+		if (word != NULL)
+			printf("error too many arguments\n");
+		else if (n > 0 && (ea = ether_aton(words[0])) == NULL)
+			printf("error invalid mac\n");
+		else if (n == 0 && !dhcping->ea_set)
+			printf("error no mac\n");
+		else if (n > 1 &&
+		    (server = dhcping_server_find(dhcping, words[1], NULL)) == NULL)
+			printf("error unknown server\n");
+		else {
+			probe->ea = (n > 0) ? *ea : dhcping->ea;
+			probe->server = (n > 1) ?
+			    server : TAILQ_FIRST(&dhcping->servers);
+			probe->tmpl = probe->server->tmpl;
+			dhcping_check(probe);
+		}
+
+		free(line);
+	}
 
-	dhcping->secs += dhcping->interval.tv_sec;
-	evtimer_add(&dhcping->retry, &dhcping->interval);
+	/* stdin is closed and every check has been answered */
+	if (dhcping->eof && probe->state != DHCPING_S_WAIT)
+		exit(0);
 }
 
 static void
-dhcping_maxwait(int fd, short revents, void *arg)
+dhcping_ctl_error(struct bufferevent *bev, short what, void *arg)
 {
 	struct dhcping *dhcping = arg;
 
-	if (dhcping->verbose)
-		warnx("timeout waiting for reply");
+	if (!(what & EVBUFFER_EOF))
+		errx(1, "control input error");
 
-	exit(2);
+	dhcping->eof = 1;
+	dhcping_ctl_read(bev, dhcping);
 }
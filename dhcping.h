@@ -0,0 +1,761 @@
+/*
+ * Copyright (c) 2019 The University of Queensland
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "libdhcping.h"
+
+#define DHCP_USER "_dhcp"
+#define DHCP_PORT "bootps"
+#define DHCP_PORT_NUM	67
+
+/* number of packets to try sending */
+#define DHCP_TRIES_MIN		1
+#define DHCP_TRIES_MAX		32
+#define DHCP_TRIES_DEFAULT	3
+
+/* how long between packet sends in msec */
+#define DHCP_IVAL_MIN		10
+#define DHCP_IVAL_MAX		10000
+#define DHCP_IVAL_DEFAULT	2000
+
+/*
+ * Rate limits let this many msec worth of packets go out together, and
+ * always at least a couple so being woken up late doesn't lose tokens.
+ */
+#define DHCP_LIMIT_BURST	10
+#define DHCP_LIMIT_DEPTH	2
+#define DHCP_TOKEN		1000000000ULL
+
+/* maximum wait time in msec */
+#define DHCP_MAXWAIT_MIN	10
+#define DHCP_MAXWAIT_MAX	60000
+#define DHCP_MAXWAIT_DEFAULT	8000
+
+/*
+ * Packets are padded to the BOOTP minimum, and only grow past it when
+ * the options need the room, up to what every server has to accept.
+ */
+#define DHCP_PACKET_MAX		(576 - DHCP_UDP_OVERHEAD)
+
+/* how many packets to move per syscall */
+#define DHCP_BATCH		64
+
+/* sendmmsg and recvmmsg came along with MSG_WAITFORONE */
+#ifdef MSG_WAITFORONE
+#define HAVE_MMSG
+#endif
+
+/*
+ * Building with USDT=yes puts USDT probes where -T takes its
+ * timestamps, see dhcping.d. Otherwise they aren't there at all.
+ */
+#ifdef DHCPING_USDT
+#include <sys/sdt.h>
+#define DHCPING_USDT2(name, a, b)	DTRACE_PROBE2(dhcping, name, a, b)
+#define DHCPING_USDT3(name, a, b, c)	DTRACE_PROBE3(dhcping, name, a, b, c)
+#else
+#define DHCPING_USDT2(name, a, b)	do { } while (0)
+#define DHCPING_USDT3(name, a, b, c)	do { } while (0)
+#endif
+
+/* packets a -T trace has room for */
+#define DHCP_TRACE_TX		8
+
+struct dhcping;
+struct dhcping_probe;
+
+/*
+ * Options a probe sends besides the ones the protocol needs. Each
+ * different set is encoded once and shared by every template using it.
+ */
+struct dhcping_opt {
+	uint8_t			code;
+	uint8_t			len;
+	uint8_t			data[DHCP_OPTION_MAXLEN];
+};
+
+struct dhcping_optset {
+	TAILQ_ENTRY(dhcping_optset) entry;
+	uint8_t			buf[DHCP_OPTION_LEN];
+	size_t			len;
+	size_t			release;	/* what a RELEASE gets */
+};
+
+TAILQ_HEAD(dhcping_optsets, dhcping_optset);
+
+/*
+ * The packet for each giaddr and option set is built once, and probes
+ * start from a copy of it. DHCPv6 templates are a Relay-Forw from the
+ * link address instead, and never have extra options.
+ */
+struct dhcping_template {
+	TAILQ_ENTRY(dhcping_template) entry;
+	int			af;
+	struct in_addr		giaddr;
+	struct in6_addr		linkaddr;
+	const struct dhcping_optset *optset;
+	uint8_t			packet[DHCP_PACKET_MAX];
+	size_t			len;
+	size_t			end;		/* where DHO_END is */
+};
+
+TAILQ_HEAD(dhcping_templates, dhcping_template);
+
+/*
+ * A token bucket for -L and -P. Tokens are kept in nsec worth of the
+ * rate so refilling doesn't lose the remainders, and a packet costs
+ * DHCP_TOKEN of them.
+ */
+struct dhcping_limit {
+	uint32_t		rate;		/* packets per second */
+	uint64_t		tokens;
+	uint64_t		depth;
+	struct timespec		last;
+};
+
+#define DHCPING_S_MAX		(DHCPING_S_OPTS + 1)
+
+/*
+ * Monitor mode keeps running totals for each server rather than every
+ * round trip time. Histogram buckets are counted separately here and
+ * only added up when they're exported.
+ */
+#define DHCPING_BUCKETS		12
+
+struct dhcping_histogram {
+	uint64_t		buckets[DHCPING_BUCKETS + 1];
+	uint64_t		count;
+	uint64_t		sum;		/* nsec */
+};
+
+/*
+ * Servers are resolved once at startup, and the daemon and monitor
+ * mode look names up again in the background. The giaddr is the local
+ * address the kernel will send packets to this server from, which is
+ * where the server is going to send its replies. With -g a server is
+ * checked from each relay address separately. A name that only has an
+ * IPv6 address is a DHCPv6 server, and gets relayed SOLICITs from the
+ * linkaddr instead.
+ */
+struct dhcping_server {
+	TAILQ_ENTRY(dhcping_server) entry;
+	struct dhcping		*dhcping;
+	char			*name;
+	char			*labels;	/* for metrics */
+
+	int			af;
+	struct sockaddr_in	sin;
+	struct in_addr		giaddr;
+	struct sockaddr_in6	sin6;
+	struct in6_addr		linkaddr;
+	struct dhcping_template	*tmpl;
+	int			named;		/* not an address */
+	struct event		refresh;
+	struct timespec		lookup;		/* when a refresh started */
+
+	/* how long setting it up took, for -T */
+	struct timespec		resolve;
+	struct timespec		connect;
+
+	/* monitor mode totals */
+	uint64_t		sent;
+	uint64_t		replies;
+	uint64_t		results[DHCPING_S_MAX];
+	struct dhcping_histogram rtt;
+	struct dhcping_histogram commit;
+
+	/* -P */
+	struct dhcping_limit	limit;
+
+	/* smoothed round trip time for -A, like TCP's */
+	uint32_t		srtt;		/* usec */
+	uint32_t		rttvar;		/* usec */
+	int			srtt_set;
+};
+
+TAILQ_HEAD(dhcping_servers, dhcping_server);
+
+/*
+ * With -a a check goes through the whole DORA exchange, and with -k a
+ * target that still has a lease renews it instead.
+ */
+enum dhcping_phase {
+	DHCPING_P_DISCOVER,
+	DHCPING_P_REQUEST,
+	DHCPING_P_RENEW,
+	DHCPING_P_INFORM,
+};
+
+/*
+ * What's known about the lease a target got, with the times in
+ * time(3) seconds. The server, giaddr, and mac only matter for finding
+ * it in a lease file, see dhcping_leases_init.
+ */
+struct dhcping_lease {
+	struct in_addr		server;
+	struct in_addr		giaddr;
+	struct ether_addr	ea;
+	uint16_t		pad;
+	struct in_addr		addr;		/* INADDR_ANY if none */
+	struct in_addr		serverid;
+	int64_t			t1;
+	int64_t			t2;
+	int64_t			expiry;
+};
+
+struct dhcping_leases {
+	char			magic[8];
+	uint32_t		version;
+	uint32_t		nslots;		/* a power of 2 */
+	struct dhcping_lease	slots[];
+};
+
+/*
+ * Probe timers go on a hashed wheel instead of libevent's heap, so
+ * that arming and cancelling them costs the same however many probes
+ * are in flight.
+ */
+struct dhcping_timer {
+	LIST_ENTRY(dhcping_timer) entry;
+	uint64_t		when;		/* tick it's due */
+	int			pending;
+	void			(*fn)(void *);
+	void			*arg;
+};
+
+LIST_HEAD(dhcping_timers, dhcping_timer);
+
+struct dhcping_wheel {
+	struct dhcping_timers	*buckets;
+	uint64_t		mask;
+	uint64_t		now;		/* next tick to run */
+	uint64_t		next;		/* what ev is set for, or 0 */
+	unsigned int		n;		/* timers pending */
+	struct event		ev;
+};
+
+/*
+ * With -T a check keeps when it got to each step on the way, so a
+ * slow one can be put down to the send, the network, or the server.
+ */
+struct dhcping_trace {
+	struct timespec		start;
+	struct timespec		tx[DHCP_TRACE_TX];	/* handed to the kernel */
+	unsigned int		ntx;
+	struct timespec		sent;		/* first send returned */
+	struct timespec		rx;		/* last reply arrived */
+	struct timespec		valid;		/* and was checked */
+};
+
+/*
+ * A probe is a check of one mac address against one server. It has
+ * its own packet and xid, and its own retry and maxwait timers. Probes
+ * come from a pool that's allocated at startup, and grown if reloading
+ * the targets file adds more.
+ */
+struct dhcping_probe {
+	TAILQ_ENTRY(dhcping_probe) entry;
+	LIST_ENTRY(dhcping_probe) wait;
+	TAILQ_ENTRY(dhcping_probe) tx;
+	int			queued;
+	struct dhcping		*dhcping;
+	struct dhcping_server	*server;
+	struct sockaddr_in	sin;		/* where this check went */
+	struct dhcping_template	*tmpl;
+	unsigned int		index;		/* target number */
+	int			file;		/* from the targets file */
+	int			stale;		/* not seen by a reload yet */
+
+	uint8_t			packet[DHCP_PACKET_MAX];
+	size_t			len;
+	struct ether_addr	ea;
+
+	enum dhcping_state	state;
+	enum dhcping_state	last;		/* previous result */
+	enum dhcping_phase	phase;
+	unsigned int		retries;
+	unsigned int		rounds;
+	uint32_t		elapsed;	/* msec since the first try */
+	uint32_t		rto;		/* usec until the next try */
+	unsigned int		attempts;	/* packets sent */
+	unsigned int		answered;	/* attempt that got a reply */
+	uint32_t		xid;
+	int			type;		/* of the last reply */
+	int			error;		/* errno if it couldn't be made */
+	const char		*cause;
+	struct timespec		sent;		/* last packet went out */
+	struct timespec		rtt;		/* DISCOVER to OFFER */
+
+	struct in_addr		yiaddr;
+	struct in_addr		serverid;
+	struct timespec		commit;		/* REQUEST to ACK */
+	struct dhcping_lease	*lease;		/* -k */
+	struct dhcping_lease	own;
+
+	struct dhcping_timer	retry;
+	struct dhcping_timer	maxwait;
+	struct event		next;		/* monitor mode */
+	uint32_t		period;		/* msec */
+
+	struct dhcping_trace	trace;		/* -T */
+
+	/* libdhcping */
+	void			(*cb)(const struct dhcping_answer *, void *);
+	void			*arg;
+};
+
+TAILQ_HEAD(dhcping_probes, dhcping_probe);
+LIST_HEAD(dhcping_bucket, dhcping_probe);
+
+struct dhcping_target {
+	struct dhcping_server	*server;
+	struct dhcping_template	*tmpl;
+	struct ether_addr	ea;
+	uint32_t		period;		/* msec */
+	int			file;
+};
+
+/*
+ * Replies are received into a ring of buffers that's big enough for
+ * a full batch of them.
+ */
+struct dhcping_rx {
+	struct sockaddr_in	sin;
+	struct sockaddr_in6	sin6;		/* DHCPv6 replies */
+	size_t			len;
+	union {
+		struct dhcp_packet	packet;
+		uint8_t			buf[DHCP_MTU_MAX];
+	}			u;
+
+	/* where each option's value starts in buf, or 0 if it's not there */
+	uint16_t		opts[256];
+	uint8_t			optlens[256];
+#ifdef SO_TIMESTAMP
+	union {
+		struct cmsghdr		hdr;
+		uint8_t			buf[CMSG_SPACE(sizeof(struct timeval))];
+	}			cmsg;
+	struct timeval		kstamp;
+	int			stamped;
+#endif
+};
+
+/*
+ * Round trip times for every successful check are kept so percentiles
+ * can be worked out at the end.
+ */
+struct dhcping_stats {
+	unsigned int		checks;
+	unsigned int		up;
+	unsigned int		down;
+
+	uint64_t		*rtt;		/* nsec */
+	size_t			nrtt;
+	size_t			rttsize;
+};
+
+enum dhcping_format {
+	DHCPING_F_TABLE,
+	DHCPING_F_JSON,
+	DHCPING_F_CSV,
+};
+
+enum dhcping_mode {
+	DHCPING_M_CHECK,
+	DHCPING_M_DAEMON,
+	DHCPING_M_BENCH,
+	DHCPING_M_MONITOR,
+	DHCPING_M_HEDGE,
+	DHCPING_M_VERDICT,
+	DHCPING_M_RESPOND,
+};
+
+/* why a packet on the socket didn't count as a reply to a probe */
+enum dhcping_ignore {
+	DHCPING_I_SHORT,
+	DHCPING_I_OP,
+	DHCPING_I_XID,
+	DHCPING_I_OPTIONS,
+	DHCPING_I_OFFER,
+	DHCPING_I_INCOMPLETE,
+	DHCPING_I_ACK,
+	DHCPING_I_HANDOFF,
+};
+#define DHCPING_I_MAX		(DHCPING_I_HANDOFF + 1)
+
+/*
+ * Single producer, single consumer queue between two threads. The
+ * producer fills in the slot from dhcping_ring_reserve() and then
+ * publishes it with dhcping_ring_commit(), the consumer works on the
+ * slot from dhcping_ring_peek() until it hands it back with
+ * dhcping_ring_consume().
+ */
+struct dhcping_ring {
+	_Atomic unsigned int	prod;
+	_Atomic unsigned int	cons;
+	unsigned int		mask;
+	size_t			size;
+	uint8_t			*slots;
+};
+
+/* a reply that arrived on another worker's socket */
+struct dhcping_handoff {
+	struct dhcping_rx	rx;
+	struct timespec		when;
+};
+
+/* what a worker tells the reporter about a finished check */
+struct dhcping_result {
+	unsigned int		index;
+	enum dhcping_state	state;
+	enum dhcping_phase	phase;
+	unsigned int		attempts;
+	unsigned int		answered;
+	uint32_t		xid;
+	int			type;
+	struct timespec		rtt;
+	struct timespec		commit;
+	struct in_addr		yiaddr;
+};
+
+/*
+ * With -j the targets are split between worker threads that each have
+ * their own event base, socket, servers, and probes. The top bits of
+ * every xid say which worker sent it so replies that land on the wrong
+ * socket can be passed on to the right one. Everything the workers
+ * share goes through the rings.
+ */
+struct dhcping_shards {
+	unsigned int		n;
+	unsigned int		shift;		/* xid bits below the worker */
+	struct dhcping		**workers;
+	struct dhcping_ring	*handoff;	/* n by n, from then to */
+	struct dhcping_ring	*results;
+	struct dhcping_probe	**probes;	/* the reporter's, by index */
+	_Atomic unsigned int	running;
+	struct event		tick;
+};
+
+/* a client of the metrics endpoint */
+struct dhcping_http {
+	struct dhcping		*dhcping;
+	int			s;
+	struct bufferevent	*bev;
+	int			lines;
+	int			found;
+	int			replied;
+};
+
+/*
+ * The benchmark starts probes with unique macs and xids at a steady
+ * rate, or as fast as replies free up room in the window, until the
+ * duration is up.
+ */
+struct dhcping_bench {
+	struct timeval		duration;
+	unsigned int		rate;		/* probes per second */
+	unsigned int		window;
+	uint64_t		started;
+	uint64_t		base;		/* first mac */
+	uint64_t		size;		/* how many macs from there */
+	int			range;		/* base and size came from -h */
+	int			shuffle;
+	uint32_t		key;		/* for shuffling the macs */
+	int			stopping;
+	struct dhcping_server	*next;
+
+	struct timespec		start;
+	struct timespec		stop;
+	struct event		tick;
+	struct event		end;
+};
+
+/*
+ * -R answers relayed requests instead of sending them, so the rest of
+ * dhcping can be pointed at something with a known latency and loss.
+ * Replies wait out the latency in a FIFO since they're all due in the
+ * order the requests came in.
+ */
+struct dhcping_response;
+
+struct dhcping_respond {
+	uint32_t		latency;	/* msec */
+	unsigned int		loss;		/* percent */
+	struct dhcping_response	*queue;
+	unsigned int		head;
+	unsigned int		tail;
+	struct event		timer;
+	struct event		sigint;
+	struct event		sigterm;
+
+	uint64_t		requests;
+	uint64_t		replies;
+	uint64_t		lost;		/* on purpose */
+	uint64_t		full;		/* no room in the queue */
+	uint64_t		ignored;
+	uint64_t		errors;		/* sends that failed */
+};
+
+/*
+ * All probes share the one unconnected socket, so replies are matched
+ * to the probe waiting on them via a hash of the xid, giaddr, and the
+ * address of the server the reply came from.
+ */
+struct dhcping {
+	enum dhcping_mode	mode;
+	struct event_base	*base;
+	const char		*local;
+	int			s;
+	int			rs;		/* where replies arrive */
+	struct in_addr		laddr;
+	struct event		input;
+
+	/* DHCPv6 goes on its own socket, once there's a server for it */
+	int			s6;
+	struct event		input6;
+	struct event		output6;
+
+	/* relay agent information, see dhcping_packet_rai */
+	const char		**circuits;
+	size_t			ncircuits;
+	const char		**remotes;
+	size_t			nremotes;
+	size_t			railen;		/* longest it can be */
+
+	/* -g sends from raw sockets as these relays */
+	int			raw;
+	struct in_addr		*relays;
+	size_t			nrelays;
+#ifndef __linux__
+	uint8_t			*bpfbuf;
+	size_t			bpflen;
+	size_t			bpfoff;
+	size_t			bpfend;
+#endif
+
+	struct dhcping_bucket	*hash;
+	uint32_t		hashmask;
+	int			error;		/* errno if the socket broke */
+	struct dhcping_wheel	wheel;
+
+	/* probes due to be sent are flushed together, within the limits */
+	struct dhcping_probes	txq;
+	struct event		flush;
+	struct dhcping_limit	limit;		/* -L */
+	uint32_t		server_rate;	/* -P */
+	struct event		output;
+	struct dhcping_rx	*rx;
+#ifdef HAVE_MMSG
+	struct mmsghdr		txmsgs[DHCP_BATCH];
+	struct iovec		txiov[DHCP_BATCH];
+	struct mmsghdr		rxmsgs[DHCP_BATCH];
+	struct iovec		rxiov[DHCP_BATCH];
+#endif
+
+	uint32_t		interval;	/* msec */
+	uint32_t		wait;		/* msec */
+	int			adaptive;
+	unsigned int		tries;
+	unsigned int		count;
+	uint32_t		xid;		/* checks started */
+	uint32_t		xid6;		/* DHCPv6 checks started */
+	uint32_t		xid_key;
+	uint32_t		xid_base;
+	uint32_t		xid_mask;
+
+	/* -j workers */
+	struct dhcping_shards	*shards;
+	unsigned int		shard;
+	int			wake[2];
+	struct event		wakeup;
+	uint32_t		kick;		/* workers with handoffs */
+
+	struct dhcping_servers	servers;
+	int			dns;		/* names are looked up again */
+	int			numeric;	/* only addresses from now on */
+	struct dhcping_templates templates;
+	struct dhcping_optsets	optsets;
+	struct dhcping_optset	*optset;	/* from -O */
+	struct dhcping_opt	*opts;
+	size_t			nopts;
+	struct dhcping_target	*targets;
+	size_t			ntargets;
+
+	/* the targets file is opened relative to its directory */
+	const char		*file;
+	int			filedir;
+	const char		*filename;
+
+	unsigned int		poolsize;
+	struct dhcping_probe	**pools;	/* what poolsize is made of */
+	size_t			npools;
+	struct dhcping_probes	idle;
+	struct dhcping_probes	probes;
+	unsigned int		nprobes;
+	unsigned int		nindex;		/* next target number */
+	unsigned int		pending;
+
+	struct dhcping_stats	stats;
+	struct dhcping_stats	commit;
+	int			table;
+
+	/* -F streams a record for every check instead */
+	enum dhcping_format	format;
+	struct evbuffer		*out;
+	struct event		outflush;
+
+	int			dora;
+	int			release;
+	int			keep;		/* -k */
+	struct dhcping_leases	*leases;
+
+	/* what a reply has to look like to count as up */
+	int			type;
+	struct in_addr		net;
+	struct in_addr		mask;
+	int			net_set;
+	uint8_t			*required;
+	size_t			nrequired;
+	unsigned int		failed[DHCPING_S_MAX];
+
+	unsigned int		verbose;
+	int			trace;		/* -T */
+	struct timespec		bind;		/* how long it took */
+
+	struct dhcping_bench	bench;
+
+	/* hedge mode */
+	uint32_t		hedge;		/* msec */
+	unsigned int		hedge_pct;
+	unsigned int		hedge_rounds;
+	struct dhcping_probe	*hedge_next;
+	struct timespec		hedge_start;
+	struct event		hedge_ev;
+
+	/* verdict mode */
+	unsigned int		verdict_need;
+	unsigned int		verdict_of;
+	uint32_t		verdict_rtt;	/* msec */
+	unsigned int		verdict_fast;
+
+	/* monitor mode */
+	struct timeval		period;
+	int			ms;
+	struct event		metrics;
+	struct event		reload;
+	uint64_t		ignored[DHCPING_I_MAX];
+
+	/* daemon mode */
+	struct ether_addr	ea;
+	int			ea_set;
+	int			eof;
+	struct bufferevent	*ctl;
+	struct dhcping_probe	*ctl_probe;
+	struct event		ctl_next;
+
+	struct dhcping_respond	respond;
+
+	/* called when a check has finished */
+	void			(*done)(struct dhcping_probe *,
+				    const struct timespec *);
+};
+
+#define DHCPING_T_MAX		(DHCPINFORM + 1)
+extern const char *dhcping_types[DHCPING_T_MAX];
+extern const char *dhcping_states[DHCPING_S_MAX];
+
+/* probe.c */
+int		dhcping_bind(const char *, int, const char **);
+struct dhcping_server *
+		dhcping_server_find(struct dhcping *, const char *,
+		    const struct in_addr *);
+struct dhcping_server *
+		dhcping_server_get(struct dhcping *, const char *,
+		    const struct in_addr *, const char **);
+int		dhcping_pool_init(struct dhcping *, unsigned int);
+struct dhcping_probe *
+		dhcping_probe_get(struct dhcping *, struct dhcping_server *,
+		    const struct ether_addr *);
+void		dhcping_probe_put(struct dhcping *, struct dhcping_probe *);
+int		dhcping_hash_init(struct dhcping *, unsigned int);
+int		dhcping_wheel_init(struct dhcping *);
+void		dhcping_timer_set(struct dhcping_timer *, void (*)(void *),
+		    void *);
+void		dhcping_timer_add(struct dhcping_wheel *,
+		    struct dhcping_timer *, uint32_t);
+void		dhcping_timer_del(struct dhcping_wheel *,
+		    struct dhcping_timer *);
+void		dhcping_hash_add(struct dhcping_probe *);
+struct dhcping_probe *
+		dhcping_match(struct dhcping *, const struct dhcping_rx *);
+int		dhcping_io_init(struct dhcping *);
+int		dhcping_recv(struct dhcping *);
+void		dhcping_events(struct dhcping *);
+void		dhcping_raw_open(struct dhcping *);
+void		dhcping_leases_init(struct dhcping *, const char *);
+void		dhcping_limit_init(struct dhcping_limit *, uint32_t);
+void		dhcping_pacing(int, uint32_t);
+void		dhcping_check(struct dhcping_probe *);
+uint64_t	dhcping_permute(uint64_t, uint64_t, uint32_t);
+double		dhcping_ms(const struct timespec *);
+uint64_t	dhcping_ns(const struct timespec *);
+void		dhcping_took(const struct timespec *, struct timespec *);
+void		dhcping_tv_ms(struct timeval *, uint32_t);
+void		dhcping_stop(struct dhcping_probe *);
+uint64_t	dhcping_ea_num(const struct ether_addr *);
+void		dhcping_ea_set(struct ether_addr *, uint64_t);
+void		dhcping_ring_init(struct dhcping_ring *, unsigned int,
+		    size_t);
+void		*dhcping_ring_reserve(struct dhcping_ring *);
+void		dhcping_ring_commit(struct dhcping_ring *);
+void		*dhcping_ring_peek(struct dhcping_ring *);
+void		dhcping_ring_consume(struct dhcping_ring *);
+void		dhcping_handoff(struct dhcping *, unsigned int,
+		    const struct dhcping_rx *, const struct timespec *);
+void		dhcping_wakeup(int, short, void *);
+
+/* packet.c */
+struct dhcp_packet *
+		dhcping_packet(struct dhcping_probe *);
+struct dhcping_template *
+		dhcping_template_get(struct dhcping *, struct in_addr,
+		    const struct dhcping_optset *);
+void		dhcping_packet_init(struct dhcping_template *);
+void		dhcping_packet_copy(struct dhcping_probe *, uint32_t);
+void		dhcping_packet_secs(struct dhcping_probe *);
+struct dhcping_template *
+		dhcping_template6_get(struct dhcping *,
+		    const struct in6_addr *);
+int		dhcping_parse6(const struct dhcping_rx *, uint32_t *, int *,
+		    int *);
+int		dhcping_parse(struct dhcping_rx *);
+const uint8_t *
+		dhcping_option(const struct dhcping_rx *, uint8_t, uint8_t *);
+int		dhcping_message_type(const struct dhcping_rx *);
+int		dhcping_type_parse(const char *);
+int		dhcping_option_parse(const char *);
+int		dhcping_opt_parse(const char *, struct dhcping_opt *);
+struct dhcping_optset *
+		dhcping_optset_get(struct dhcping *, const struct dhcping_opt *,
+		    size_t);
+size_t		dhcping_packet_dora(const struct dhcping_probe *, uint8_t *,
+		    uint8_t);
+size_t		dhcping_packet_len(const uint8_t *, const uint8_t *);
+uint8_t		*dhcping_packet_rai(const struct dhcping_probe *, uint8_t *);
+int		dhcping_rai_parse(const char *, size_t *);
+
+/* respond.c */
+void		dhcping_respond(struct dhcping *);
@@ -0,0 +1,314 @@
+/*
+ * Copyright (c) 2019 The University of Queensland
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+
+#include <event.h>
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/if_ether.h>
+#include <arpa/inet.h>
+
+#include "dhcp.h"
+#include "dhcping.h"
+
+/* how many checks the tables start out sized for */
+#define DHCP_LIB_WINDOW		64
+
+static void	dhcping_answer(struct dhcping_probe *,
+		    const struct timespec *);
+static void	dhcping_unwait(struct dhcping *);
+
+/*
+ * The same engine as the dhcping command, set up the way it would be
+ * for a plain check, except on the caller's event base. Nothing here
+ * looks names up, since that would block the caller's loop, so the
+ * local address and servers have to be given as addresses.
+ */
+struct dhcping *
+dhcping_open(struct event_base *base, const struct dhcping_config *conf,
+    const char **errstr)
+{
+	struct dhcping *dhcping;
+	struct sockaddr_in sin;
+	socklen_t sinlen = sizeof(sin);
+	struct in_addr addr;
+	unsigned int window;
+	int serrno;
+	int on = 1;
+
+	dhcping = calloc(1, sizeof(*dhcping));
+	if (dhcping == NULL) {
+		*errstr = strerror(errno);
+		return (NULL);
+	}
+
+	TAILQ_INIT(&dhcping->servers);
+	TAILQ_INIT(&dhcping->templates);
+	TAILQ_INIT(&dhcping->optsets);
+	TAILQ_INIT(&dhcping->idle);
+	TAILQ_INIT(&dhcping->probes);
+	TAILQ_INIT(&dhcping->txq);
+
+	dhcping->mode = DHCPING_M_CHECK;
+	dhcping->numeric = 1;
+	dhcping->base = base;
+	dhcping->s = -1;
+	dhcping->s6 = -1;
+	dhcping->filedir = AT_FDCWD;
+	dhcping->done = dhcping_answer;
+
+	dhcping->local = conf->local;
+	dhcping->tries = conf->tries ? conf->tries : DHCP_TRIES_DEFAULT;
+	dhcping->interval = conf->interval ?
+	    conf->interval : DHCP_IVAL_DEFAULT;
+	dhcping->wait = conf->wait ? conf->wait : DHCP_MAXWAIT_DEFAULT;
+	dhcping->adaptive = conf->adaptive;
+	dhcping->dora = conf->dora;
+	dhcping->release = conf->release;
+	window = conf->window ? conf->window : DHCP_LIB_WINDOW;
+
+	if (dhcping->local != NULL &&
+	    inet_pton(AF_INET, dhcping->local, &addr) != 1) {
+		*errstr = "local has to be an address";
+		goto fail;
+	}
+	if (dhcping->tries < DHCP_TRIES_MIN ||
+	    dhcping->tries > DHCP_TRIES_MAX) {
+		*errstr = "tries is out of range";
+		goto fail;
+	}
+	if (dhcping->interval < DHCP_IVAL_MIN ||
+	    dhcping->interval > DHCP_IVAL_MAX) {
+		*errstr = "interval is out of range";
+		goto fail;
+	}
+	if (dhcping->wait < DHCP_MAXWAIT_MIN ||
+	    dhcping->wait > DHCP_MAXWAIT_MAX) {
+		*errstr = "wait is out of range";
+		goto fail;
+	}
+	if (dhcping->release && !dhcping->dora) {
+		*errstr = "release requires dora";
+		goto fail;
+	}
+	if (!dhcping->adaptive &&
+	    dhcping->tries * dhcping->interval > dhcping->wait) {
+		*errstr = "tries by interval is longer than the wait";
+		goto fail;
+	}
+
+	dhcping->xid_mask = 0xffffffff;
+	dhcping->xid_key = arc4random();
+
+	dhcping->optset = dhcping_optset_get(dhcping, NULL, 0);
+	if (dhcping->optset == NULL) {
+		*errstr = "options";
+		goto fail;
+	}
+
+	dhcping->s = dhcping_bind(dhcping->local, 0, errstr);
+	if (dhcping->s == -1)
+		goto fail;
+	dhcping->rs = dhcping->s;
+
+	if (getsockname(dhcping->s, (struct sockaddr *)&sin, &sinlen) == -1)
+		goto syserr;
+	dhcping->laddr = sin.sin_addr;
+
+#ifdef SO_TIMESTAMP
+	if (setsockopt(dhcping->s, SOL_SOCKET, SO_TIMESTAMP,
+	    &on, sizeof(on)) == -1)
+		goto syserr;
+#endif
+
+	if (dhcping_pool_init(dhcping, window) == -1 ||
+	    dhcping_hash_init(dhcping, window) == -1 ||
+	    dhcping_wheel_init(dhcping) == -1 ||
+	    dhcping_io_init(dhcping) == -1)
+		goto syserr;
+
+	dhcping_events(dhcping);
+
+	return (dhcping);
+
+syserr:
+	serrno = errno;
+	dhcping_close(dhcping);
+	*errstr = strerror(serrno);
+	return (NULL);
+fail:
+	dhcping_close(dhcping);
+	return (NULL);
+}
+
+void
+dhcping_close(struct dhcping *dhcping)
+{
+	struct dhcping_server *server;
+	struct dhcping_template *tmpl;
+	struct dhcping_optset *optset;
+	size_t i;
+
+	if (event_initialized(&dhcping->input)) {
+		dhcping_unwait(dhcping);
+		event_del(&dhcping->input);
+		event_del(&dhcping->output);
+		evtimer_del(&dhcping->flush);
+		evtimer_del(&dhcping->wheel.ev);
+	}
+
+	if (dhcping->s != -1)
+		close(dhcping->s);
+	if (dhcping->s6 != -1) {
+		if (event_initialized(&dhcping->input6)) {
+			event_del(&dhcping->input6);
+			event_del(&dhcping->output6);
+		}
+		close(dhcping->s6);
+	}
+
+	while ((server = TAILQ_FIRST(&dhcping->servers)) != NULL) {
+		TAILQ_REMOVE(&dhcping->servers, server, entry);
+		free(server->name);
+		free(server->labels);
+		free(server);
+	}
+	while ((tmpl = TAILQ_FIRST(&dhcping->templates)) != NULL) {
+		TAILQ_REMOVE(&dhcping->templates, tmpl, entry);
+		free(tmpl);
+	}
+	while ((optset = TAILQ_FIRST(&dhcping->optsets)) != NULL) {
+		TAILQ_REMOVE(&dhcping->optsets, optset, entry);
+		free(optset);
+	}
+
+	for (i = 0; i < dhcping->npools; i++)
+		free(dhcping->pools[i]);
+	free(dhcping->pools);
+	free(dhcping->hash);
+	free(dhcping->wheel.buckets);
+	free(dhcping->rx);
+	free(dhcping);
+}
+
+/* servers are shared by every check sent to them */
+struct dhcping_server *
+dhcping_server(struct dhcping *dhcping, const char *name,
+    const char **errstr)
+{
+	return (dhcping_server_get(dhcping, name, NULL, errstr));
+}
+
+/*
+ * The check starts straight away. The callback runs from the event
+ * loop, and by then the probe has gone back to the pool, so it's fine
+ * to submit another check from it. The probe can only be cancelled
+ * until then. The loop that's running the callback carries on after
+ * it, which is why closing from there isn't allowed.
+ */
+struct dhcping_probe *
+dhcping_submit(struct dhcping *dhcping, struct dhcping_server *server,
+    const struct ether_addr *ea,
+    void (*cb)(const struct dhcping_answer *, void *), void *arg,
+    const char **errstr)
+{
+	struct dhcping_probe *probe;
+
+	if (dhcping->error != 0) {
+		*errstr = strerror(dhcping->error);
+		return (NULL);
+	}
+
+	/* the pool only ever grows to how many are out at once */
+	if (TAILQ_EMPTY(&dhcping->idle) &&
+	    dhcping_pool_init(dhcping, MAX(dhcping->poolsize, 1)) == -1) {
+		*errstr = strerror(errno);
+		return (NULL);
+	}
+
+	probe = dhcping_probe_get(dhcping, server, ea);
+	probe->cb = cb;
+	probe->arg = arg;
+
+	dhcping_check(probe);
+
+	return (probe);
+}
+
+/* the callback isn't run for a cancelled check */
+void
+dhcping_cancel(struct dhcping_probe *probe)
+{
+	if (probe->state != DHCPING_S_WAIT)
+		return;
+
+	dhcping_stop(probe);
+	dhcping_probe_put(probe->dhcping, probe);
+}
+
+const char *
+dhcping_state_name(enum dhcping_state state)
+{
+	if ((unsigned int)state >= DHCPING_S_MAX)
+		return ("unknown");
+
+	return (dhcping_states[state]);
+}
+
+static void
+dhcping_answer(struct dhcping_probe *probe, const struct timespec *reply)
+{
+	struct dhcping_answer answer = {
+		.state = probe->state,
+		.error = probe->error,
+		.attempts = probe->attempts,
+		.answered = probe->answered,
+		.type = probe->type,
+		.rtt = probe->rtt,
+		.commit = probe->commit,
+		.yiaddr = probe->yiaddr,
+		.serverid = probe->serverid,
+	};
+	void (*cb)(const struct dhcping_answer *, void *) = probe->cb;
+	void *arg = probe->arg;
+
+	dhcping_probe_put(probe->dhcping, probe);
+	cb(&answer, arg);
+}
+
+static void
+dhcping_unwait(struct dhcping *dhcping)
+{
+	struct dhcping_probe *probe;
+	uint32_t b;
+
+	for (b = 0; b <= dhcping->hashmask; b++) {
+		while ((probe = LIST_FIRST(&dhcping->hash[b])) != NULL)
+			dhcping_cancel(probe);
+	}
+}
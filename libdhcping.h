@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2019 The University of Queensland
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _LIBDHCPING_H_
+#define _LIBDHCPING_H_
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <time.h>
+
+/*
+ * The checks dhcping runs, for programs that already have a libevent
+ * loop. Everything happens on the caller's event_base: a check is
+ * submitted, and its callback runs from the loop once it's finished.
+ * Nothing in here exits or prints, errors come back as values.
+ *
+ * Nothing in here looks names up, because that would block the loop.
+ * The local address and servers have to be given as addresses, and
+ * resolving names is left to the caller, with evdns for example.
+ *
+ * Callbacks can run while a batch of replies or a socket error is
+ * still being handled. They can submit and cancel checks, but must
+ * not call dhcping_close.
+ */
+
+struct event_base;
+struct ether_addr;
+
+struct dhcping;
+struct dhcping_server;
+struct dhcping_probe;
+
+enum dhcping_state {
+	DHCPING_S_IDLE,
+	DHCPING_S_WAIT,
+	DHCPING_S_UP,
+	DHCPING_S_DOWN,
+	DHCPING_S_NAK,
+	DHCPING_S_TYPE,		/* reply was the wrong message type */
+	DHCPING_S_ADDR,		/* offered address outside -y prefix */
+	DHCPING_S_OPTS,		/* reply missing a -o option */
+};
+
+/* zeroed fields get the same defaults as the dhcping command */
+struct dhcping_config {
+	const char		*local;		/* address to bind, or any */
+	unsigned int		tries;
+	unsigned int		interval;	/* msec between tries */
+	unsigned int		wait;		/* msec until a check is down */
+	int			adaptive;	/* like -A */
+	int			dora;		/* like -a */
+	int			release;	/* like -x */
+	unsigned int		window;		/* checks expected at once */
+};
+
+struct dhcping_answer {
+	enum dhcping_state	state;
+	int			error;		/* errno if the socket broke */
+	unsigned int		attempts;	/* packets sent */
+	unsigned int		answered;	/* attempt that got a reply */
+	int			type;		/* of the last reply */
+	struct timespec		rtt;		/* DISCOVER to OFFER */
+	struct timespec		commit;		/* REQUEST to ACK */
+	struct in_addr		yiaddr;
+	struct in_addr		serverid;
+};
+
+struct dhcping	*dhcping_open(struct event_base *,
+		    const struct dhcping_config *, const char **);
+void		dhcping_close(struct dhcping *);
+struct dhcping_server *
+		dhcping_server(struct dhcping *, const char *, const char **);
+struct dhcping_probe *
+		dhcping_submit(struct dhcping *, struct dhcping_server *,
+		    const struct ether_addr *,
+		    void (*)(const struct dhcping_answer *, void *), void *,
+		    const char **);
+void		dhcping_cancel(struct dhcping_probe *);
+const char	*dhcping_state_name(enum dhcping_state);
+
+#endif /* _LIBDHCPING_H_ */
@@ -0,0 +1,905 @@
+/*
+ * Copyright (c) 2019 The University of Queensland
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <ctype.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <err.h>
+#include <stdatomic.h>
+
+#include <event.h>
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/if_ether.h>
+
+#include "dhcp.h"
+#include "dhcp6.h"
+#include "dhcping.h"
+
+const char *dhcping_types[DHCPING_T_MAX] = {
+	[DHCPDISCOVER] =	"discover",
+	[DHCPOFFER] =		"offer",
+	[DHCPREQUEST] =		"request",
+	[DHCPDECLINE] =		"decline",
+	[DHCPACK] =		"ack",
+	[DHCPNAK] =		"nak",
+	[DHCPRELEASE] =		"release",
+	[DHCPINFORM] =		"inform",
+};
+
+static int	dhcping_opt_prl(const char *, struct dhcping_opt *);
+static int	dhcping_opt_hex(const char *, struct dhcping_opt *);
+static int	dhcping_optset_put(struct dhcping_optset *, uint8_t,
+		    const uint8_t *, size_t);
+
+static int	dhcping_parse_field(struct dhcping_rx *, size_t, size_t,
+		    int *);
+static void	dhcping_packet6_init(struct dhcping_template *);
+static void	dhcping_packet6_copy(struct dhcping_probe *, uint32_t);
+static uint8_t	*dhcping_opt6_put(uint8_t *, uint16_t, uint16_t);
+static int	dhcping_opt6_find(const uint8_t *, const uint8_t *, uint16_t,
+		    const uint8_t **, uint16_t *);
+static uint8_t	*dhcping_rai_sub(uint8_t *, uint8_t, const char *,
+		    unsigned int);
+
+struct dhcp_packet *
+dhcping_packet(struct dhcping_probe *probe)
+{
+	return ((struct dhcp_packet *)probe->packet);
+}
+
+static const uint8_t dhcping_requested[] = {
+	DHO_SUBNET_MASK,
+	DHO_BROADCAST_ADDRESS,
+	DHO_TIME_OFFSET,
+	DHO_CLASSLESS_STATIC_ROUTES,
+	DHO_ROUTERS,
+	DHO_DOMAIN_NAME,
+	DHO_DOMAIN_SEARCH,
+	DHO_DOMAIN_NAME_SERVERS,
+	DHO_HOST_NAME,
+	DHO_BOOTFILE_NAME,
+	DHO_TFTP_SERVER,
+};
+
+struct dhcping_template *
+dhcping_template_get(struct dhcping *dhcping, struct in_addr giaddr,
+    const struct dhcping_optset *optset)
+{
+	struct dhcping_template *tmpl;
+
+	TAILQ_FOREACH(tmpl, &dhcping->templates, entry) {
+		if (tmpl->af == AF_INET &&
+		    tmpl->giaddr.s_addr == giaddr.s_addr &&
+		    tmpl->optset == optset)
+			return (tmpl);
+	}
+
+	tmpl = calloc(1, sizeof(*tmpl));
+	if (tmpl == NULL)
+		return (NULL);
+
+	tmpl->af = AF_INET;
+	tmpl->giaddr = giaddr;
+	tmpl->optset = optset;
+	dhcping_packet_init(tmpl);
+
+	TAILQ_INSERT_TAIL(&dhcping->templates, tmpl, entry);
+
+	return (tmpl);
+}
+
+/*
+ * Everything but the xid, chaddr, and secs is the same for every probe
+ * from a template, so it's only filled in here.
+ */
+void
+dhcping_packet_init(struct dhcping_template *tmpl)
+{
+	static const uint8_t cookie[DHCP_OPTIONS_COOKIE_LEN] =
+	    DHCP_OPTIONS_COOKIE;
+	struct dhcp_packet *p = (struct dhcp_packet *)tmpl->packet;
+	uint8_t *dho;
+
+	p->op = BOOTREQUEST;
+	p->htype = HTYPE_ETHER;
+	p->hlen = ETHER_ADDR_LEN;
+	p->hops = 1;
+	p->xid = 0;
+	p->secs = 0;
+	p->flags = 0;
+	p->giaddr = tmpl->giaddr;
+	memcpy(p->cookie, cookie, sizeof(cookie));
+
+	dho = (uint8_t *)(p + 1);
+
+	*dho++ = DHO_DHCP_MESSAGE_TYPE;
+	*dho++ = 1;
+	*dho++ = DHCPDISCOVER;
+
+	memcpy(dho, tmpl->optset->buf, tmpl->optset->len);
+	dho += tmpl->optset->len;
+
+	tmpl->end = dho - tmpl->packet;
+	*dho++ = DHO_END;
+	tmpl->len = dhcping_packet_len(tmpl->packet, dho);
+}
+
+/* a probe only differs from its template by xid, chaddr, and relay info */
+void
+dhcping_packet_copy(struct dhcping_probe *probe, uint32_t xid)
+{
+	struct dhcping *dhcping = probe->dhcping;
+	struct dhcp_packet *p = dhcping_packet(probe);
+	uint8_t *dho;
+
+	if (probe->tmpl->af == AF_INET6) {
+		dhcping_packet6_copy(probe, xid);
+		return;
+	}
+
+	memcpy(probe->packet, probe->tmpl->packet, probe->tmpl->len);
+	probe->len = probe->tmpl->len;
+
+	/* agent information is different for every probe */
+	if (dhcping->ncircuits > 0 || dhcping->nremotes > 0) {
+		dho = dhcping_packet_rai(probe,
+		    probe->packet + probe->tmpl->end);
+		*dho++ = DHO_END;
+		probe->len = dhcping_packet_len(probe->packet, dho);
+	}
+
+	p->xid = probe->xid = xid;
+	memcpy(p->chaddr, &probe->ea, sizeof(probe->ea));
+}
+
+/* how long the probe has been trying for, as of the next send */
+void
+dhcping_packet_secs(struct dhcping_probe *probe)
+{
+	struct dhcp_packet *p = dhcping_packet(probe);
+	uint16_t elapsed;
+
+	if (probe->tmpl->af == AF_INET6) {
+		/* in hundredths of a second */
+		elapsed = htons(MIN(probe->elapsed / 10, 0xffff));
+		memcpy(probe->packet + DHCP6_PROBE_ELAPSED, &elapsed,
+		    sizeof(elapsed));
+		return;
+	}
+
+	p->secs = htons(MIN(probe->elapsed / 1000, 0xffff));
+}
+
+struct dhcping_template *
+dhcping_template6_get(struct dhcping *dhcping, const struct in6_addr *linkaddr)
+{
+	struct dhcping_template *tmpl;
+
+	TAILQ_FOREACH(tmpl, &dhcping->templates, entry) {
+		if (tmpl->af == AF_INET6 &&
+		    IN6_ARE_ADDR_EQUAL(&tmpl->linkaddr, linkaddr))
+			return (tmpl);
+	}
+
+	tmpl = calloc(1, sizeof(*tmpl));
+	if (tmpl == NULL)
+		return (NULL);
+
+	tmpl->af = AF_INET6;
+	tmpl->linkaddr = *linkaddr;
+	dhcping_packet6_init(tmpl);
+
+	TAILQ_INSERT_TAIL(&dhcping->templates, tmpl, entry);
+
+	return (tmpl);
+}
+
+/*
+ * A DHCPv6 probe is a SOLICIT in a Relay-Forw from the link address, as
+ * if a client on that link had sent it. The elapsed time goes first so
+ * it's always in the same place, and the client's DUID and IAID are
+ * made from its mac like a real one's would be.
+ */
+static void
+dhcping_packet6_init(struct dhcping_template *tmpl)
+{
+	static const uint16_t oro[] = {
+		DHCP6_OPT_DNS_SERVERS,
+		DHCP6_OPT_DOMAIN_LIST,
+	};
+	uint8_t *p = tmpl->packet;
+	uint8_t *msg;
+	uint16_t v;
+	size_t i;
+
+	p[0] = DHCP6_RELAY_FORW;
+	p[1] = 0;	/* hop count */
+	memcpy(p + DHCP6_RELAY_LINK, &tmpl->linkaddr,
+	    sizeof(tmpl->linkaddr));
+	/* the peer address is the client's */
+
+	msg = dhcping_opt6_put(p + DHCP6_RELAY_LEN, DHCP6_OPT_RELAY_MSG, 0);
+	p = msg;
+	*p++ = DHCP6_SOLICIT;
+	p += 3;		/* transaction id */
+
+	p = dhcping_opt6_put(p, DHCP6_OPT_ELAPSED_TIME, sizeof(v));
+	p += sizeof(v);
+
+	p = dhcping_opt6_put(p, DHCP6_OPT_CLIENTID, 4 + ETHER_ADDR_LEN);
+	v = htons(DHCP6_DUID_LL);
+	memcpy(p, &v, sizeof(v));
+	v = htons(HTYPE_ETHER);
+	memcpy(p + 2, &v, sizeof(v));
+	p += 4 + ETHER_ADDR_LEN;
+
+	/* the IAID, and leaving T1 and T2 up to the server */
+	p = dhcping_opt6_put(p, DHCP6_OPT_IA_NA, 12);
+	p += 12;
+
+	p = dhcping_opt6_put(p, DHCP6_OPT_ORO, sizeof(oro));
+	for (i = 0; i < sizeof(oro) / sizeof(oro[0]); i++) {
+		v = htons(oro[i]);
+		memcpy(p, &v, sizeof(v));
+		p += sizeof(v);
+	}
+
+	v = htons(p - msg);
+	memcpy(msg - 2, &v, sizeof(v));
+
+	tmpl->len = tmpl->end = p - tmpl->packet;
+}
+
+/*
+ * The transaction id is only 24 bits, so the probe keeps the xid it
+ * would have had with the top byte cleared to match replies against.
+ * The peer address is the link-local address the mac would give the
+ * client.
+ */
+static void
+dhcping_packet6_copy(struct dhcping_probe *probe, uint32_t xid)
+{
+	const uint8_t *ea = probe->ea.ether_addr_octet;
+	uint8_t *peer = probe->packet + DHCP6_RELAY_PEER;
+	uint8_t *msg = probe->packet + DHCP6_PROBE_MSG;
+
+	memcpy(probe->packet, probe->tmpl->packet, probe->tmpl->len);
+	probe->len = probe->tmpl->len;
+
+	memset(peer, 0, sizeof(struct in6_addr));
+	peer[0] = 0xfe;
+	peer[1] = 0x80;
+	peer[8] = ea[0] ^ 0x02;
+	peer[9] = ea[1];
+	peer[10] = ea[2];
+	peer[11] = 0xff;
+	peer[12] = 0xfe;
+	peer[13] = ea[3];
+	peer[14] = ea[4];
+	peer[15] = ea[5];
+
+	/* dhcping_xid6 leaves the top byte clear */
+	probe->xid = xid;
+	memcpy(msg + 1, (uint8_t *)&probe->xid + 1, 3);
+
+	memcpy(probe->packet + DHCP6_PROBE_DUID + 4, ea, ETHER_ADDR_LEN);
+	memcpy(probe->packet + DHCP6_PROBE_IAID, ea + 2, 4);
+}
+
+static uint8_t *
+dhcping_opt6_put(uint8_t *p, uint16_t code, uint16_t len)
+{
+	code = htons(code);
+	len = htons(len);
+
+	memcpy(p, &code, sizeof(code));
+	memcpy(p + 2, &len, sizeof(len));
+
+	return (p + DHCP6_OPT_HDR_LEN);
+}
+
+/*
+ * Work out the transaction id, message type, and status of the message
+ * a Relay-Reply carries. The status is from the message, or from its
+ * first IA_NA if the message doesn't have one, which is where servers
+ * say they have no addresses these days.
+ */
+int
+dhcping_parse6(const struct dhcping_rx *rx, uint32_t *xid, int *type,
+    int *status)
+{
+	const uint8_t *end = rx->u.buf + rx->len;
+	const uint8_t *msg, *opt, *ia;
+	uint16_t len, ialen;
+
+	if (dhcping_opt6_find(rx->u.buf + DHCP6_RELAY_LEN, end,
+	    DHCP6_OPT_RELAY_MSG, &msg, &len) == -1 ||
+	    msg == NULL || len < DHCP6_MSG_LEN)
+		return (-1);
+	end = msg + len;
+
+	*type = msg[0];
+	*xid = 0;
+	memcpy((uint8_t *)xid + 1, msg + 1, 3);
+
+	if (dhcping_opt6_find(msg + DHCP6_MSG_LEN, end,
+	    DHCP6_OPT_STATUS_CODE, &opt, &len) == -1)
+		return (-1);
+	if (opt == NULL) {
+		if (dhcping_opt6_find(msg + DHCP6_MSG_LEN, end,
+		    DHCP6_OPT_IA_NA, &ia, &ialen) == -1)
+			return (-1);
+		if (ia != NULL && ialen >= 12 &&
+		    dhcping_opt6_find(ia + 12, ia + ialen,
+		    DHCP6_OPT_STATUS_CODE, &opt, &len) == -1)
+			return (-1);
+	}
+
+	*status = DHCP6_STATUS_SUCCESS;
+	if (opt != NULL) {
+		if (len < 2)
+			return (-1);
+		*status = opt[0] << 8 | opt[1];
+	}
+
+	return (0);
+}
+
+/*
+ * Find the first instance of an option between p and end. Every option
+ * is walked, so one running past the end makes the whole lot invalid.
+ */
+static int
+dhcping_opt6_find(const uint8_t *p, const uint8_t *end, uint16_t code,
+    const uint8_t **opt, uint16_t *optlen)
+{
+	uint16_t c, len;
+
+	*opt = NULL;
+
+	while (p < end) {
+		if (end - p < DHCP6_OPT_HDR_LEN)
+			return (-1);
+		c = p[0] << 8 | p[1];
+		len = p[2] << 8 | p[3];
+		p += DHCP6_OPT_HDR_LEN;
+		if (len > end - p)
+			return (-1);
+
+		if (c == code && *opt == NULL) {
+			*opt = p;
+			*optlen = len;
+		}
+		p += len;
+	}
+
+	return (0);
+}
+
+/*
+ * Index the options in a reply where they sit in the receive buffer.
+ * The options field is walked first, followed by the file and sname
+ * fields if the overload option says they carry options too. Only the
+ * first instance of an option is kept since concatenating split
+ * options would mean copying them. An option running past the end of
+ * its field makes the whole reply invalid.
+ */
+int
+dhcping_parse(struct dhcping_rx *rx)
+{
+	static const uint8_t cookie[DHCP_OPTIONS_COOKIE_LEN] =
+	    DHCP_OPTIONS_COOKIE;
+	int overload = 0;
+
+	memset(rx->opts, 0, sizeof(rx->opts));
+
+	/* a BOOTP reply just doesn't have any options */
+	if (memcmp(rx->u.packet.cookie, cookie, sizeof(cookie)) != 0)
+		return (0);
+
+	if (dhcping_parse_field(rx, sizeof(struct dhcp_packet), rx->len,
+	    &overload) == -1)
+		return (-1);
+
+	if (overload & 1) {
+		if (dhcping_parse_field(rx,
+		    offsetof(struct dhcp_packet, file),
+		    offsetof(struct dhcp_packet, cookie), NULL) == -1)
+			return (-1);
+	}
+	if (overload & 2) {
+		if (dhcping_parse_field(rx,
+		    offsetof(struct dhcp_packet, sname),
+		    offsetof(struct dhcp_packet, file), NULL) == -1)
+			return (-1);
+	}
+
+	return (0);
+}
+
+static int
+dhcping_parse_field(struct dhcping_rx *rx, size_t off, size_t end,
+    int *overload)
+{
+	const uint8_t *buf = rx->u.buf;
+	uint8_t code, len;
+
+	while (off < end) {
+		code = buf[off++];
+		if (code == DHO_PAD)
+			continue;
+		if (code == DHO_END)
+			return (0);
+
+		if (off == end)
+			return (-1);
+		len = buf[off++];
+		if (end - off < len)
+			return (-1);
+
+		if (code == DHO_DHCP_OPTION_OVERLOAD) {
+			/* only allowed in the options field itself */
+			if (overload == NULL || len != 1)
+				return (-1);
+			*overload = buf[off];
+		}
+
+		if (rx->opts[code] == 0) {
+			rx->opts[code] = off;
+			rx->optlens[code] = len;
+		}
+
+		off += len;
+	}
+
+	return (0);
+}
+
+const uint8_t *
+dhcping_option(const struct dhcping_rx *rx, uint8_t code, uint8_t *lenp)
+{
+	if (rx->opts[code] == 0)
+		return (NULL);
+
+	*lenp = rx->optlens[code];
+	return (rx->u.buf + rx->opts[code]);
+}
+
+int
+dhcping_message_type(const struct dhcping_rx *rx)
+{
+	const uint8_t *dho;
+	uint8_t len;
+
+	dho = dhcping_option(rx, DHO_DHCP_MESSAGE_TYPE, &len);
+	if (dho == NULL || len != 1)
+		return (-1);
+
+	return (*dho);
+}
+
+int
+dhcping_type_parse(const char *type)
+{
+	size_t i;
+
+	for (i = 1; i < DHCPING_T_MAX; i++) {
+		if (strcasecmp(type, dhcping_types[i]) == 0)
+			return (i);
+	}
+
+	return (-1);
+}
+
+int
+dhcping_option_parse(const char *option)
+{
+	static const struct {
+		const char	*name;
+		uint8_t		 code;
+	} options[] = {
+		{ "mask",	DHO_SUBNET_MASK },
+		{ "routers",	DHO_ROUTERS },
+		{ "dns",	DHO_DOMAIN_NAME_SERVERS },
+		{ "hostname",	DHO_HOST_NAME },
+		{ "domain",	DHO_DOMAIN_NAME },
+		{ "broadcast",	DHO_BROADCAST_ADDRESS },
+		{ "lease",	DHO_DHCP_LEASE_TIME },
+		{ "tftp",	DHO_TFTP_SERVER },
+		{ "bootfile",	DHO_BOOTFILE_NAME },
+		{ "search",	DHO_DOMAIN_SEARCH },
+		{ "routes",	DHO_CLASSLESS_STATIC_ROUTES },
+		{ "maxsize",	DHO_DHCP_MAX_MESSAGE_SIZE },
+		{ "prl",	DHO_DHCP_PARAMETER_REQUEST_LIST },
+		{ "vendor",	DHO_DHCP_CLASS_IDENTIFIER },
+		{ "clientid",	DHO_DHCP_CLIENT_IDENTIFIER },
+		{ "userclass",	DHO_DHCP_USER_CLASS_ID },
+	};
+	const char *errstr;
+	size_t i;
+	int code;
+
+	for (i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+		if (strcasecmp(option, options[i].name) == 0)
+			return (options[i].code);
+	}
+
+	code = strtonum(option, DHO_PAD + 1, DHO_END - 1, &errstr);
+	if (errstr != NULL)
+		return (-1);
+
+	return (code);
+}
+
+/*
+ * -O takes name=value. The parameter request list is a list of option
+ * names or numbers, and the maximum message size is a number. Anything
+ * else is sent as text, unless it's bytes in hex separated by colons.
+ */
+int
+dhcping_opt_parse(const char *arg, struct dhcping_opt *opt)
+{
+	char name[32];
+	const char *value;
+	const char *errstr;
+	size_t len;
+	int code;
+	int size;
+
+	value = strchr(arg, '=');
+	if (value == NULL || (size_t)(value - arg) >= sizeof(name))
+		return (-1);
+	memcpy(name, arg, value - arg);
+	name[value - arg] = '\0';
+	value++;
+
+	code = dhcping_option_parse(name);
+	if (code == -1)
+		return (-1);
+	opt->code = code;
+
+	switch (code) {
+	case DHO_DHCP_MESSAGE_TYPE:
+	case DHO_DHCP_OPTION_OVERLOAD:
+	case DHO_DHCP_REQUESTED_ADDRESS:
+	case DHO_DHCP_SERVER_IDENTIFIER:
+	case DHO_RELAY_AGENT_INFORMATION:
+		/* these are up to dhcping */
+		return (-1);
+	case DHO_DHCP_PARAMETER_REQUEST_LIST:
+		return (dhcping_opt_prl(value, opt));
+	case DHO_DHCP_MAX_MESSAGE_SIZE:
+		size = strtonum(value, 576, 65535, &errstr);
+		if (errstr != NULL)
+			return (-1);
+		opt->data[0] = size >> 8;
+		opt->data[1] = size & 0xff;
+		opt->len = 2;
+		return (0);
+	}
+
+	if (dhcping_opt_hex(value, opt) == 0)
+		return (0);
+
+	len = strlen(value);
+	if (len > sizeof(opt->data))
+		return (-1);
+	memcpy(opt->data, value, len);
+	opt->len = len;
+
+	return (0);
+}
+
+static int
+dhcping_opt_prl(const char *value, struct dhcping_opt *opt)
+{
+	char buf[1024];
+	char *s, *word;
+	int code;
+
+	if (strlcpy(buf, value, sizeof(buf)) >= sizeof(buf))
+		return (-1);
+
+	opt->len = 0;
+	s = buf;
+	while ((word = strsep(&s, ",")) != NULL) {
+		code = dhcping_option_parse(word);
+		if (code == -1 || opt->len == sizeof(opt->data))
+			return (-1);
+		opt->data[opt->len++] = code;
+	}
+
+	return (0);
+}
+
+/* xx:xx:... */
+static int
+dhcping_opt_hex(const char *value, struct dhcping_opt *opt)
+{
+	size_t len = strlen(value);
+	size_t i;
+	char hex[3];
+
+	if (len < 5 || len % 3 != 2 || (len + 1) / 3 > sizeof(opt->data))
+		return (-1);
+
+	for (i = 0; i < len; i += 3) {
+		if (!isxdigit((unsigned char)value[i]) ||
+		    !isxdigit((unsigned char)value[i + 1]) ||
+		    (i + 2 < len && value[i + 2] != ':'))
+			return (-1);
+	}
+
+	hex[2] = '\0';
+	for (i = 0; i < len; i += 3) {
+		hex[0] = value[i];
+		hex[1] = value[i + 1];
+		opt->data[i / 3] = strtoul(hex, NULL, 16);
+	}
+	opt->len = (len + 1) / 3;
+
+	return (0);
+}
+
+/*
+ * Work out the options a target sends by putting its own over the -O
+ * ones, and reuse the encoding of any earlier target that sends the
+ * same. The client identifier goes first so a RELEASE can take just
+ * that, and the parameter request list goes last.
+ */
+struct dhcping_optset *
+dhcping_optset_get(struct dhcping *dhcping, const struct dhcping_opt *extra,
+    size_t nextra)
+{
+	const struct dhcping_opt *bycode[256];
+	uint8_t order[256];
+	const struct dhcping_opt *opt;
+	struct dhcping_optset *set, *optset;
+	size_t i, n = 0;
+
+	memset(bycode, 0, sizeof(bycode));
+	for (i = 0; i < dhcping->nopts + nextra; i++) {
+		opt = i < dhcping->nopts ?
+		    &dhcping->opts[i] : &extra[i - dhcping->nopts];
+		if (bycode[opt->code] == NULL)
+			order[n++] = opt->code;
+		bycode[opt->code] = opt;
+	}
+
+	set = calloc(1, sizeof(*set));
+	if (set == NULL) {
+		warn("options");
+		return (NULL);
+	}
+
+	opt = bycode[DHO_DHCP_CLIENT_IDENTIFIER];
+	if (opt != NULL &&
+	    dhcping_optset_put(set, opt->code, opt->data, opt->len) == -1)
+		goto fail;
+	set->release = set->len;
+
+	for (i = 0; i < n; i++) {
+		opt = bycode[order[i]];
+		if (opt->code == DHO_DHCP_CLIENT_IDENTIFIER ||
+		    opt->code == DHO_DHCP_PARAMETER_REQUEST_LIST)
+			continue;
+		if (dhcping_optset_put(set, opt->code, opt->data,
+		    opt->len) == -1)
+			goto fail;
+	}
+
+	opt = bycode[DHO_DHCP_PARAMETER_REQUEST_LIST];
+	if (opt != NULL) {
+		if (dhcping_optset_put(set, opt->code, opt->data,
+		    opt->len) == -1)
+			goto fail;
+	} else if (dhcping_optset_put(set, DHO_DHCP_PARAMETER_REQUEST_LIST,
+	    dhcping_requested, sizeof(dhcping_requested)) == -1)
+		goto fail;
+
+	/* a REQUEST is the biggest packet, make sure it'll fit */
+	if (sizeof(struct dhcp_packet) + 3 + 2 * (2 + sizeof(struct in_addr)) +
+	    set->len + dhcping->railen + 1 > DHCP_PACKET_MAX) {
+		warnx("options don't fit in a %d byte packet",
+		    DHCP_PACKET_MAX);
+		goto fail;
+	}
+
+	TAILQ_FOREACH(optset, &dhcping->optsets, entry) {
+		if (optset->len == set->len &&
+		    optset->release == set->release &&
+		    memcmp(optset->buf, set->buf, set->len) == 0) {
+			free(set);
+			return (optset);
+		}
+	}
+
+	TAILQ_INSERT_TAIL(&dhcping->optsets, set, entry);
+	return (set);
+
+fail:
+	free(set);
+	return (NULL);
+}
+
+static int
+dhcping_optset_put(struct dhcping_optset *set, uint8_t code,
+    const uint8_t *data, size_t len)
+{
+	if (set->len + 2 + len > sizeof(set->buf)) {
+		warnx("options are longer than %d bytes", DHCP_OPTION_LEN);
+		return (-1);
+	}
+
+	set->buf[set->len++] = code;
+	set->buf[set->len++] = len;
+	memcpy(set->buf + set->len, data, len);
+	set->len += len;
+
+	return (0);
+}
+
+/*
+ * Rewrite the options in a copy of a probe's packet for the later
+ * steps of the DORA exchange. The REQUEST is for the address that was
+ * offered, and the RELEASE gives it back. A client renewing its lease
+ * or asking about it with an INFORM says which address it has in
+ * ciaddr instead, and doesn't name the server.
+ */
+size_t
+dhcping_packet_dora(const struct dhcping_probe *probe, uint8_t *packet,
+    uint8_t type)
+{
+	const struct dhcping_optset *optset = probe->tmpl->optset;
+	struct dhcp_packet *p = (struct dhcp_packet *)packet;
+	uint8_t *dho = (uint8_t *)(p + 1);
+	size_t len;
+
+	memset(dho, 0, DHCP_PACKET_MAX - sizeof(*p));
+
+	*dho++ = DHO_DHCP_MESSAGE_TYPE;
+	*dho++ = 1;
+	*dho++ = type;
+
+	if (type == DHCPREQUEST && probe->phase == DHCPING_P_REQUEST) {
+		*dho++ = DHO_DHCP_REQUESTED_ADDRESS;
+		*dho++ = sizeof(probe->yiaddr);
+		memcpy(dho, &probe->yiaddr, sizeof(probe->yiaddr));
+		dho += sizeof(probe->yiaddr);
+	} else
+		p->ciaddr = probe->yiaddr;
+
+	if (type == DHCPRELEASE || probe->phase == DHCPING_P_REQUEST) {
+		*dho++ = DHO_DHCP_SERVER_IDENTIFIER;
+		*dho++ = sizeof(probe->serverid);
+		memcpy(dho, &probe->serverid, sizeof(probe->serverid));
+		dho += sizeof(probe->serverid);
+	}
+
+	/* a RELEASE only says who the client is */
+	len = type == DHCPRELEASE ? optset->release : optset->len;
+	memcpy(dho, optset->buf, len);
+	dho += len;
+
+	dho = dhcping_packet_rai(probe, dho);
+	*dho++ = DHO_END;
+
+	return (dhcping_packet_len(packet, dho));
+}
+
+size_t
+dhcping_packet_len(const uint8_t *packet, const uint8_t *dho)
+{
+	return (MAX(dho - packet, BOOTP_MIN_LEN));
+}
+
+/*
+ * Relays add their agent information as the last option. The circuit
+ * and remote IDs are picked from the -C and -E lists by the probe's
+ * number, and a %u in them is replaced with the number itself.
+ * dhcping_rai_parse has already made sure they fit.
+ */
+uint8_t *
+dhcping_packet_rai(const struct dhcping_probe *probe, uint8_t *dho)
+{
+	struct dhcping *dhcping = probe->dhcping;
+	uint8_t *len;
+
+	if (dhcping->ncircuits == 0 && dhcping->nremotes == 0)
+		return (dho);
+
+	*dho++ = DHO_RELAY_AGENT_INFORMATION;
+	len = dho++;
+
+	if (dhcping->ncircuits > 0) {
+		dho = dhcping_rai_sub(dho, RAI_CIRCUIT_ID,
+		    dhcping->circuits[probe->index % dhcping->ncircuits],
+		    probe->index);
+	}
+	if (dhcping->nremotes > 0) {
+		dho = dhcping_rai_sub(dho, RAI_REMOTE_ID,
+		    dhcping->remotes[probe->index % dhcping->nremotes],
+		    probe->index);
+	}
+
+	*len = dho - (len + 1);
+	return (dho);
+}
+
+static uint8_t *
+dhcping_rai_sub(uint8_t *dho, uint8_t code, const char *pattern,
+    unsigned int n)
+{
+	char num[16];
+	uint8_t *len;
+	int nlen;
+
+	nlen = snprintf(num, sizeof(num), "%u", n);
+
+	*dho++ = code;
+	len = dho++;
+
+	for (; *pattern != '\0'; pattern++) {
+		if (pattern[0] != '%')
+			*dho++ = pattern[0];
+		else if (*++pattern == 'u') {
+			memcpy(dho, num, nlen);
+			dho += nlen;
+		} else
+			*dho++ = '%';
+	}
+
+	*len = dho - (len + 1);
+	return (dho);
+}
+
+/* work out how long a sub-option could get once %u is replaced */
+int
+dhcping_rai_parse(const char *pattern, size_t *max)
+{
+	size_t len = 0;
+
+	for (; *pattern != '\0'; pattern++) {
+		if (pattern[0] != '%') {
+			len++;
+			continue;
+		}
+
+		switch (*++pattern) {
+		case 'u':
+			len += sizeof("4294967295") - 1;
+			break;
+		case '%':
+			len++;
+			break;
+		default:
+			return (-1);
+		}
+	}
+
+	*max = len;
+	return (0);
+}
@@ -0,0 +1,2955 @@
+/*
+ * Copyright (c) 2019 The University of Queensland
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+
+#include <event.h>
+#include <evdns.h>
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/if_ether.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#ifdef __linux__
+#include <linux/filter.h>
+#include <netpacket/packet.h>
+#else
+#include <sys/ioctl.h>
+#include <net/bpf.h>
+#include <ifaddrs.h>
+#endif
+
+#include "dhcp.h"
+#include "dhcp6.h"
+#include "dhcping.h"
+
+/* adaptive retransmit clock granularity in usec */
+#define DHCP_RTO_GRANULARITY	1000
+
+/* server names are looked up again once their ttl, kept in these, runs out */
+#define DHCP_DNS_TTL_MIN	30
+#define DHCP_DNS_TTL_MAX	3600
+
+/* smallest table for matching replies to probes */
+#define DHCP_HASH_MIN		16
+
+/* probe timeouts are rounded up to ticks of this many nsec */
+#define DHCP_WHEEL_TICK		1000000
+
+/* -K lease files, which have room for twice the leases they hold */
+#define DHCP_LEASES_MAGIC	"dhcpingL"
+#define DHCP_LEASES_VERSION	1
+#define DHCP_LEASES_MIN		64
+#define DHCP_LEASE_INFINITE	0xffffffffU
+
+const char *dhcping_states[DHCPING_S_MAX] = {
+	[DHCPING_S_IDLE] =	"idle",
+	[DHCPING_S_WAIT] =	"wait",
+	[DHCPING_S_UP] =	"up",
+	[DHCPING_S_DOWN] =	"down",
+	[DHCPING_S_NAK] =	"nak",
+	[DHCPING_S_TYPE] =	"type",
+	[DHCPING_S_ADDR] =	"addr",
+	[DHCPING_S_OPTS] =	"opts",
+};
+
+static void	dhcping_dns_add(struct dhcping_server *);
+static void	dhcping_dns_refresh(int, short, void *);
+static void	dhcping_dns_answer(int, char, int, int, void *, void *);
+static void	dhcping_dns_move(struct dhcping_server *, struct in_addr);
+static void	dhcping_dns_retemplate(struct dhcping_probe *,
+		    const struct dhcping_server *);
+
+static int	dhcping_bind6(struct dhcping *);
+static int	dhcping_source6(const struct sockaddr_in6 *,
+		    struct in6_addr *, const char **);
+static int	dhcping_plain(const struct dhcping *);
+static char	*dhcping_label(const char *);
+
+static struct dhcping_bucket *
+		dhcping_hash(struct dhcping *, uint32_t, struct in_addr,
+		    struct in_addr);
+static struct dhcping_bucket *
+		dhcping_hash6(struct dhcping *, uint32_t,
+		    const struct in6_addr *);
+static struct dhcping_probe *
+		dhcping_match6(struct dhcping *, const struct dhcping_rx *,
+		    uint32_t);
+
+static uint32_t	dhcping_xid(struct dhcping *);
+static uint32_t	dhcping_xid6(struct dhcping *);
+static uint32_t	dhcping_xid_at(const struct dhcping *, uint32_t);
+static uint64_t	dhcping_mix(uint64_t, uint32_t, unsigned int);
+static void	dhcping_done(struct dhcping_probe *, enum dhcping_state,
+		    const struct timespec *);
+static void	dhcping_fail(struct dhcping_probe *, const char *, int);
+
+static int	dhcping_send(struct dhcping *, struct dhcping_probe **,
+		    unsigned int);
+static int	dhcping_send_each(struct dhcping *, struct dhcping_probe **,
+		    unsigned int);
+static int	dhcping_sendto(struct dhcping *, struct dhcping_probe *,
+		    void *, size_t);
+
+static int	dhcping_recvfrom(struct dhcping *, int, int);
+static int	dhcping_raw_recv(struct dhcping *);
+static int	dhcping_raw_strip(struct dhcping_rx *, const uint8_t *,
+		    size_t);
+static uint16_t	dhcping_cksum(const void *, size_t, uint32_t);
+static void	dhcping_reply(struct dhcping *, struct dhcping_rx *,
+		    const struct timespec *);
+static void	dhcping_reply6(struct dhcping *, struct dhcping_rx *,
+		    const struct timespec *);
+static const char *
+		dhcping_ntoa6(const struct dhcping_rx *);
+static enum dhcping_state
+		dhcping_assert(struct dhcping_probe *,
+		    const struct dhcping_rx *);
+static void	dhcping_offer(struct dhcping_probe *, struct dhcping_rx *,
+		    const struct timespec *);
+static void	dhcping_release(struct dhcping_probe *);
+static void	dhcping_lease_use(struct dhcping_probe *);
+static void	dhcping_lease_set(struct dhcping_probe *,
+		    const struct dhcping_rx *);
+static int64_t	dhcping_lease_time(int64_t, uint32_t);
+static struct dhcping_lease *
+		dhcping_lease_slot(struct dhcping_leases *,
+		    const struct dhcping_lease *);
+
+static uint64_t	dhcping_wheel_ns(void);
+static void	dhcping_wheel_tick(int, short, void *);
+static void	dhcping_wheel_arm(struct dhcping_wheel *, uint64_t, uint64_t);
+
+static void	dhcping_trace_tx(struct dhcping_probe *,
+		    const struct timespec *, const struct timespec *);
+static void	dhcping_maxwait(void *);
+static void	dhcping_retry(void *);
+static void	dhcping_flush(int, short, void *);
+static int	dhcping_output6(struct dhcping *);
+static void	dhcping_limit_fill(struct dhcping_limit *,
+		    const struct timespec *);
+static int	dhcping_limit_ok(const struct dhcping_limit *);
+static uint64_t	dhcping_limit_wait(const struct dhcping_limit *);
+static void	dhcping_input(int, short, void *);
+static void	dhcping_input6(int, short, void *);
+static void	dhcping_events6(struct dhcping *);
+
+static uint32_t	dhcping_rto(const struct dhcping_probe *);
+static void	dhcping_rtt_sample(struct dhcping_server *,
+		    const struct timespec *);
+
+static void	dhcping_kick(struct dhcping *);
+
+
+/*
+ * A name is only checked over DHCPv6 if it doesn't have an IPv4
+ * address, so existing checks of dual stack servers stay as they are.
+ * Once dhcping has chrooted, and always in the library, only addresses
+ * are taken, so adding a server can't hold up the checks with a lookup.
+ */
+static int
+dhcping_resolve(const char *remote, struct dhcping_server *server,
+    const char **errstr)
+{
+	struct addrinfo *res, *res0, *res6 = NULL;
+	int error;
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_DGRAM,
+	};
+
+	*errstr = NULL;
+
+	if (server->dhcping->numeric)
+		hints.ai_flags = AI_NUMERICHOST;
+
+	error = getaddrinfo(remote, NULL, &hints, &res0);
+	if (error == EAI_NONAME && server->dhcping->numeric) {
+		*errstr = "has to be an address";
+		return (-1);
+	}
+	if (error != 0) {
+		*errstr = gai_strerror(error);
+		return (-1);
+	}
+
+	/* the first address will do, replies are matched against it */
+	for (res = res0; res != NULL; res = res->ai_next) {
+		if (res->ai_family == AF_INET)
+			break;
+		if (res->ai_family == AF_INET6 && res6 == NULL)
+			res6 = res;
+	}
+	if (res == NULL)
+		res = res6;
+	if (res == NULL) {
+		*errstr = "no IPv4 or IPv6 address";
+		freeaddrinfo(res0);
+		return (-1);
+	}
+
+	server->af = res->ai_family;
+	if (server->af == AF_INET6) {
+		memcpy(&server->sin6, res->ai_addr, sizeof(server->sin6));
+		server->sin6.sin6_port = htons(DHCP6_SERVER_PORT);
+	} else {
+		memcpy(&server->sin, res->ai_addr, sizeof(server->sin));
+		server->sin.sin_port = htons(DHCP_PORT_NUM);
+	}
+
+	freeaddrinfo(res0);
+	return (0);
+}
+
+int
+dhcping_bind(const char *local, int reuseport, const char **errstr)
+{
+	struct addrinfo *res, *res0;
+	int serrno;
+	int error;
+	int on = 1;
+	int s;
+	const char *cause;
+	struct addrinfo hints = {
+		.ai_family = AF_INET,
+		.ai_socktype = SOCK_DGRAM,
+		.ai_flags = AI_PASSIVE,
+	};
+
+	error = getaddrinfo(local, DHCP_PORT, &hints, &res0);
+	if (error) {
+		*errstr = gai_strerror(error);
+		errno = 0;
+		return (-1);
+	}
+
+	for (res = res0; res != NULL; res = res->ai_next) {
+		s = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK,
+		    res->ai_protocol);
+		if (s == -1) {
+			serrno = errno;
+			cause = "socket";
+			continue;
+		}
+
+		/* every -j worker has its own socket on the same port */
+		if (reuseport && setsockopt(s, SOL_SOCKET, SO_REUSEPORT,
+		    &on, sizeof(on)) == -1) {
+			serrno = errno;
+			cause = "reuseport";
+			close(s);
+			s = -1;
+			continue;
+		}
+
+		if (bind(s, res->ai_addr, res->ai_addrlen) == -1) {
+			serrno = errno;
+			cause = "bind";
+			close(s);
+			s = -1;
+			continue;
+		}
+
+		break;  /* okay we got one */
+	}
+
+	freeaddrinfo(res0);
+
+	if (s == -1) {
+		*errstr = cause;
+		errno = serrno;
+	}
+
+	return (s);
+}
+
+/*
+ * If the socket is bound to a wildcard address, ask the kernel which
+ * address it would use to talk to the server by connecting a scratch
+ * socket to it.
+ */
+static int
+dhcping_source(struct dhcping *dhcping, const struct sockaddr_in *sin,
+    struct in_addr *giaddr, const char **errstr)
+{
+	struct sockaddr_in src;
+	socklen_t srclen = sizeof(src);
+	int s;
+
+	*errstr = NULL;
+
+	if (dhcping->laddr.s_addr != htonl(INADDR_ANY)) {
+		*giaddr = dhcping->laddr;
+		return (0);
+	}
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	if (s == -1) {
+		*errstr = strerror(errno);
+		return (-1);
+	}
+
+	if (connect(s, (const struct sockaddr *)sin, sizeof(*sin)) == -1 ||
+	    getsockname(s, (struct sockaddr *)&src, &srclen) == -1) {
+		*errstr = strerror(errno);
+		close(s);
+		return (-1);
+	}
+
+	close(s);
+
+	*giaddr = src.sin_addr;
+	return (0);
+}
+
+/*
+ * Relays talk to DHCPv6 servers from port 547, like they do from 67 for
+ * DHCP. The socket isn't opened until there's a server for it so
+ * checking only DHCP doesn't need the port.
+ */
+static int
+dhcping_bind6(struct dhcping *dhcping)
+{
+	struct sockaddr_in6 sin6;
+	int serrno;
+	int on = 1;
+	int s;
+
+	memset(&sin6, 0, sizeof(sin6));
+	sin6.sin6_family = AF_INET6;
+	sin6.sin6_port = htons(DHCP6_SERVER_PORT);
+	sin6.sin6_addr = in6addr_any;
+
+	s = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if (s == -1)
+		return (-1);
+
+	if (setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on)) == -1 ||
+#ifdef SO_TIMESTAMP
+	    setsockopt(s, SOL_SOCKET, SO_TIMESTAMP, &on, sizeof(on)) == -1 ||
+#endif
+	    bind(s, (struct sockaddr *)&sin6, sizeof(sin6)) == -1) {
+		serrno = errno;
+		close(s);
+		errno = serrno;
+		return (-1);
+	}
+
+	dhcping_pacing(s, dhcping->limit.rate);
+	dhcping->s6 = s;
+
+	/* servers can be added after the events are set up */
+	if (event_initialized(&dhcping->input))
+		dhcping_events6(dhcping);
+
+	return (0);
+}
+
+/* the link address is the one the kernel would send to the server from */
+static int
+dhcping_source6(const struct sockaddr_in6 *sin6, struct in6_addr *linkaddr,
+    const char **errstr)
+{
+	struct sockaddr_in6 src;
+	socklen_t srclen = sizeof(src);
+	int s;
+
+	*errstr = NULL;
+
+	s = socket(AF_INET6, SOCK_DGRAM, 0);
+	if (s == -1) {
+		*errstr = strerror(errno);
+		return (-1);
+	}
+
+	if (connect(s, (const struct sockaddr *)sin6, sizeof(*sin6)) == -1 ||
+	    getsockname(s, (struct sockaddr *)&src, &srclen) == -1) {
+		*errstr = strerror(errno);
+		close(s);
+		return (-1);
+	}
+
+	close(s);
+
+	*linkaddr = src.sin6_addr;
+	return (0);
+}
+
+/*
+ * DHCPv6 checks are a SOLICIT that has to get an ADVERTISE back. DORA,
+ * leases, relay agent information, and what a reply has to look like
+ * are all DHCP things.
+ */
+static int
+dhcping_plain(const struct dhcping *dhcping)
+{
+	return (!dhcping->dora && !dhcping->keep && !dhcping->raw &&
+	    dhcping->type == 0 && !dhcping->net_set &&
+	    dhcping->nrequired == 0 && dhcping->nopts == 0 &&
+	    dhcping->railen == 0);
+}
+
+/* names come from the command line or a file, and can have anything */
+static char *
+dhcping_label(const char *value)
+{
+	char *label, *l;
+
+	label = l = reallocarray(NULL, strlen(value) + 1, 2);
+	if (label == NULL)
+		return (NULL);
+
+	for (; *value != '\0'; value++) {
+		switch (*value) {
+		case '\\':
+		case '"':
+			*l++ = '\\';
+			*l++ = *value;
+			break;
+		case '\n':
+			*l++ = '\\';
+			*l++ = 'n';
+			break;
+		default:
+			*l++ = *value;
+			break;
+		}
+	}
+	*l = '\0';
+
+	return (label);
+}
+
+/* a NULL giaddr matches the server from any relay */
+struct dhcping_server *
+dhcping_server_find(struct dhcping *dhcping, const char *name,
+    const struct in_addr *giaddr)
+{
+	struct dhcping_server *server;
+
+	TAILQ_FOREACH(server, &dhcping->servers, entry) {
+		if (strcmp(server->name, name) == 0 && (giaddr == NULL ||
+		    server->giaddr.s_addr == giaddr->s_addr))
+			return (server);
+	}
+
+	return (NULL);
+}
+
+struct dhcping_server *
+dhcping_server_get(struct dhcping *dhcping, const char *name,
+    const struct in_addr *giaddr, const char **errstr)
+{
+	struct dhcping_server *server;
+	struct in_addr addr;
+	struct timespec start;
+	char *label = NULL;
+	int rv;
+
+	server = dhcping_server_find(dhcping, name, giaddr);
+	if (server != NULL)
+		return (server);
+
+	server = calloc(1, sizeof(*server));
+	if (server == NULL) {
+		*errstr = strerror(errno);
+		return (NULL);
+	}
+
+	server->dhcping = dhcping;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &start) == -1)
+		goto nomem;
+	if (dhcping_resolve(name, server, errstr) == -1)
+		goto fail;
+	dhcping_took(&start, &server->resolve);
+	DHCPING_USDT2(resolve, name, dhcping_ns(&server->resolve));
+
+	label = dhcping_label(name);
+	if (label == NULL)
+		goto nomem;
+
+	if (server->af == AF_INET6) {
+		if (giaddr != NULL || !dhcping_plain(dhcping)) {
+			*errstr = "only plain checks can go to DHCPv6 servers";
+			goto fail;
+		}
+		if (dhcping->s6 == -1 && dhcping_bind6(dhcping) == -1)
+			goto nomem;
+		if (clock_gettime(CLOCK_MONOTONIC, &start) == -1)
+			goto nomem;
+		if (dhcping_source6(&server->sin6, &server->linkaddr,
+		    errstr) == -1)
+			goto fail;
+		dhcping_took(&start, &server->connect);
+		DHCPING_USDT2(connect, name, dhcping_ns(&server->connect));
+		rv = asprintf(&server->labels, "server=\"%s\"", label);
+	} else if (giaddr != NULL) {
+		server->giaddr = *giaddr;
+		rv = asprintf(&server->labels, "server=\"%s\",relay=\"%s\"",
+		    label, inet_ntoa(*giaddr));
+	} else {
+		if (clock_gettime(CLOCK_MONOTONIC, &start) == -1)
+			goto nomem;
+		if (dhcping_source(dhcping, &server->sin, &server->giaddr,
+		    errstr) == -1)
+			goto fail;
+		dhcping_took(&start, &server->connect);
+		DHCPING_USDT2(connect, name, dhcping_ns(&server->connect));
+		rv = asprintf(&server->labels, "server=\"%s\"", label);
+	}
+	free(label);
+	label = NULL;
+	if (rv == -1) {
+		server->labels = NULL;
+		goto nomem;
+	}
+
+	if (server->af == AF_INET6)
+		server->tmpl = dhcping_template6_get(dhcping, &server->linkaddr);
+	else {
+		server->tmpl = dhcping_template_get(dhcping, server->giaddr,
+		    dhcping->optset);
+	}
+	if (server->tmpl == NULL)
+		goto nomem;
+
+	server->name = strdup(name);
+	if (server->name == NULL)
+		goto nomem;
+	dhcping_limit_init(&server->limit, dhcping->server_rate);
+
+	/* evdns can only look up IPv4 addresses */
+	server->named = inet_aton(name, &addr) == 0;
+	if (dhcping->dns && server->named && server->af != AF_INET6)
+		dhcping_dns_add(server);
+
+	TAILQ_INSERT_TAIL(&dhcping->servers, server, entry);
+
+	return (server);
+
+nomem:
+	*errstr = strerror(errno);
+fail:
+	free(label);
+	free(server->labels);
+	free(server);
+	return (NULL);
+}
+
+/*
+ * Looking a name up again happens in the background, so a slow or
+ * broken resolver can't hold up any checks. The server keeps the
+ * address it has until there's an answer with a different one, and
+ * keeps it through failures, so DNS going away doesn't look like the
+ * DHCP server going away.
+ */
+static void
+dhcping_dns_add(struct dhcping_server *server)
+{
+	static const struct timeval now = { 0, 0 };
+
+	evtimer_set(&server->refresh, dhcping_dns_refresh, server);
+	event_base_set(server->dhcping->base, &server->refresh);
+
+	/* getaddrinfo doesn't say what the ttl is */
+	evtimer_add(&server->refresh, &now);
+}
+
+static void
+dhcping_dns_refresh(int fd, short revents, void *arg)
+{
+	struct dhcping_server *server = arg;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &server->lookup) == -1)
+		err(1, "clock_gettime");
+	if (evdns_resolve_ipv4(server->name, 0, dhcping_dns_answer,
+	    server) != 0)
+		dhcping_dns_answer(DNS_ERR_UNKNOWN, DNS_IPv4_A, 0, 0, NULL,
+		    server);
+}
+
+static void
+dhcping_dns_answer(int result, char type, int count, int ttl,
+    void *addresses, void *arg)
+{
+	struct dhcping_server *server = arg;
+	const struct in_addr *addrs = addresses;
+	struct timeval tv = { DHCP_DNS_TTL_MIN, 0 };
+	int i;
+
+	if (result != DNS_ERR_NONE || type != DNS_IPv4_A || count == 0) {
+		if (server->dhcping->verbose) {
+			warnx("server %s: %s, still using %s", server->name,
+			    result != DNS_ERR_NONE ?
+			    evdns_err_to_string(result) : "no addresses",
+			    inet_ntoa(server->sin.sin_addr));
+		}
+		evtimer_add(&server->refresh, &tv);
+		return;
+	}
+
+	dhcping_took(&server->lookup, &server->resolve);
+	DHCPING_USDT2(resolve, server->name, dhcping_ns(&server->resolve));
+
+	/* stay where we are if the name still has this address */
+	for (i = 0; i < count; i++) {
+		if (addrs[i].s_addr == server->sin.sin_addr.s_addr)
+			break;
+	}
+	if (i == count)
+		dhcping_dns_move(server, addrs[0]);
+
+	tv.tv_sec = MIN(MAX(ttl, DHCP_DNS_TTL_MIN), DHCP_DNS_TTL_MAX);
+	evtimer_add(&server->refresh, &tv);
+}
+
+/*
+ * Checks that are waiting finish with the address they were sent to,
+ * so replies already on the way still count, and only checks started
+ * after this go to the new one. The new address might be reached from
+ * somewhere else, so the giaddr, and the templates with it, are worked
+ * out again as well.
+ */
+static void
+dhcping_dns_move(struct dhcping_server *server, struct in_addr addr)
+{
+	struct dhcping *dhcping = server->dhcping;
+	struct dhcping_probe *probe;
+	struct dhcping_template *tmpl;
+	struct sockaddr_in sin = server->sin;
+	struct in_addr giaddr;
+	const char *errstr;
+
+	sin.sin_addr = addr;
+	if (dhcping_source(dhcping, &sin, &giaddr, &errstr) == -1) {
+		if (dhcping->verbose) {
+			warnx("server %s: %s: %s, still using %s",
+			    server->name, inet_ntoa(addr), errstr,
+			    inet_ntoa(server->sin.sin_addr));
+		}
+		return;
+	}
+	tmpl = dhcping_template_get(dhcping, giaddr, server->tmpl->optset);
+	if (tmpl == NULL) {
+		if (dhcping->verbose)
+			warn("server %s template", server->name);
+		return;
+	}
+
+	if (dhcping->verbose)
+		warnx("server %s is now at %s", server->name, inet_ntoa(addr));
+	server->sin = sin;
+	server->giaddr = giaddr;
+	server->tmpl = tmpl;
+
+	TAILQ_FOREACH(probe, &dhcping->probes, entry)
+		dhcping_dns_retemplate(probe, server);
+
+	/* the daemon's probe isn't on the list */
+	if (dhcping->ctl_probe != NULL)
+		dhcping_dns_retemplate(dhcping->ctl_probe, server);
+}
+
+/* the packet for a check is copied when it starts, so this is safe */
+static void
+dhcping_dns_retemplate(struct dhcping_probe *probe,
+    const struct dhcping_server *server)
+{
+	struct dhcping_template *tmpl;
+
+	if (probe->server != server ||
+	    probe->tmpl->giaddr.s_addr == server->giaddr.s_addr)
+		return;
+
+	tmpl = dhcping_template_get(server->dhcping, server->giaddr,
+	    probe->tmpl->optset);
+	if (tmpl != NULL)
+		probe->tmpl = tmpl;
+}
+
+/* this adds n more probes to the pool */
+int
+dhcping_pool_init(struct dhcping *dhcping, unsigned int n)
+{
+	struct dhcping_probe **pools, *pool, *probe;
+	unsigned int i;
+
+	pools = reallocarray(dhcping->pools, dhcping->npools + 1,
+	    sizeof(*pools));
+	if (pools == NULL)
+		return (-1);
+	dhcping->pools = pools;
+
+	pool = calloc(n, sizeof(*pool));
+	if (pool == NULL)
+		return (-1);
+	dhcping->pools[dhcping->npools++] = pool;
+	dhcping->poolsize += n;
+
+	for (i = 0; i < n; i++) {
+		probe = &pool[i];
+		probe->dhcping = dhcping;
+
+		dhcping_timer_set(&probe->maxwait, dhcping_maxwait, probe);
+		dhcping_timer_set(&probe->retry, dhcping_retry, probe);
+
+		TAILQ_INSERT_TAIL(&dhcping->idle, probe, entry);
+	}
+
+	return (0);
+}
+
+struct dhcping_probe *
+dhcping_probe_get(struct dhcping *dhcping, struct dhcping_server *server,
+    const struct ether_addr *ea)
+{
+	struct dhcping_probe *probe;
+
+	probe = TAILQ_FIRST(&dhcping->idle);
+	if (probe == NULL)
+		errx(1, "probe pool exhausted");
+	TAILQ_REMOVE(&dhcping->idle, probe, entry);
+
+	probe->server = server;
+	probe->tmpl = server->tmpl;
+	if (ea != NULL)
+		probe->ea = *ea;
+	probe->state = DHCPING_S_IDLE;
+	probe->own.addr.s_addr = htonl(INADDR_ANY);
+	probe->lease = &probe->own;
+
+	return (probe);
+}
+
+void
+dhcping_probe_put(struct dhcping *dhcping, struct dhcping_probe *probe)
+{
+	probe->state = DHCPING_S_IDLE;
+	TAILQ_INSERT_HEAD(&dhcping->idle, probe, entry);
+}
+
+int
+dhcping_hash_init(struct dhcping *dhcping, unsigned int nprobes)
+{
+	uint32_t size = DHCP_HASH_MIN;
+	uint32_t i;
+
+	/* keep the chains short */
+	while (size < nprobes * 2)
+		size <<= 1;
+
+	dhcping->hash = calloc(size, sizeof(*dhcping->hash));
+	if (dhcping->hash == NULL)
+		return (-1);
+
+	for (i = 0; i < size; i++)
+		LIST_INIT(&dhcping->hash[i]);
+
+	dhcping->hashmask = size - 1;
+
+	return (0);
+}
+
+/*
+ * The wheel has a bucket for every tick out to the longest a probe
+ * can wait, so a bucket only ever holds timers due in that tick unless
+ * the clock has jumped a long way. One libevent timer is kept for the
+ * next bucket with anything in it.
+ */
+int
+dhcping_wheel_init(struct dhcping *dhcping)
+{
+	struct dhcping_wheel *wheel = &dhcping->wheel;
+	uint64_t ticks, size = 1;
+	uint64_t i;
+
+	ticks = (uint64_t)MAX(dhcping->wait, DHCP_IVAL_MAX) * 1000000 /
+	    DHCP_WHEEL_TICK;
+	while (size <= ticks)
+		size <<= 1;
+
+	wheel->buckets = calloc(size, sizeof(*wheel->buckets));
+	if (wheel->buckets == NULL)
+		return (-1);
+
+	for (i = 0; i < size; i++)
+		LIST_INIT(&wheel->buckets[i]);
+
+	wheel->mask = size - 1;
+	wheel->now = dhcping_wheel_ns() / DHCP_WHEEL_TICK;
+
+	evtimer_set(&wheel->ev, dhcping_wheel_tick, wheel);
+	event_base_set(dhcping->base, &wheel->ev);
+
+	return (0);
+}
+
+static uint64_t
+dhcping_wheel_ns(void)
+{
+	struct timespec now;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+		err(1, "clock_gettime");
+
+	return ((uint64_t)now.tv_sec * 1000000000 + now.tv_nsec);
+}
+
+static void
+dhcping_wheel_tick(int fd, short revents, void *arg)
+{
+	struct dhcping_wheel *wheel = arg;
+	struct dhcping_timers expired;
+	struct dhcping_timers *bucket;
+	struct dhcping_timer *t, *nt;
+	uint64_t ns, now, i;
+
+	ns = dhcping_wheel_ns();
+	now = ns / DHCP_WHEEL_TICK;
+	wheel->next = 0;
+
+	/* going round once gets everything that could be due */
+	if (now - wheel->now > wheel->mask)
+		wheel->now = now - wheel->mask;
+
+	for (; wheel->now <= now && wheel->n > 0; wheel->now++) {
+		bucket = &wheel->buckets[wheel->now & wheel->mask];
+
+		/* the callbacks can add and delete timers in here */
+		LIST_INIT(&expired);
+		for (t = LIST_FIRST(bucket); t != NULL; t = nt) {
+			nt = LIST_NEXT(t, entry);
+			if (t->when > now)
+				continue;
+
+			LIST_REMOVE(t, entry);
+			LIST_INSERT_HEAD(&expired, t, entry);
+		}
+
+		while ((t = LIST_FIRST(&expired)) != NULL) {
+			LIST_REMOVE(t, entry);
+			t->pending = 0;
+			wheel->n--;
+			t->fn(t->arg);
+		}
+	}
+	if (wheel->now <= now)
+		wheel->now = now + 1;
+
+	if (wheel->n == 0)
+		return;
+
+	/* the callbacks might have armed it for later than the next one */
+	for (i = wheel->now; i <= wheel->now + wheel->mask; i++) {
+		if (!LIST_EMPTY(&wheel->buckets[i & wheel->mask])) {
+			dhcping_wheel_arm(wheel, i, ns);
+			break;
+		}
+	}
+}
+
+static void
+dhcping_wheel_arm(struct dhcping_wheel *wheel, uint64_t when, uint64_t ns)
+{
+	struct timeval tv;
+	uint64_t due = when * DHCP_WHEEL_TICK;
+	uint64_t wait = due > ns ? due - ns : 0;
+
+	tv.tv_sec = wait / 1000000000;
+	tv.tv_usec = (wait % 1000000000 + 999) / 1000;
+
+	wheel->next = when;
+	evtimer_add(&wheel->ev, &tv);
+}
+
+void
+dhcping_timer_set(struct dhcping_timer *t, void (*fn)(void *), void *arg)
+{
+	t->pending = 0;
+	t->fn = fn;
+	t->arg = arg;
+}
+
+/* like evtimer_add, adding a pending timer moves it */
+void
+dhcping_timer_add(struct dhcping_wheel *wheel, struct dhcping_timer *t,
+    uint32_t usec)
+{
+	uint64_t ns = dhcping_wheel_ns();
+
+	if (t->pending)
+		LIST_REMOVE(t, entry);
+	else if (wheel->n++ == 0)
+		wheel->now = ns / DHCP_WHEEL_TICK;
+
+	/* rounding up means it never goes off early */
+	t->when = (ns + (uint64_t)usec * 1000 + DHCP_WHEEL_TICK - 1) /
+	    DHCP_WHEEL_TICK;
+	t->pending = 1;
+	LIST_INSERT_HEAD(&wheel->buckets[t->when & wheel->mask], t, entry);
+
+	if (wheel->next == 0 || t->when < wheel->next)
+		dhcping_wheel_arm(wheel, t->when, ns);
+}
+
+void
+dhcping_timer_del(struct dhcping_wheel *wheel, struct dhcping_timer *t)
+{
+	if (!t->pending)
+		return;
+
+	LIST_REMOVE(t, entry);
+	t->pending = 0;
+
+	/* otherwise the wheel just turns over an empty bucket */
+	if (--wheel->n == 0) {
+		evtimer_del(&wheel->ev);
+		wheel->next = 0;
+	}
+}
+
+static struct dhcping_bucket *
+dhcping_hash(struct dhcping *dhcping, uint32_t xid, struct in_addr giaddr,
+    struct in_addr src)
+{
+	uint32_t h = xid;
+
+	h ^= giaddr.s_addr * 0x9e3779b1;
+	h ^= src.s_addr * 0x85ebca6b;
+	h ^= h >> 16;
+	h *= 0x7feb352d;
+	h ^= h >> 15;
+
+	return (&dhcping->hash[h & dhcping->hashmask]);
+}
+
+/* DHCPv6 has no giaddr, and the server's address is folded in half twice */
+static struct dhcping_bucket *
+dhcping_hash6(struct dhcping *dhcping, uint32_t xid,
+    const struct in6_addr *src)
+{
+	struct in_addr giaddr = { htonl(INADDR_ANY) };
+	struct in_addr fold;
+	uint32_t w[4];
+
+	memcpy(w, src, sizeof(w));
+	fold.s_addr = w[0] ^ w[1] ^ w[2] ^ w[3];
+
+	return (dhcping_hash(dhcping, xid, giaddr, fold));
+}
+
+/* replies are matched on everything a probe made up its packet with */
+void
+dhcping_hash_add(struct dhcping_probe *probe)
+{
+	struct dhcp_packet *p = dhcping_packet(probe);
+	struct dhcping_bucket *bucket;
+
+	if (probe->server->af == AF_INET6) {
+		bucket = dhcping_hash6(probe->dhcping, probe->xid,
+		    &probe->server->sin6.sin6_addr);
+	} else {
+		bucket = dhcping_hash(probe->dhcping, p->xid, p->giaddr,
+		    probe->sin.sin_addr);
+	}
+
+	LIST_INSERT_HEAD(bucket, probe, wait);
+}
+
+struct dhcping_probe *
+dhcping_match(struct dhcping *dhcping, const struct dhcping_rx *rx)
+{
+	const struct dhcp_packet *reply = &rx->u.packet;
+	struct dhcping_bucket *bucket;
+	struct dhcping_probe *probe;
+	struct dhcp_packet *p;
+
+	bucket = dhcping_hash(dhcping, reply->xid, reply->giaddr,
+	    rx->sin.sin_addr);
+	LIST_FOREACH(probe, bucket, wait) {
+		p = dhcping_packet(probe);
+		if (reply->xid == p->xid &&
+		    reply->giaddr.s_addr == p->giaddr.s_addr &&
+		    rx->sin.sin_addr.s_addr == probe->sin.sin_addr.s_addr)
+			return (probe);
+	}
+
+	return (NULL);
+}
+
+static struct dhcping_probe *
+dhcping_match6(struct dhcping *dhcping, const struct dhcping_rx *rx,
+    uint32_t xid)
+{
+	struct dhcping_bucket *bucket;
+	struct dhcping_probe *probe;
+
+	bucket = dhcping_hash6(dhcping, xid, &rx->sin6.sin6_addr);
+	LIST_FOREACH(probe, bucket, wait) {
+		if (probe->xid == xid && probe->server->af == AF_INET6 &&
+		    IN6_ARE_ADDR_EQUAL(&rx->sin6.sin6_addr,
+		    &probe->server->sin6.sin6_addr))
+			return (probe);
+	}
+
+	return (NULL);
+}
+
+int
+dhcping_io_init(struct dhcping *dhcping)
+{
+#ifdef HAVE_MMSG
+	struct msghdr *msg;
+	unsigned int i;
+#endif
+
+	dhcping->rx = calloc(DHCP_BATCH, sizeof(*dhcping->rx));
+	if (dhcping->rx == NULL)
+		return (-1);
+
+#ifdef HAVE_MMSG
+	/* the rx side always points at the same buffers */
+	for (i = 0; i < DHCP_BATCH; i++) {
+		dhcping->rxiov[i].iov_base = dhcping->rx[i].u.buf;
+		dhcping->rxiov[i].iov_len = sizeof(dhcping->rx[i].u.buf);
+
+		msg = &dhcping->rxmsgs[i].msg_hdr;
+		msg->msg_name = &dhcping->rx[i].sin;
+		msg->msg_iov = &dhcping->rxiov[i];
+		msg->msg_iovlen = 1;
+#ifdef SO_TIMESTAMP
+		msg->msg_control = dhcping->rx[i].cmsg.buf;
+#endif
+
+		msg = &dhcping->txmsgs[i].msg_hdr;
+		msg->msg_namelen = sizeof(struct sockaddr_in);
+		msg->msg_iov = &dhcping->txiov[i];
+		msg->msg_iovlen = 1;
+	}
+#endif
+
+	return (0);
+}
+
+void
+dhcping_events(struct dhcping *dhcping)
+{
+	event_set(&dhcping->input, dhcping->rs, EV_READ|EV_PERSIST,
+	    dhcping_input, dhcping);
+	event_base_set(dhcping->base, &dhcping->input);
+	event_set(&dhcping->output, dhcping->s, EV_WRITE,
+	    dhcping_flush, dhcping);
+	event_base_set(dhcping->base, &dhcping->output);
+	evtimer_set(&dhcping->flush, dhcping_flush, dhcping);
+	event_base_set(dhcping->base, &dhcping->flush);
+	event_add(&dhcping->input, NULL);
+
+	if (dhcping->s6 != -1)
+		dhcping_events6(dhcping);
+}
+
+static void
+dhcping_events6(struct dhcping *dhcping)
+{
+	event_set(&dhcping->input6, dhcping->s6, EV_READ|EV_PERSIST,
+	    dhcping_input6, dhcping);
+	event_base_set(dhcping->base, &dhcping->input6);
+	event_set(&dhcping->output6, dhcping->s6, EV_WRITE,
+	    dhcping_flush, dhcping);
+	event_base_set(dhcping->base, &dhcping->output6);
+	event_add(&dhcping->input6, NULL);
+}
+
+static void
+dhcping_rx_stamp(struct dhcping_rx *rx, struct msghdr *msg)
+{
+#ifdef SO_TIMESTAMP
+	struct cmsghdr *cmsg;
+
+	rx->stamped = 0;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+	    cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_TIMESTAMP) {
+			memcpy(&rx->kstamp, CMSG_DATA(cmsg),
+			    sizeof(rx->kstamp));
+			rx->stamped = 1;
+		}
+	}
+#endif
+}
+
+/*
+ * Work out when a reply arrived on the monotonic clock. The kernel
+ * timestamp is on the realtime clock, so it's used to work out how
+ * long the reply sat on the socket before we got to it.
+ */
+static void
+dhcping_rx_time(const struct dhcping_rx *rx, const struct timespec *mono,
+    const struct timespec *real, struct timespec *ts)
+{
+#ifdef SO_TIMESTAMP
+	struct timespec kstamp, delay;
+
+	if (rx->stamped) {
+		TIMEVAL_TO_TIMESPEC(&rx->kstamp, &kstamp);
+		timespecsub(real, &kstamp, &delay);
+		if (delay.tv_sec >= 0 && timespeccmp(&delay, mono, <)) {
+			timespecsub(mono, &delay, ts);
+			return;
+		}
+	}
+#endif
+
+	*ts = *mono;
+}
+
+#ifdef HAVE_MMSG
+static int
+dhcping_send(struct dhcping *dhcping, struct dhcping_probe **probes,
+    unsigned int n)
+{
+	struct dhcping_server *server;
+	struct msghdr *msg;
+	int af = probes[0]->server->af;
+	unsigned int i;
+
+	if (dhcping->raw)
+		return (dhcping_send_each(dhcping, probes, n));
+
+	for (i = 0; i < n; i++) {
+		server = probes[i]->server;
+
+		/* a batch only goes out the one socket, flush sends the rest */
+		if (server->af != af)
+			break;
+
+		dhcping->txiov[i].iov_base = probes[i]->packet;
+		dhcping->txiov[i].iov_len = probes[i]->len;
+		msg = &dhcping->txmsgs[i].msg_hdr;
+		if (af == AF_INET6) {
+			msg->msg_name = &server->sin6;
+			msg->msg_namelen = sizeof(server->sin6);
+		} else {
+			msg->msg_name = &probes[i]->sin;
+			msg->msg_namelen = sizeof(probes[i]->sin);
+		}
+	}
+
+	return (sendmmsg(af == AF_INET6 ? dhcping->s6 : dhcping->s,
+	    dhcping->txmsgs, i, 0));
+}
+
+static int
+dhcping_recvfrom(struct dhcping *dhcping, int s, int af)
+{
+	struct msghdr *msg;
+	unsigned int i;
+	int rv;
+
+	for (i = 0; i < DHCP_BATCH; i++) {
+		msg = &dhcping->rxmsgs[i].msg_hdr;
+		if (af == AF_INET6) {
+			msg->msg_name = &dhcping->rx[i].sin6;
+			msg->msg_namelen = sizeof(dhcping->rx[i].sin6);
+		} else {
+			msg->msg_name = &dhcping->rx[i].sin;
+			msg->msg_namelen = sizeof(dhcping->rx[i].sin);
+		}
+#ifdef SO_TIMESTAMP
+		msg->msg_controllen = sizeof(dhcping->rx[i].cmsg.buf);
+#endif
+	}
+
+	rv = recvmmsg(s, dhcping->rxmsgs, DHCP_BATCH, 0, NULL);
+	if (rv == -1)
+		return (-1);
+
+	for (i = 0; i < (unsigned int)rv; i++) {
+		dhcping->rx[i].len = dhcping->rxmsgs[i].msg_len;
+		dhcping_rx_stamp(&dhcping->rx[i],
+		    &dhcping->rxmsgs[i].msg_hdr);
+	}
+
+	return (rv);
+}
+#else /* HAVE_MMSG */
+static int
+dhcping_send(struct dhcping *dhcping, struct dhcping_probe **probes,
+    unsigned int n)
+{
+	return (dhcping_send_each(dhcping, probes, n));
+}
+
+static int
+dhcping_recvfrom(struct dhcping *dhcping, int s, int af)
+{
+	struct dhcping_rx *rx = &dhcping->rx[0];
+	struct iovec iov = {
+		.iov_base = rx->u.buf,
+		.iov_len = sizeof(rx->u.buf),
+	};
+	struct msghdr msg = {
+		.msg_name = &rx->sin,
+		.msg_namelen = sizeof(rx->sin),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+#ifdef SO_TIMESTAMP
+		.msg_control = rx->cmsg.buf,
+		.msg_controllen = sizeof(rx->cmsg.buf),
+#endif
+	};
+	ssize_t rv;
+
+	if (af == AF_INET6) {
+		msg.msg_name = &rx->sin6;
+		msg.msg_namelen = sizeof(rx->sin6);
+	}
+
+	rv = recvmsg(s, &msg, 0);
+	if (rv == -1)
+		return (-1);
+
+	rx->len = rv;
+	dhcping_rx_stamp(rx, &msg);
+	return (1);
+}
+#endif /* HAVE_MMSG */
+
+int
+dhcping_recv(struct dhcping *dhcping)
+{
+	if (dhcping->raw)
+		return (dhcping_raw_recv(dhcping));
+
+	return (dhcping_recvfrom(dhcping, dhcping->rs, AF_INET));
+}
+
+static int
+dhcping_send_each(struct dhcping *dhcping, struct dhcping_probe **probes,
+    unsigned int n)
+{
+	struct dhcping_probe *probe;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		probe = probes[i];
+
+		if (dhcping_sendto(dhcping, probe, probe->packet,
+		    probe->len) == -1)
+			return (i > 0 ? (int)i : -1);
+	}
+
+	return (n);
+}
+
+/* raw sockets need the IP and UDP headers put in front */
+static int
+dhcping_sendto(struct dhcping *dhcping, struct dhcping_probe *probe,
+    void *packet, size_t len)
+{
+	struct dhcping_server *server = probe->server;
+	struct ip ip;
+	struct udphdr uh;
+	struct iovec iov[3];
+	struct msghdr msg;
+	uint32_t sum;
+
+	if (server->af == AF_INET6) {
+		return (sendto(dhcping->s6, packet, len, 0,
+		    (struct sockaddr *)&server->sin6,
+		    sizeof(server->sin6)) == -1 ? -1 : 0);
+	}
+	if (!dhcping->raw) {
+		return (sendto(dhcping->s, packet, len, 0,
+		    (struct sockaddr *)&probe->sin,
+		    sizeof(probe->sin)) == -1 ? -1 : 0);
+	}
+
+	memset(&ip, 0, sizeof(ip));
+	ip.ip_v = IPVERSION;
+	ip.ip_hl = sizeof(ip) >> 2;
+	ip.ip_len = htons(sizeof(ip) + sizeof(uh) + len);
+	ip.ip_ttl = IPDEFTTL;
+	ip.ip_p = IPPROTO_UDP;
+	ip.ip_src = server->giaddr;
+	ip.ip_dst = probe->sin.sin_addr;
+	/* the kernel fills in the id and header checksum */
+
+	uh.uh_sport = htons(DHCP_PORT_NUM);
+	uh.uh_dport = htons(DHCP_PORT_NUM);
+	uh.uh_ulen = htons(sizeof(uh) + len);
+	uh.uh_sum = 0;
+
+	/* the pseudo header, then the header and payload */
+	sum = (ip.ip_src.s_addr >> 16) + (ip.ip_src.s_addr & 0xffff) +
+	    (ip.ip_dst.s_addr >> 16) + (ip.ip_dst.s_addr & 0xffff) +
+	    htons(IPPROTO_UDP) + uh.uh_ulen;
+	sum = dhcping_cksum(&uh, sizeof(uh), sum);
+	uh.uh_sum = ~dhcping_cksum(packet, len, sum);
+	if (uh.uh_sum == 0)
+		uh.uh_sum = 0xffff;
+
+	iov[0].iov_base = &ip;
+	iov[0].iov_len = sizeof(ip);
+	iov[1].iov_base = &uh;
+	iov[1].iov_len = sizeof(uh);
+	iov[2].iov_base = packet;
+	iov[2].iov_len = len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &probe->sin;
+	msg.msg_namelen = sizeof(probe->sin);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = sizeof(iov) / sizeof(iov[0]);
+
+	return (sendmsg(dhcping->s, &msg, 0) == -1 ? -1 : 0);
+}
+
+/* fold 16 bit words into a running ones complement sum */
+static uint16_t
+dhcping_cksum(const void *buf, size_t len, uint32_t sum)
+{
+	const uint8_t *p = buf;
+	size_t i;
+	uint16_t w;
+
+	for (i = 0; i + 1 < len; i += 2) {
+		memcpy(&w, p + i, sizeof(w));
+		sum += w;
+	}
+	if (i < len) {
+		w = 0;
+		memcpy(&w, p + i, 1);
+		sum += w;
+	}
+
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return (sum);
+}
+
+/*
+ * Nothing is bound to the bootps port with -g, so replies are read off
+ * the wire instead. The filter only lets through UDP from bootps to
+ * bootps that looks like a BOOTREPLY, and dhcping_raw_strip checks the
+ * headers properly before the reply is passed on.
+ */
+#ifdef __linux__
+#define bpf_insn		sock_filter
+#define DHCPING_LINKHDR		0	/* cooked packet sockets */
+#else
+#define DHCPING_LINKHDR		ETHER_HDR_LEN
+#endif
+
+static struct bpf_insn dhcping_filter[] = {
+#ifndef __linux__
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHERTYPE_IP, 0, 10),
+#endif
+	BPF_STMT(BPF_LD | BPF_B | BPF_ABS, DHCPING_LINKHDR + 9),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 8),
+	BPF_STMT(BPF_LD | BPF_H | BPF_ABS, DHCPING_LINKHDR + 6),
+	BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x3fff, 6, 0),
+	BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, DHCPING_LINKHDR),
+	BPF_STMT(BPF_LD | BPF_W | BPF_IND, DHCPING_LINKHDR),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+	    (DHCP_PORT_NUM << 16) | DHCP_PORT_NUM, 0, 3),
+	BPF_STMT(BPF_LD | BPF_B | BPF_IND, DHCPING_LINKHDR + 8),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, BOOTREPLY, 0, 1),
+	BPF_STMT(BPF_RET | BPF_K, (u_int)-1),
+	BPF_STMT(BPF_RET | BPF_K, 0),
+};
+
+#ifdef __linux__
+void
+dhcping_raw_open(struct dhcping *dhcping)
+{
+	struct sock_fprog prog = {
+		.len = sizeof(dhcping_filter) / sizeof(dhcping_filter[0]),
+		.filter = dhcping_filter,
+	};
+	int on = 1;
+
+	dhcping->s = socket(AF_INET, SOCK_RAW | SOCK_NONBLOCK, IPPROTO_RAW);
+	if (dhcping->s == -1)
+		err(1, "raw socket");
+	if (setsockopt(dhcping->s, IPPROTO_IP, IP_HDRINCL,
+	    &on, sizeof(on)) == -1)
+		err(1, "raw socket header");
+
+	dhcping->rs = socket(AF_PACKET, SOCK_DGRAM | SOCK_NONBLOCK,
+	    htons(ETH_P_IP));
+	if (dhcping->rs == -1)
+		err(1, "packet socket");
+	if (setsockopt(dhcping->rs, SOL_SOCKET, SO_ATTACH_FILTER,
+	    &prog, sizeof(prog)) == -1)
+		err(1, "packet filter");
+#ifdef SO_TIMESTAMP
+	if (setsockopt(dhcping->rs, SOL_SOCKET, SO_TIMESTAMP,
+	    &on, sizeof(on)) == -1)
+		err(1, "timestamps");
+#endif
+}
+
+static int
+dhcping_raw_recv(struct dhcping *dhcping)
+{
+	uint8_t pkt[DHCP_UDP_OVERHEAD + 40 + DHCP_MTU_MAX];
+	struct sockaddr_ll sll;
+	struct dhcping_rx *rx;
+	struct iovec iov = {
+		.iov_base = pkt,
+		.iov_len = sizeof(pkt),
+	};
+	struct msghdr msg;
+	ssize_t rv;
+	int n = 0;
+
+	while (n < DHCP_BATCH) {
+		rx = &dhcping->rx[n];
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &sll;
+		msg.msg_namelen = sizeof(sll);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+#ifdef SO_TIMESTAMP
+		msg.msg_control = rx->cmsg.buf;
+		msg.msg_controllen = sizeof(rx->cmsg.buf);
+#endif
+
+		rv = recvmsg(dhcping->rs, &msg, 0);
+		if (rv == -1) {
+			/* let the next call see the error */
+			if (n > 0)
+				break;
+			return (-1);
+		}
+
+		/* loopback shows packets going out as well as in */
+		if (sll.sll_pkttype == PACKET_OUTGOING ||
+		    (msg.msg_flags & MSG_TRUNC) ||
+		    dhcping_raw_strip(rx, pkt, rv) == -1)
+			continue;
+
+		dhcping_rx_stamp(rx, &msg);
+		n++;
+	}
+
+	return (n);
+}
+#else /* __linux__ */
+/*
+ * bpf has to be attached to the interface facing the servers, and
+ * there's only the one, so they all have to be out the same way.
+ */
+void
+dhcping_raw_open(struct dhcping *dhcping)
+{
+	struct bpf_program prog = {
+		.bf_len = sizeof(dhcping_filter) / sizeof(dhcping_filter[0]),
+		.bf_insns = dhcping_filter,
+	};
+	struct dhcping_server *server;
+	struct ifaddrs *ifap, *ifa;
+	struct ifreq ifr;
+	struct in_addr src;
+	const char *errstr;
+	const char *first = NULL;
+	u_int dlt, blen;
+	u_int on = 1;
+
+	dhcping->s = socket(AF_INET, SOCK_RAW | SOCK_NONBLOCK, IPPROTO_RAW);
+	if (dhcping->s == -1)
+		err(1, "raw socket");
+	if (setsockopt(dhcping->s, IPPROTO_IP, IP_HDRINCL,
+	    &on, sizeof(on)) == -1)
+		err(1, "raw socket header");
+
+	if (TAILQ_EMPTY(&dhcping->servers))
+		errx(1, "no servers to listen for");
+	if (getifaddrs(&ifap) == -1)
+		err(1, "getifaddrs");
+
+	memset(&ifr, 0, sizeof(ifr));
+	TAILQ_FOREACH(server, &dhcping->servers, entry) {
+		if (dhcping_source(dhcping, &server->sin, &src,
+		    &errstr) == -1)
+			errx(1, "server %s: %s", server->name, errstr);
+
+		for (ifa = ifap; ifa != NULL; ifa = ifa->ifa_next) {
+			if (ifa->ifa_addr != NULL &&
+			    ifa->ifa_addr->sa_family == AF_INET &&
+			    ((struct sockaddr_in *)ifa->ifa_addr)->
+			    sin_addr.s_addr == src.s_addr)
+				break;
+		}
+		if (ifa == NULL)
+			errx(1, "no interface has address %s", inet_ntoa(src));
+
+		if (first == NULL) {
+			first = server->name;
+			strlcpy(ifr.ifr_name, ifa->ifa_name,
+			    sizeof(ifr.ifr_name));
+		} else if (strcmp(ifr.ifr_name, ifa->ifa_name) != 0) {
+			errx(1, "servers %s and %s are out different "
+			    "interfaces, %s and %s", first, server->name,
+			    ifr.ifr_name, ifa->ifa_name);
+		}
+	}
+	freeifaddrs(ifap);
+
+	dhcping->rs = open("/dev/bpf", O_RDWR | O_NONBLOCK);
+	if (dhcping->rs == -1)
+		err(1, "/dev/bpf");
+	if (ioctl(dhcping->rs, BIOCSETIF, &ifr) == -1)
+		err(1, "%s bpf", ifr.ifr_name);
+	if (ioctl(dhcping->rs, BIOCGDLT, &dlt) == -1)
+		err(1, "%s bpf dlt", ifr.ifr_name);
+	if (dlt != DLT_EN10MB)
+		errx(1, "%s is not an ethernet interface", ifr.ifr_name);
+	if (ioctl(dhcping->rs, BIOCIMMEDIATE, &on) == -1)
+		err(1, "%s bpf immediate", ifr.ifr_name);
+	if (ioctl(dhcping->rs, BIOCSETF, &prog) == -1)
+		err(1, "%s bpf filter", ifr.ifr_name);
+	if (ioctl(dhcping->rs, BIOCGBLEN, &blen) == -1)
+		err(1, "%s bpf buffer", ifr.ifr_name);
+#ifdef BIOCLOCK
+	if (ioctl(dhcping->rs, BIOCLOCK) == -1)
+		err(1, "%s bpf lock", ifr.ifr_name);
+#endif
+
+	dhcping->bpfbuf = malloc(blen);
+	if (dhcping->bpfbuf == NULL)
+		err(1, "bpf buffer");
+	dhcping->bpflen = blen;
+}
+
+/* a read from bpf can hold more than a batch, keep the rest for later */
+static int
+dhcping_raw_recv(struct dhcping *dhcping)
+{
+	struct bpf_hdr bh;
+	struct dhcping_rx *rx;
+	const uint8_t *pkt;
+	ssize_t rv;
+	int n = 0;
+
+	while (n < DHCP_BATCH) {
+		if (dhcping->bpfoff >= dhcping->bpfend) {
+			if (n > 0)
+				break;
+
+			rv = read(dhcping->rs, dhcping->bpfbuf,
+			    dhcping->bpflen);
+			if (rv == -1)
+				return (-1);
+			if (rv == 0)
+				return (0);
+
+			dhcping->bpfoff = 0;
+			dhcping->bpfend = rv;
+		}
+
+		memcpy(&bh, dhcping->bpfbuf + dhcping->bpfoff, sizeof(bh));
+		pkt = dhcping->bpfbuf + dhcping->bpfoff + bh.bh_hdrlen;
+		dhcping->bpfoff += BPF_WORDALIGN(bh.bh_hdrlen + bh.bh_caplen);
+
+		rx = &dhcping->rx[n];
+		if (bh.bh_caplen != bh.bh_datalen ||
+		    bh.bh_caplen < ETHER_HDR_LEN ||
+		    dhcping_raw_strip(rx, pkt + ETHER_HDR_LEN,
+		    bh.bh_caplen - ETHER_HDR_LEN) == -1)
+			continue;
+
+		rx->kstamp.tv_sec = bh.bh_tstamp.tv_sec;
+		rx->kstamp.tv_usec = bh.bh_tstamp.tv_usec;
+		rx->stamped = 1;
+		n++;
+	}
+
+	return (n);
+}
+#endif /* __linux__ */
+
+/* check the IP and UDP headers and keep what's inside them */
+static int
+dhcping_raw_strip(struct dhcping_rx *rx, const uint8_t *pkt, size_t len)
+{
+	struct ip ip;
+	struct udphdr uh;
+	size_t hlen, ulen;
+
+	if (len < sizeof(ip))
+		return (-1);
+	memcpy(&ip, pkt, sizeof(ip));
+
+	hlen = ip.ip_hl << 2;
+	if (ip.ip_v != IPVERSION || hlen < sizeof(ip) ||
+	    ip.ip_p != IPPROTO_UDP ||
+	    (ntohs(ip.ip_off) & (IP_MF | IP_OFFMASK)) != 0 ||
+	    ntohs(ip.ip_len) > len || ntohs(ip.ip_len) < hlen + sizeof(uh))
+		return (-1);
+
+	/* ethernet pads short frames */
+	len = ntohs(ip.ip_len) - hlen;
+	memcpy(&uh, pkt + hlen, sizeof(uh));
+
+	ulen = ntohs(uh.uh_ulen);
+	if (uh.uh_sport != htons(DHCP_PORT_NUM) ||
+	    uh.uh_dport != htons(DHCP_PORT_NUM) ||
+	    ulen < sizeof(uh) || ulen > len ||
+	    ulen - sizeof(uh) > sizeof(rx->u.buf))
+		return (-1);
+
+	rx->len = ulen - sizeof(uh);
+	memcpy(rx->u.buf, pkt + hlen + sizeof(uh), rx->len);
+
+	memset(&rx->sin, 0, sizeof(rx->sin));
+	rx->sin.sin_family = AF_INET;
+	rx->sin.sin_addr = ip.ip_src;
+	rx->sin.sin_port = uh.uh_sport;
+
+	return (0);
+}
+
+static void
+dhcping_input(int s, short revents, void *arg)
+{
+	struct dhcping *dhcping = arg;
+	struct dhcping_probe *probe;
+	struct timespec now, real, ts;
+	uint32_t b;
+	int i, n;
+
+	do {
+		n = dhcping_recv(dhcping);
+		if (n == -1) {
+			switch (errno) {
+			case EAGAIN:
+			case EINTR:
+			case ECONNREFUSED:
+				return; /* try again later */
+			default:
+				break;
+			}
+
+			/* nothing waiting can be answered now */
+			dhcping->error = errno;
+			event_del(&dhcping->input);
+			for (b = 0; b <= dhcping->hashmask; b++) {
+				while ((probe =
+				    LIST_FIRST(&dhcping->hash[b])) != NULL)
+					dhcping_fail(probe, "input",
+					    dhcping->error);
+			}
+			return;
+		}
+
+		if (clock_gettime(CLOCK_MONOTONIC, &now) == -1 ||
+		    clock_gettime(CLOCK_REALTIME, &real) == -1)
+			err(1, "clock_gettime");
+
+		for (i = 0; i < n; i++) {
+			dhcping_rx_time(&dhcping->rx[i], &now, &real, &ts);
+			dhcping_reply(dhcping, &dhcping->rx[i], &ts);
+		}
+
+		/* a full batch means there's probably more waiting */
+	} while (n == DHCP_BATCH);
+
+	if (dhcping->kick != 0)
+		dhcping_kick(dhcping);
+}
+
+static void
+dhcping_input6(int s, short revents, void *arg)
+{
+	struct dhcping *dhcping = arg;
+	struct dhcping_probe *probe, *next;
+	struct timespec now, real, ts;
+	uint32_t b;
+	int i, n, error;
+
+	do {
+		n = dhcping_recvfrom(dhcping, dhcping->s6, AF_INET6);
+		if (n == -1) {
+			switch (errno) {
+			case EAGAIN:
+			case EINTR:
+			case ECONNREFUSED:
+				return; /* try again later */
+			default:
+				break;
+			}
+
+			/* DHCP checks can carry on without it */
+			error = errno;
+			event_del(&dhcping->input6);
+			for (b = 0; b <= dhcping->hashmask; b++) {
+				probe = LIST_FIRST(&dhcping->hash[b]);
+				while (probe != NULL) {
+					next = LIST_NEXT(probe, wait);
+					if (probe->server->af == AF_INET6)
+						dhcping_fail(probe, "input",
+						    error);
+					probe = next;
+				}
+			}
+			return;
+		}
+
+		if (clock_gettime(CLOCK_MONOTONIC, &now) == -1 ||
+		    clock_gettime(CLOCK_REALTIME, &real) == -1)
+			err(1, "clock_gettime");
+
+		for (i = 0; i < n; i++) {
+			dhcping_rx_time(&dhcping->rx[i], &now, &real, &ts);
+			dhcping_reply6(dhcping, &dhcping->rx[i], &ts);
+		}
+	} while (n == DHCP_BATCH);
+}
+
+static void
+dhcping_reply(struct dhcping *dhcping, struct dhcping_rx *rx,
+    const struct timespec *now)
+{
+	struct dhcp_packet *reply = &rx->u.packet;
+	struct dhcping_probe *probe;
+	unsigned int shard;
+
+	if (rx->len < sizeof(*reply)) {
+		dhcping->ignored[DHCPING_I_SHORT]++;
+		if (dhcping->verbose)
+			warnx("%s: ignoring short packet on input",
+			    inet_ntoa(rx->sin.sin_addr));
+		return;
+	}
+
+	if (reply->op != BOOTREPLY) {
+		dhcping->ignored[DHCPING_I_OP]++;
+		if (dhcping->verbose)
+			warnx("%s: ignoring non-BOOTREPLY packet",
+			    inet_ntoa(rx->sin.sin_addr));
+		return;
+	}
+
+	if (dhcping->shards != NULL) {
+		shard = ntohl(reply->xid) >> dhcping->shards->shift;
+		if (shard != dhcping->shard &&
+		    shard < dhcping->shards->n) {
+			dhcping_handoff(dhcping, shard, rx, now);
+			return;
+		}
+	}
+
+	probe = dhcping_match(dhcping, rx);
+	if (probe == NULL) {
+		dhcping->ignored[DHCPING_I_XID]++;
+		if (dhcping->verbose)
+			warnx("%s: ignoring packet with different xid",
+			    inet_ntoa(rx->sin.sin_addr));
+		return;
+	}
+	probe->server->replies++;
+	if (dhcping->trace)
+		probe->trace.rx = *now;
+
+	if (dhcping_parse(rx) == -1) {
+		dhcping->ignored[DHCPING_I_OPTIONS]++;
+		if (dhcping->verbose)
+			warnx("%s: ignoring reply with malformed options",
+			    inet_ntoa(rx->sin.sin_addr));
+		return;
+	}
+	DHCPING_USDT3(recv, probe->server->name, ntohl(probe->xid),
+	    dhcping_message_type(rx));
+
+	if (dhcping->dora) {
+		dhcping_offer(probe, rx, now);
+		return;
+	}
+
+	probe->type = dhcping_message_type(rx);
+	probe->yiaddr = reply->yiaddr;
+	dhcping_done(probe, dhcping_assert(probe, rx), now);
+}
+
+/*
+ * A DHCPv6 server is up if it ADVERTISEs, and one saying it has no
+ * addresses to give out is as good as a NAK.
+ */
+static void
+dhcping_reply6(struct dhcping *dhcping, struct dhcping_rx *rx,
+    const struct timespec *now)
+{
+	struct dhcping_probe *probe;
+	enum dhcping_state state = DHCPING_S_UP;
+	uint32_t xid;
+	int type, status;
+
+	if (rx->len < DHCP6_RELAY_LEN) {
+		dhcping->ignored[DHCPING_I_SHORT]++;
+		if (dhcping->verbose)
+			warnx("%s: ignoring short packet on input",
+			    dhcping_ntoa6(rx));
+		return;
+	}
+
+	if (rx->u.buf[0] != DHCP6_RELAY_REPL) {
+		dhcping->ignored[DHCPING_I_OP]++;
+		if (dhcping->verbose)
+			warnx("%s: ignoring non-Relay-Reply packet",
+			    dhcping_ntoa6(rx));
+		return;
+	}
+
+	if (dhcping_parse6(rx, &xid, &type, &status) == -1) {
+		dhcping->ignored[DHCPING_I_OPTIONS]++;
+		if (dhcping->verbose)
+			warnx("%s: ignoring reply with malformed options",
+			    dhcping_ntoa6(rx));
+		return;
+	}
+
+	probe = dhcping_match6(dhcping, rx, xid);
+	if (probe == NULL) {
+		dhcping->ignored[DHCPING_I_XID]++;
+		if (dhcping->verbose)
+			warnx("%s: ignoring packet with different xid",
+			    dhcping_ntoa6(rx));
+		return;
+	}
+	probe->server->replies++;
+	if (dhcping->trace)
+		probe->trace.rx = *now;
+	DHCPING_USDT3(recv, probe->server->name, ntohl(probe->xid), type);
+
+	if (type != DHCP6_ADVERTISE) {
+		if (dhcping->verbose)
+			warnx("%s: reply has message type %d, not %d",
+			    probe->server->name, type, DHCP6_ADVERTISE);
+		state = DHCPING_S_TYPE;
+	} else if (status != DHCP6_STATUS_SUCCESS) {
+		if (dhcping->verbose)
+			warnx("%s: advertise has status %d",
+			    probe->server->name, status);
+		state = DHCPING_S_NAK;
+	}
+
+	dhcping_done(probe, state, now);
+}
+
+/* like inet_ntoa, for where a DHCPv6 reply came from */
+static const char *
+dhcping_ntoa6(const struct dhcping_rx *rx)
+{
+	static char buf[INET6_ADDRSTRLEN];
+
+	return (inet_ntop(AF_INET6, &rx->sin6.sin6_addr, buf, sizeof(buf)));
+}
+
+/*
+ * Check a reply against the -m, -y, and -o requirements. A server
+ * answering with the wrong thing is as good as down, but each way of
+ * being wrong is kept apart so it can be reported.
+ */
+static enum dhcping_state
+dhcping_assert(struct dhcping_probe *probe, const struct dhcping_rx *rx)
+{
+	struct dhcping *dhcping = probe->dhcping;
+	const struct dhcp_packet *reply = &rx->u.packet;
+	const char *name = probe->server->name;
+	size_t i;
+	uint8_t len;
+	int type;
+
+	if (dhcping->type != 0) {
+		type = dhcping_message_type(rx);
+		if (type != dhcping->type) {
+			if (dhcping->verbose)
+				warnx("%s: reply has message type %d, "
+				    "not %d", name, type, dhcping->type);
+			return (type == DHCPNAK ?
+			    DHCPING_S_NAK : DHCPING_S_TYPE);
+		}
+	}
+
+	/* an INFORM isn't given an address */
+	if (dhcping->net_set && probe->phase != DHCPING_P_INFORM &&
+	    (reply->yiaddr.s_addr & dhcping->mask.s_addr) !=
+	    dhcping->net.s_addr) {
+		if (dhcping->verbose)
+			warnx("%s: offered address %s is outside the prefix",
+			    name, inet_ntoa(reply->yiaddr));
+		return (DHCPING_S_ADDR);
+	}
+
+	for (i = 0; i < dhcping->nrequired; i++) {
+		if (dhcping_option(rx, dhcping->required[i], &len) == NULL) {
+			if (dhcping->verbose)
+				warnx("%s: reply is missing option %u",
+				    name, dhcping->required[i]);
+			return (DHCPING_S_OPTS);
+		}
+	}
+
+	return (DHCPING_S_UP);
+}
+
+/*
+ * In DORA mode an OFFER moves the probe on to sending a REQUEST for
+ * the offered address with the same xid, and the ACK or NAK to that
+ * finishes the check. Renewing a kept lease only has the second half,
+ * so its ACK gets checked like an OFFER would have been.
+ */
+static void
+dhcping_offer(struct dhcping_probe *probe, struct dhcping_rx *rx,
+    const struct timespec *now)
+{
+	struct dhcping *dhcping = probe->dhcping;
+	const struct dhcp_packet *reply = &rx->u.packet;
+	enum dhcping_state state;
+	const uint8_t *dho;
+	uint8_t len;
+	int type;
+
+	type = dhcping_message_type(rx);
+
+	switch (probe->phase) {
+	case DHCPING_P_DISCOVER:
+		if (type != DHCPOFFER) {
+			dhcping->ignored[DHCPING_I_OFFER]++;
+			if (dhcping->verbose)
+				warnx("%s: ignoring non-OFFER reply",
+				    probe->server->name);
+			return;
+		}
+
+		dho = dhcping_option(rx, DHO_DHCP_SERVER_IDENTIFIER, &len);
+		if (dho == NULL || len != sizeof(probe->serverid) ||
+		    reply->yiaddr.s_addr == htonl(INADDR_ANY)) {
+			dhcping->ignored[DHCPING_I_INCOMPLETE]++;
+			if (dhcping->verbose)
+				warnx("%s: ignoring incomplete OFFER",
+				    probe->server->name);
+			return;
+		}
+
+		probe->type = type;
+		probe->yiaddr = reply->yiaddr;
+
+		state = dhcping_assert(probe, rx);
+		if (state != DHCPING_S_UP) {
+			dhcping_done(probe, state, now);
+			return;
+		}
+
+		probe->answered = probe->attempts;
+		timespecsub(now, &probe->sent, &probe->rtt);
+		if (probe->attempts == 1)
+			dhcping_rtt_sample(probe->server, &probe->rtt);
+		memcpy(&probe->serverid, dho, sizeof(probe->serverid));
+
+		probe->phase = DHCPING_P_REQUEST;
+		probe->len = dhcping_packet_dora(probe, probe->packet,
+		    DHCPREQUEST);
+
+		dhcping_timer_del(&dhcping->wheel, &probe->retry);
+		probe->retries = dhcping->tries;
+		probe->rto = dhcping_rto(probe);
+		probe->attempts = 0;
+		dhcping_retry(probe);
+		break;
+
+	case DHCPING_P_REQUEST:
+	case DHCPING_P_RENEW:
+	case DHCPING_P_INFORM:
+		switch (type) {
+		case DHCPACK:
+			probe->type = type;
+			timespecsub(now, &probe->sent, &probe->commit);
+			if (probe->attempts == 1)
+				dhcping_rtt_sample(probe->server,
+				    &probe->commit);
+
+			state = DHCPING_S_UP;
+			if (probe->phase != DHCPING_P_REQUEST) {
+				probe->answered = probe->attempts;
+				if (reply->yiaddr.s_addr != htonl(INADDR_ANY))
+					probe->yiaddr = reply->yiaddr;
+				state = dhcping_assert(probe, rx);
+			}
+
+			if (state == DHCPING_S_UP && dhcping->keep &&
+			    probe->phase != DHCPING_P_INFORM)
+				dhcping_lease_set(probe, rx);
+			if (dhcping->release)
+				dhcping_release(probe);
+			dhcping_done(probe, state, now);
+			break;
+		case DHCPNAK:
+			probe->type = type;
+			timespecsub(now, &probe->sent, &probe->commit);
+			if (dhcping->verbose)
+				warnx("%s: REQUEST was NAKed",
+				    probe->server->name);
+
+			if (probe->phase != DHCPING_P_REQUEST)
+				probe->answered = probe->attempts;
+
+			/* the client would have to start again */
+			if (probe->phase == DHCPING_P_RENEW)
+				probe->lease->addr.s_addr = htonl(INADDR_ANY);
+			dhcping_done(probe, DHCPING_S_NAK, now);
+			break;
+		default:
+			dhcping->ignored[DHCPING_I_ACK]++;
+			if (dhcping->verbose)
+				warnx("%s: ignoring non-ACK reply",
+				    probe->server->name);
+			break;
+		}
+		break;
+	}
+}
+
+/*
+ * Nothing comes back for a RELEASE, so it's sent straight away from a
+ * copy of the packet rather than going through the transmit queue.
+ */
+static void
+dhcping_release(struct dhcping_probe *probe)
+{
+	struct dhcping *dhcping = probe->dhcping;
+	uint8_t packet[DHCP_PACKET_MAX];
+	struct dhcp_packet *p = (struct dhcp_packet *)packet;
+	size_t len;
+
+	/* it keeps the check's xid, so every check uses up just the one */
+	memcpy(packet, probe->packet, sizeof(packet));
+	len = dhcping_packet_dora(probe, packet, DHCPRELEASE);
+	p->secs = 0;
+
+	if (dhcping_sendto(dhcping, probe, packet,
+	    len) == -1 && dhcping->verbose)
+		warn("%s release", probe->server->name);
+}
+
+/*
+ * With -k a target that still has a lease goes down the path a bound
+ * client would, rather than getting a new address with a DISCOVER.
+ * Before T1 the client has no reason to talk to the server about its
+ * lease, so it only asks for its configuration with an INFORM. After
+ * T1 it RENEWs, and after T2 it REBINDs, which looks the same from a
+ * relay. Once the lease has run out it has to start again.
+ */
+static void
+dhcping_lease_use(struct dhcping_probe *probe)
+{
+	struct dhcping_lease *lease = probe->lease;
+	int64_t now = time(NULL);
+
+	if (lease->addr.s_addr == htonl(INADDR_ANY))
+		return;
+	if (now >= lease->expiry) {
+		lease->addr.s_addr = htonl(INADDR_ANY);
+		return;
+	}
+
+	probe->phase = now < lease->t1 ? DHCPING_P_INFORM : DHCPING_P_RENEW;
+	probe->yiaddr = lease->addr;
+	probe->serverid = lease->serverid;
+	probe->len = dhcping_packet_dora(probe, probe->packet,
+	    probe->phase == DHCPING_P_INFORM ? DHCPINFORM : DHCPREQUEST);
+}
+
+/*
+ * Keep the lease from an ACK. The server has to say how long it's for,
+ * but T1 and T2 can be left for the client to work out.
+ */
+static void
+dhcping_lease_set(struct dhcping_probe *probe, const struct dhcping_rx *rx)
+{
+	struct dhcping_lease *lease = probe->lease;
+	const uint8_t *dho;
+	uint32_t secs, t1, t2;
+	int64_t now = time(NULL);
+	uint8_t len;
+
+	dho = dhcping_option(rx, DHO_DHCP_LEASE_TIME, &len);
+	if (dho == NULL || len != sizeof(secs)) {
+		if (probe->dhcping->verbose)
+			warnx("%s: ACK doesn't have a lease time",
+			    probe->server->name);
+		lease->addr.s_addr = htonl(INADDR_ANY);
+		return;
+	}
+	memcpy(&secs, dho, sizeof(secs));
+	secs = ntohl(secs);
+
+	if (secs == DHCP_LEASE_INFINITE)
+		t1 = t2 = secs;
+	else {
+		t1 = secs / 2;
+		t2 = (uint64_t)secs * 7 / 8;
+	}
+
+	dho = dhcping_option(rx, DHO_DHCP_RENEWAL_TIME, &len);
+	if (dho != NULL && len == sizeof(t1)) {
+		memcpy(&t1, dho, sizeof(t1));
+		t1 = ntohl(t1);
+	}
+	dho = dhcping_option(rx, DHO_DHCP_REBINDING_TIME, &len);
+	if (dho != NULL && len == sizeof(t2)) {
+		memcpy(&t2, dho, sizeof(t2));
+		t2 = ntohl(t2);
+	}
+
+	lease->addr = probe->yiaddr;
+	lease->serverid = probe->serverid;
+	lease->t1 = dhcping_lease_time(now, t1);
+	lease->t2 = dhcping_lease_time(now, t2);
+	lease->expiry = dhcping_lease_time(now, secs);
+}
+
+static int64_t
+dhcping_lease_time(int64_t now, uint32_t secs)
+{
+	return (secs == DHCP_LEASE_INFINITE ? INT64_MAX : now + secs);
+}
+
+/*
+ * A lease file is a hash table of leases found by their server, relay,
+ * and mac. It's rebuilt every time it's opened, which drops the leases
+ * that have run out and makes room for every target, so each probe
+ * can keep pointing at its slot and leases are written to the file as
+ * they change. Only one dhcping can use a lease file at a time, others
+ * keep their leases in memory.
+ */
+void
+dhcping_leases_init(struct dhcping *dhcping, const char *file)
+{
+	struct dhcping_leases *leases;
+	struct dhcping_lease *live = NULL, key;
+	struct dhcping_probe *probe;
+	struct stat st;
+	uint32_t nslots = DHCP_LEASES_MIN;
+	size_t nlive = 0, size, i;
+	int64_t now = time(NULL);
+	int fd;
+
+	/* the lock lasts as long as fd is open, so it's never closed */
+	fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd == -1)
+		err(1, "%s", file);
+	if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+		if (errno != EWOULDBLOCK)
+			err(1, "%s", file);
+		warnx("%s is in use, leases will only be kept in memory",
+		    file);
+		close(fd);
+		return;
+	}
+	if (fstat(fd, &st) == -1)
+		err(1, "%s", file);
+
+	if (st.st_size > 0) {
+		if ((size_t)st.st_size < sizeof(*leases))
+			errx(1, "%s is not a lease file", file);
+		leases = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (leases == MAP_FAILED)
+			err(1, "%s", file);
+		if (memcmp(leases->magic, DHCP_LEASES_MAGIC,
+		    sizeof(leases->magic)) != 0 ||
+		    leases->version != DHCP_LEASES_VERSION ||
+		    leases->nslots == 0 ||
+		    (leases->nslots & (leases->nslots - 1)) != 0 ||
+		    (size_t)st.st_size != sizeof(*leases) +
+		    leases->nslots * sizeof(*leases->slots))
+			errx(1, "%s is not a lease file", file);
+
+		live = calloc(leases->nslots, sizeof(*live));
+		if (live == NULL)
+			err(1, "%s", file);
+		for (i = 0; i < leases->nslots; i++) {
+			key = leases->slots[i];
+			if (key.addr.s_addr != htonl(INADDR_ANY) &&
+			    key.expiry > now)
+				live[nlive++] = key;
+		}
+		munmap(leases, st.st_size);
+	}
+
+	while (nslots < 2 * (dhcping->nprobes + nlive))
+		nslots <<= 1;
+	size = sizeof(*leases) + nslots * sizeof(*leases->slots);
+
+	/* everything that's kept gets put back, so start from nothing */
+	if (ftruncate(fd, 0) == -1 || ftruncate(fd, size) == -1)
+		err(1, "%s", file);
+	leases = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (leases == MAP_FAILED)
+		err(1, "%s", file);
+	memcpy(leases->magic, DHCP_LEASES_MAGIC, sizeof(leases->magic));
+	leases->version = DHCP_LEASES_VERSION;
+	leases->nslots = nslots;
+
+	for (i = 0; i < nlive; i++)
+		*dhcping_lease_slot(leases, &live[i]) = live[i];
+	free(live);
+
+	memset(&key, 0, sizeof(key));
+	TAILQ_FOREACH(probe, &dhcping->probes, entry) {
+		key.server = probe->server->sin.sin_addr;
+		key.giaddr = probe->server->giaddr;
+		key.ea = probe->ea;
+		probe->lease = dhcping_lease_slot(leases, &key);
+	}
+}
+
+/*
+ * Find the slot with a lease, or take an empty one for it. The table
+ * is never more than half full, so there's always one.
+ */
+static struct dhcping_lease *
+dhcping_lease_slot(struct dhcping_leases *leases,
+    const struct dhcping_lease *key)
+{
+	struct dhcping_lease *slot;
+	uint32_t mask = leases->nslots - 1;
+	uint32_t i;
+	uint64_t h;
+
+	h = dhcping_mix((uint64_t)key->server.s_addr << 32 |
+	    key->giaddr.s_addr, 0, 0) ^ dhcping_ea_num(&key->ea);
+	for (i = dhcping_mix(h, 0, 1) & mask;; i = (i + 1) & mask) {
+		slot = &leases->slots[i];
+		if (slot->server.s_addr == htonl(INADDR_ANY)) {
+			slot->server = key->server;
+			slot->giaddr = key->giaddr;
+			slot->ea = key->ea;
+			return (slot);
+		}
+
+		if (slot->server.s_addr == key->server.s_addr &&
+		    slot->giaddr.s_addr == key->giaddr.s_addr &&
+		    memcmp(&slot->ea, &key->ea, sizeof(slot->ea)) == 0)
+			return (slot);
+	}
+}
+
+static void
+dhcping_retry(void *arg)
+{
+	static const struct timeval now = { 0, 0 };
+	struct dhcping_probe *probe = arg;
+	struct dhcping *dhcping = probe->dhcping;
+
+	dhcping_packet_secs(probe);
+
+	/*
+	 * Everything due in this tick goes out together. A retry that's
+	 * due while the last packet is still held up by the rate limits
+	 * is dropped, so retransmits can't pile up behind them.
+	 */
+	if (!probe->queued) {
+		if (TAILQ_EMPTY(&dhcping->txq) &&
+		    !event_pending(&dhcping->output, EV_WRITE, NULL) &&
+		    !dhcping_output6(dhcping))
+			evtimer_add(&dhcping->flush, &now);
+		TAILQ_INSERT_TAIL(&dhcping->txq, probe, tx);
+		probe->queued = 1;
+	}
+
+	if (--probe->retries == 0)
+		return;
+
+	dhcping_timer_add(&dhcping->wheel, &probe->retry, probe->rto);
+	probe->elapsed += probe->rto / 1000;
+
+	/* back off until there's an answer */
+	if (dhcping->adaptive)
+		probe->rto = MIN(probe->rto * 2, DHCP_IVAL_MAX * 1000);
+}
+
+/*
+ * With -A the first retransmit timeout comes from the smoothed round
+ * trip time of the server as worked out in RFC 6298, otherwise it is
+ * the -i interval.
+ */
+static uint32_t
+dhcping_rto(const struct dhcping_probe *probe)
+{
+	const struct dhcping *dhcping = probe->dhcping;
+	struct dhcping_server *server = probe->server;
+	uint32_t rto;
+
+	if (!dhcping->adaptive || !server->srtt_set)
+		return (dhcping->interval * 1000);
+
+	rto = server->srtt + MAX(DHCP_RTO_GRANULARITY, 4 * server->rttvar);
+
+	return (MIN(MAX(rto, DHCP_IVAL_MIN * 1000), DHCP_IVAL_MAX * 1000));
+}
+
+/*
+ * Karn's rule: a reply after a retransmit could be to any of the
+ * packets that were sent, so only checks that were answered on the
+ * first try are used.
+ */
+static void
+dhcping_rtt_sample(struct dhcping_server *server, const struct timespec *ts)
+{
+	uint32_t rtt, delta;
+
+	if (ts->tv_sec >= DHCP_MAXWAIT_MAX / 1000)
+		return;
+	rtt = ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+
+	if (!server->srtt_set) {
+		server->srtt = rtt;
+		server->rttvar = rtt / 2;
+		server->srtt_set = 1;
+		return;
+	}
+
+	delta = server->srtt > rtt ? server->srtt - rtt : rtt - server->srtt;
+	server->rttvar = server->rttvar - server->rttvar / 4 + delta / 4;
+	server->srtt = server->srtt - server->srtt / 8 + rtt / 8;
+}
+
+/*
+ * Packets go out in the order they were queued, as long as there are
+ * tokens for them in the -L bucket and their server's -P bucket. One
+ * server being out of tokens doesn't hold up the others, but the -L
+ * limit stops everything until it's refilled.
+ */
+static void
+dhcping_flush(int fd, short revents, void *arg)
+{
+	struct dhcping *dhcping = arg;
+	struct dhcping_probe *probes[DHCP_BATCH];
+	struct dhcping_probe *probe;
+	struct dhcping_limit *limit;
+	struct timespec now, done;
+	struct timeval tv;
+	uint64_t wait, w;
+	unsigned int i, n;
+	int rv, error;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+		err(1, "clock_gettime");
+
+	dhcping_limit_fill(&dhcping->limit, &now);
+
+	while (!TAILQ_EMPTY(&dhcping->txq)) {
+		n = 0;
+		wait = 0;
+		TAILQ_FOREACH(probe, &dhcping->txq, tx) {
+			if (!dhcping_limit_ok(&dhcping->limit)) {
+				wait = dhcping_limit_wait(&dhcping->limit);
+				break;
+			}
+
+			limit = &probe->server->limit;
+			dhcping_limit_fill(limit, &now);
+			if (!dhcping_limit_ok(limit)) {
+				w = dhcping_limit_wait(limit);
+				if (wait == 0 || w < wait)
+					wait = w;
+				continue;
+			}
+
+			if (dhcping->limit.rate != 0)
+				dhcping->limit.tokens -= DHCP_TOKEN;
+			if (limit->rate != 0)
+				limit->tokens -= DHCP_TOKEN;
+
+			probes[n++] = probe;
+			if (n == DHCP_BATCH)
+				break;
+		}
+
+		if (n == 0) {
+			/* come back when there are tokens again */
+			tv.tv_sec = wait / 1000000000;
+			tv.tv_usec = (wait % 1000000000 + 999) / 1000;
+			evtimer_add(&dhcping->flush, &tv);
+			return;
+		}
+
+		rv = dhcping_send(dhcping, probes, n);
+		if (dhcping->trace && rv > 0 &&
+		    clock_gettime(CLOCK_MONOTONIC, &done) == -1)
+			err(1, "clock_gettime");
+		error = 0;
+		if (rv == -1) {
+			switch (errno) {
+			case EINTR:
+				rv = 0;
+				break;
+			case EAGAIN:
+				rv = 0;
+				/* come back when there's room */
+				event_add(probes[0]->server->af == AF_INET6 ?
+				    &dhcping->output6 : &dhcping->output, NULL);
+				break;
+			default:
+				/* the first one failed, the rest go again */
+				error = errno;
+				rv = 0;
+				break;
+			}
+		}
+
+		for (i = 0; i < n; i++) {
+			probe = probes[i];
+
+			/* the tokens for what didn't go are given back */
+			if (i >= (unsigned int)rv) {
+				if (dhcping->limit.rate != 0)
+					dhcping->limit.tokens += DHCP_TOKEN;
+				if (probe->server->limit.rate != 0)
+					probe->server->limit.tokens +=
+					    DHCP_TOKEN;
+				continue;
+			}
+
+			TAILQ_REMOVE(&dhcping->txq, probe, tx);
+			probe->queued = 0;
+			probe->sent = now;
+			if (dhcping->trace)
+				dhcping_trace_tx(probe, &now, &done);
+			if (probe->attempts++ == 0 &&
+			    probe->phase != DHCPING_P_REQUEST) {
+				dhcping_timer_add(&dhcping->wheel,
+				    &probe->maxwait, dhcping->wait * 1000);
+			}
+			if (probe->attempts == 1) {
+				DHCPING_USDT2(send, probe->server->name,
+				    ntohl(probe->xid));
+			} else {
+				DHCPING_USDT3(retransmit, probe->server->name,
+				    ntohl(probe->xid), probe->attempts);
+			}
+			probe->server->sent++;
+		}
+
+		if (error != 0)
+			dhcping_fail(probes[0], "transmit", error);
+
+		if (event_pending(&dhcping->output, EV_WRITE, NULL) ||
+		    dhcping_output6(dhcping))
+			return;
+	}
+}
+
+/* the DHCPv6 socket might never have been set up */
+static int
+dhcping_output6(struct dhcping *dhcping)
+{
+	return (dhcping->s6 != -1 &&
+	    event_pending(&dhcping->output6, EV_WRITE, NULL));
+}
+
+void
+dhcping_limit_init(struct dhcping_limit *limit, uint32_t rate)
+{
+	memset(limit, 0, sizeof(*limit));
+	if (rate == 0)
+		return;
+
+	limit->rate = rate;
+	limit->depth = MAX(DHCP_LIMIT_DEPTH,
+	    (uint64_t)rate * DHCP_LIMIT_BURST / 1000) * DHCP_TOKEN;
+	limit->tokens = limit->depth;
+}
+
+static void
+dhcping_limit_fill(struct dhcping_limit *limit, const struct timespec *now)
+{
+	struct timespec elapsed;
+	uint64_t ns;
+
+	if (limit->rate == 0)
+		return;
+
+	if (!timespecisset(&limit->last)) {
+		limit->last = *now;
+		return;
+	}
+
+	timespecsub(now, &limit->last, &elapsed);
+	limit->last = *now;
+
+	/* the bucket is full after a second whatever the rate is */
+	if (elapsed.tv_sec > 0) {
+		limit->tokens = limit->depth;
+		return;
+	}
+
+	ns = elapsed.tv_nsec;
+	limit->tokens = MIN(limit->tokens + ns * limit->rate, limit->depth);
+}
+
+static int
+dhcping_limit_ok(const struct dhcping_limit *limit)
+{
+	return (limit->rate == 0 || limit->tokens >= DHCP_TOKEN);
+}
+
+/* nsec until there's a token */
+static uint64_t
+dhcping_limit_wait(const struct dhcping_limit *limit)
+{
+	return ((DHCP_TOKEN - limit->tokens + limit->rate - 1) / limit->rate);
+}
+
+/*
+ * Where the kernel can pace a socket, it spreads out the packets in a
+ * batch instead of sending them as a burst. The rate is set for the
+ * biggest packets so it never holds up what the -L bucket lets through.
+ */
+void
+dhcping_pacing(int s, uint32_t rate)
+{
+#ifdef SO_MAX_PACING_RATE
+	unsigned int bps;
+
+	if (rate == 0)
+		return;
+
+	bps = MIN((uint64_t)rate * (DHCP_PACKET_MAX + DHCP_UDP_OVERHEAD),
+	    UINT_MAX);
+	if (setsockopt(s, SOL_SOCKET, SO_MAX_PACING_RATE,
+	    &bps, sizeof(bps)) == -1)
+		err(1, "pacing rate");
+#endif
+}
+
+/*
+ * The first packet's send call has returned by the time its trace is
+ * filled in, the rest just say when they went.
+ */
+static void
+dhcping_trace_tx(struct dhcping_probe *probe, const struct timespec *now,
+    const struct timespec *done)
+{
+	struct dhcping_trace *trace = &probe->trace;
+
+	if (trace->ntx == 0)
+		trace->sent = *done;
+	if (trace->ntx < DHCP_TRACE_TX)
+		trace->tx[trace->ntx] = *now;
+	trace->ntx++;
+}
+
+static void
+dhcping_maxwait(void *arg)
+{
+	struct dhcping_probe *probe = arg;
+	struct dhcping *dhcping = probe->dhcping;
+
+	if (dhcping->verbose) {
+		warnx("%s %s: timeout waiting for reply", probe->server->name,
+		    ether_ntoa(&probe->ea));
+	}
+
+	dhcping_done(probe, DHCPING_S_DOWN, NULL);
+}
+
+void
+dhcping_check(struct dhcping_probe *probe)
+{
+	struct dhcping *dhcping = probe->dhcping;
+
+	/* every check gets a new xid so late replies are ignored */
+	dhcping_packet_copy(probe, probe->server->af == AF_INET6 ?
+	    dhcping_xid6(dhcping) : dhcping_xid(dhcping));
+
+	probe->state = DHCPING_S_WAIT;
+	probe->phase = DHCPING_P_DISCOVER;
+	probe->retries = dhcping->tries;
+	probe->elapsed = 0;
+	probe->rto = dhcping_rto(probe);
+	probe->attempts = 0;
+	probe->answered = 0;
+	probe->type = 0;
+	probe->error = 0;
+	probe->yiaddr.s_addr = htonl(INADDR_ANY);
+	if (dhcping->keep)
+		dhcping_lease_use(probe);
+
+	/* it stays with this address if the server's name moves */
+	probe->sin = probe->server->sin;
+	dhcping_hash_add(probe);
+	dhcping->pending++;
+
+	if (dhcping->trace) {
+		memset(&probe->trace, 0, sizeof(probe->trace));
+		if (clock_gettime(CLOCK_MONOTONIC, &probe->trace.start) == -1)
+			err(1, "clock_gettime");
+	}
+	DHCPING_USDT2(check, probe->server->name, ntohl(probe->xid));
+
+	/* maxwait starts when the first packet actually goes out */
+	dhcping_retry(probe);
+}
+
+static uint32_t
+dhcping_xid(struct dhcping *dhcping)
+{
+	return (dhcping_xid_at(dhcping, dhcping->xid++));
+}
+
+/*
+ * The xid of the nth check is a keyed permutation of n, so xids don't
+ * repeat until n wraps around, but they're not predictable like a
+ * counter. A benchmark client's xid can be worked out again from its
+ * number this way. With -j the worker's number is kept in the top bits.
+ */
+static uint32_t
+dhcping_xid_at(const struct dhcping *dhcping, uint32_t n)
+{
+	uint32_t mask = dhcping->xid_mask;
+
+	return (htonl(dhcping->xid_base |
+	    dhcping_permute(n & mask, (uint64_t)mask + 1, dhcping->xid_key)));
+}
+
+/*
+ * DHCPv6 transaction ids only have 24 bits, so they're counted and
+ * permuted separately in a space that fits, or they'd collide.
+ */
+static uint32_t
+dhcping_xid6(struct dhcping *dhcping)
+{
+	uint32_t mask = dhcping->xid_mask >> 8;
+
+	return (htonl((dhcping->xid_base >> 8) | dhcping_permute(
+	    dhcping->xid6++ & mask, (uint64_t)mask + 1, dhcping->xid_key)));
+}
+
+/*
+ * A keyed permutation of the numbers below n, from a four round Feistel
+ * network over the smallest even number of bits that covers n. Results
+ * past n are fed back in until one fits, which keeps it a permutation.
+ * Nothing has to be stored, so it works for any n up to 2^48.
+ */
+uint64_t
+dhcping_permute(uint64_t x, uint64_t n, uint32_t key)
+{
+	unsigned int bits = 0, half, round;
+	uint64_t mask, l, r, t;
+
+	while (bits < 48 && (1ULL << bits) < n)
+		bits++;
+	half = (bits + 1) / 2;
+	mask = (1ULL << half) - 1;
+
+	do {
+		l = x >> half;
+		r = x & mask;
+		for (round = 0; round < 4; round++) {
+			t = l ^ (dhcping_mix(r, key, round) & mask);
+			l = r;
+			r = t;
+		}
+		x = (l << half) | r;
+	} while (x >= n);
+
+	return (x);
+}
+
+/* the splitmix64 finalizer */
+static uint64_t
+dhcping_mix(uint64_t x, uint32_t key, unsigned int round)
+{
+	x ^= ((uint64_t)key << 32 | round) * 0x9e3779b97f4a7c15ULL;
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+
+	return (x);
+}
+
+double
+dhcping_ms(const struct timespec *ts)
+{
+	return (ts->tv_sec * 1000.0 + ts->tv_nsec / 1000000.0);
+}
+
+uint64_t
+dhcping_ns(const struct timespec *ts)
+{
+	return ((uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec);
+}
+
+/* how long it's been since start */
+void
+dhcping_took(const struct timespec *start, struct timespec *took)
+{
+	struct timespec now;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+		err(1, "clock_gettime");
+	timespecsub(&now, start, took);
+}
+
+void
+dhcping_tv_ms(struct timeval *tv, uint32_t ms)
+{
+	tv->tv_sec = ms / 1000;
+	tv->tv_usec = (ms % 1000) * 1000;
+}
+
+/*
+ * Take a probe off the timers, the reply hash, and the transmit queue.
+ */
+void
+dhcping_stop(struct dhcping_probe *probe)
+{
+	struct dhcping *dhcping = probe->dhcping;
+
+	dhcping_timer_del(&dhcping->wheel, &probe->retry);
+	dhcping_timer_del(&dhcping->wheel, &probe->maxwait);
+	LIST_REMOVE(probe, wait);
+	if (probe->queued) {
+		TAILQ_REMOVE(&dhcping->txq, probe, tx);
+		probe->queued = 0;
+	}
+	dhcping->pending--;
+}
+
+/*
+ * A check has finished. If reply is NULL the server didn't answer in
+ * time, otherwise it's when the reply arrived. The round trip time is
+ * from the last packet sent before the reply, which is the attempt
+ * that's reported as answered. What happens next is up to whatever
+ * started the check.
+ */
+static void
+dhcping_done(struct dhcping_probe *probe, enum dhcping_state state,
+    const struct timespec *reply)
+{
+	struct dhcping *dhcping = probe->dhcping;
+
+	/* the reply has been checked by now */
+	if (dhcping->trace && reply != NULL &&
+	    clock_gettime(CLOCK_MONOTONIC, &probe->trace.valid) == -1)
+		err(1, "clock_gettime");
+	DHCPING_USDT3(done, probe->server->name, ntohl(probe->xid), state);
+
+	dhcping_stop(probe);
+
+	/* a reply that didn't pass still says which try it answered */
+	probe->state = state;
+	if (reply != NULL && probe->phase == DHCPING_P_DISCOVER) {
+		probe->answered = probe->attempts;
+		timespecsub(reply, &probe->sent, &probe->rtt);
+		if (state == DHCPING_S_UP && probe->attempts == 1)
+			dhcping_rtt_sample(probe->server, &probe->rtt);
+	}
+
+	dhcping->done(probe, reply);
+}
+
+/* a check that couldn't be made is down, and says why */
+static void
+dhcping_fail(struct dhcping_probe *probe, const char *cause, int error)
+{
+	probe->cause = cause;
+	probe->error = error;
+	dhcping_done(probe, DHCPING_S_DOWN, NULL);
+}
+
+uint64_t
+dhcping_ea_num(const struct ether_addr *ea)
+{
+	uint64_t num = 0;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(ea->ether_addr_octet); i++)
+		num = (num << 8) | ea->ether_addr_octet[i];
+
+	return (num);
+}
+
+void
+dhcping_ea_set(struct ether_addr *ea, uint64_t num)
+{
+	int i;
+
+	for (i = sizeof(ea->ether_addr_octet) - 1; i >= 0; i--) {
+		ea->ether_addr_octet[i] = num & 0xff;
+		num >>= 8;
+	}
+}
+
+void
+dhcping_ring_init(struct dhcping_ring *ring, unsigned int nslots,
+    size_t size)
+{
+	/* nslots has to be a power of 2 */
+	ring->slots = calloc(nslots, size);
+	if (ring->slots == NULL)
+		err(1, "ring");
+
+	ring->mask = nslots - 1;
+	ring->size = size;
+	atomic_init(&ring->prod, 0);
+	atomic_init(&ring->cons, 0);
+}
+
+void *
+dhcping_ring_reserve(struct dhcping_ring *ring)
+{
+	unsigned int prod, cons;
+
+	prod = atomic_load_explicit(&ring->prod, memory_order_relaxed);
+	cons = atomic_load_explicit(&ring->cons, memory_order_acquire);
+	if (prod - cons > ring->mask)
+		return (NULL);
+
+	return (ring->slots + (prod & ring->mask) * ring->size);
+}
+
+void
+dhcping_ring_commit(struct dhcping_ring *ring)
+{
+	unsigned int prod;
+
+	prod = atomic_load_explicit(&ring->prod, memory_order_relaxed);
+	atomic_store_explicit(&ring->prod, prod + 1, memory_order_release);
+}
+
+void *
+dhcping_ring_peek(struct dhcping_ring *ring)
+{
+	unsigned int prod, cons;
+
+	cons = atomic_load_explicit(&ring->cons, memory_order_relaxed);
+	prod = atomic_load_explicit(&ring->prod, memory_order_acquire);
+	if (prod == cons)
+		return (NULL);
+
+	return (ring->slots + (cons & ring->mask) * ring->size);
+}
+
+void
+dhcping_ring_consume(struct dhcping_ring *ring)
+{
+	unsigned int cons;
+
+	cons = atomic_load_explicit(&ring->cons, memory_order_relaxed);
+	atomic_store_explicit(&ring->cons, cons + 1, memory_order_release);
+}
+
+void
+dhcping_handoff(struct dhcping *dhcping, unsigned int shard,
+    const struct dhcping_rx *rx, const struct timespec *now)
+{
+	struct dhcping_shards *shards = dhcping->shards;
+	struct dhcping_ring *ring;
+	struct dhcping_handoff *h;
+
+	ring = &shards->handoff[dhcping->shard * shards->n + shard];
+	h = dhcping_ring_reserve(ring);
+	if (h == NULL) {
+		dhcping->ignored[DHCPING_I_HANDOFF]++;
+		if (dhcping->verbose)
+			warnx("%s: ignoring reply for busy worker %u",
+			    inet_ntoa(rx->sin.sin_addr), shard);
+		return;
+	}
+
+	h->rx.sin = rx->sin;
+	h->rx.len = rx->len;
+	memcpy(h->rx.u.buf, rx->u.buf, rx->len);
+	h->when = *now;
+	dhcping_ring_commit(ring);
+
+	dhcping->kick |= 1U << shard;
+}
+
+/* wake up the workers that were handed replies */
+static void
+dhcping_kick(struct dhcping *dhcping)
+{
+	struct dhcping_shards *shards = dhcping->shards;
+	unsigned int w;
+
+	for (w = 0; w < shards->n; w++) {
+		if (!(dhcping->kick & (1U << w)))
+			continue;
+
+		/* a full pipe means it's already been woken */
+		if (write(shards->workers[w]->wake[1], "", 1) == -1 &&
+		    errno != EAGAIN)
+			err(1, "worker %u wakeup", w);
+	}
+
+	dhcping->kick = 0;
+}
+
+void
+dhcping_wakeup(int fd, short revents, void *arg)
+{
+	struct dhcping *dhcping = arg;
+	struct dhcping_shards *shards = dhcping->shards;
+	struct dhcping_ring *ring;
+	struct dhcping_handoff *h;
+	char buf[64];
+	unsigned int w;
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+
+	for (w = 0; w < shards->n; w++) {
+		ring = &shards->handoff[w * shards->n + dhcping->shard];
+		while ((h = dhcping_ring_peek(ring)) != NULL) {
+			dhcping_reply(dhcping, &h->rx, &h->when);
+			dhcping_ring_consume(ring);
+		}
+	}
+}
@@ -0,0 +1,402 @@
+/*
+ * Copyright (c) 2019 The University of Queensland
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <err.h>
+
+#include <event.h>
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/if_ether.h>
+
+#include "dhcp.h"
+#include "dhcping.h"
+
+/* how many replies can be waiting out the latency at once */
+#define DHCP_RESPOND_SLOTS	16384
+
+/* the lease the responder hands out to everyone */
+#define DHCP_RESPOND_LEASE	3600
+#define DHCP_RESPOND_NETMASK	0xff000000U
+#define DHCP_RESPOND_NET	0x0a000000U
+
+struct dhcping_response {
+	struct timespec		due;
+	struct sockaddr_in	sin;
+	size_t			len;
+	union {
+		struct dhcp_packet	packet;
+		uint8_t			buf[DHCP_PACKET_MAX];
+	}			u;
+};
+
+static void	dhcping_respond_input(int, short, void *);
+static int	dhcping_respond_build(struct dhcping *, struct dhcping_rx *,
+		    struct dhcping_response *);
+static uint8_t	*dhcping_respond_u32(uint8_t *, uint8_t, uint32_t);
+static void	dhcping_respond_flush(int, short, void *);
+static int	dhcping_respond_send(struct dhcping *, unsigned int);
+static void	dhcping_respond_stop(int, short, void *);
+
+static inline struct dhcping_response *
+dhcping_respond_slot(struct dhcping_respond *respond, unsigned int i)
+{
+	return (&respond->queue[i & (DHCP_RESPOND_SLOTS - 1)]);
+}
+
+void
+dhcping_respond(struct dhcping *dhcping)
+{
+	struct dhcping_respond *respond = &dhcping->respond;
+
+	respond->queue = calloc(DHCP_RESPOND_SLOTS, sizeof(*respond->queue));
+	if (respond->queue == NULL)
+		err(1, "response queue");
+
+	event_set(&dhcping->input, dhcping->rs, EV_READ|EV_PERSIST,
+	    dhcping_respond_input, dhcping);
+	event_base_set(dhcping->base, &dhcping->input);
+	event_set(&dhcping->output, dhcping->s, EV_WRITE,
+	    dhcping_respond_flush, dhcping);
+	event_base_set(dhcping->base, &dhcping->output);
+	evtimer_set(&respond->timer, dhcping_respond_flush, dhcping);
+	event_base_set(dhcping->base, &respond->timer);
+
+	signal_set(&respond->sigint, SIGINT, dhcping_respond_stop, dhcping);
+	event_base_set(dhcping->base, &respond->sigint);
+	signal_add(&respond->sigint, NULL);
+	signal_set(&respond->sigterm, SIGTERM, dhcping_respond_stop, dhcping);
+	event_base_set(dhcping->base, &respond->sigterm);
+	signal_add(&respond->sigterm, NULL);
+
+	event_add(&dhcping->input, NULL);
+}
+
+static void
+dhcping_respond_input(int s, short revents, void *arg)
+{
+	struct dhcping *dhcping = arg;
+	struct dhcping_respond *respond = &dhcping->respond;
+	struct dhcping_response *res;
+	struct timespec now, latency;
+	int i, n;
+
+	latency.tv_sec = respond->latency / 1000;
+	latency.tv_nsec = (respond->latency % 1000) * 1000000;
+
+	do {
+		n = dhcping_recv(dhcping);
+		if (n == -1) {
+			switch (errno) {
+			case EAGAIN:
+			case EINTR:
+			case ECONNREFUSED:
+				n = 0;
+				break;
+			default:
+				err(1, "receive");
+			}
+			break;
+		}
+
+		if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+			err(1, "clock_gettime");
+
+		for (i = 0; i < n; i++) {
+			if (respond->tail - respond->head ==
+			    DHCP_RESPOND_SLOTS) {
+				respond->full++;
+				continue;
+			}
+
+			res = dhcping_respond_slot(respond, respond->tail);
+			if (!dhcping_respond_build(dhcping, &dhcping->rx[i],
+			    res))
+				continue;
+
+			if (respond->loss > 0 &&
+			    arc4random_uniform(100) < respond->loss) {
+				respond->lost++;
+				continue;
+			}
+
+			timespecadd(&now, &latency, &res->due);
+			respond->tail++;
+		}
+
+		/* a full batch means there's probably more waiting */
+	} while (n == DHCP_BATCH);
+
+	/* otherwise the timer or the socket will get to it */
+	if (!evtimer_pending(&respond->timer, NULL) &&
+	    !event_pending(&dhcping->output, EV_WRITE, NULL))
+		dhcping_respond_flush(-1, 0, dhcping);
+}
+
+/*
+ * Only DHCP requests that came through a relay are answered, and the
+ * answer goes back to the relay. Returns 0 if nothing should be sent.
+ */
+static int
+dhcping_respond_build(struct dhcping *dhcping, struct dhcping_rx *rx,
+    struct dhcping_response *res)
+{
+	static const uint8_t cookie[DHCP_OPTIONS_COOKIE_LEN] =
+	    DHCP_OPTIONS_COOKIE;
+	struct dhcping_respond *respond = &dhcping->respond;
+	const struct dhcp_packet *req = &rx->u.packet;
+	struct dhcp_packet *p = &res->u.packet;
+	struct in_addr yiaddr;
+	const uint8_t *opt;
+	uint8_t *dho;
+	uint8_t len;
+	int type, reply;
+
+	if (rx->len < sizeof(*req) || req->op != BOOTREQUEST ||
+	    req->giaddr.s_addr == htonl(INADDR_ANY) ||
+	    dhcping_parse(rx) == -1) {
+		respond->ignored++;
+		return (0);
+	}
+
+	type = dhcping_message_type(rx);
+	switch (type) {
+	case DHCPDISCOVER:
+		reply = DHCPOFFER;
+		break;
+	case DHCPREQUEST:
+		/* one selecting another server's offer is left alone */
+		opt = dhcping_option(rx, DHO_DHCP_SERVER_IDENTIFIER, &len);
+		if (opt != NULL && (len != sizeof(dhcping->laddr) ||
+		    memcmp(opt, &dhcping->laddr, len) != 0)) {
+			respond->ignored++;
+			return (0);
+		}
+		reply = DHCPACK;
+		break;
+	case DHCPINFORM:
+		reply = DHCPACK;
+		break;
+	case DHCPDECLINE:
+	case DHCPRELEASE:
+		/* there's no lease to take back */
+		respond->requests++;
+		return (0);
+	default:
+		respond->ignored++;
+		return (0);
+	}
+	respond->requests++;
+
+	/* the same client always gets the same address */
+	opt = dhcping_option(rx, DHO_DHCP_REQUESTED_ADDRESS, &len);
+	if (type == DHCPINFORM)
+		yiaddr.s_addr = htonl(INADDR_ANY);
+	else if (opt != NULL && len == sizeof(yiaddr))
+		memcpy(&yiaddr, opt, sizeof(yiaddr));
+	else if (req->ciaddr.s_addr != htonl(INADDR_ANY))
+		yiaddr = req->ciaddr;
+	else {
+		yiaddr.s_addr = htonl(DHCP_RESPOND_NET |
+		    req->chaddr[3] << 16 | req->chaddr[4] << 8 |
+		    req->chaddr[5]);
+	}
+
+	memset(&res->u, 0, sizeof(res->u));
+	p->op = BOOTREPLY;
+	p->htype = req->htype;
+	p->hlen = req->hlen;
+	p->xid = req->xid;
+	p->flags = req->flags;
+	p->ciaddr = req->ciaddr;
+	p->yiaddr = yiaddr;
+	p->giaddr = req->giaddr;
+	memcpy(p->chaddr, req->chaddr, sizeof(p->chaddr));
+	memcpy(p->cookie, cookie, sizeof(cookie));
+
+	dho = (uint8_t *)(p + 1);
+
+	*dho++ = DHO_DHCP_MESSAGE_TYPE;
+	*dho++ = 1;
+	*dho++ = reply;
+
+	*dho++ = DHO_DHCP_SERVER_IDENTIFIER;
+	*dho++ = sizeof(dhcping->laddr);
+	memcpy(dho, &dhcping->laddr, sizeof(dhcping->laddr));
+	dho += sizeof(dhcping->laddr);
+
+	/* an INFORM already has its address and doesn't get a lease */
+	if (type != DHCPINFORM) {
+		dho = dhcping_respond_u32(dho, DHO_DHCP_LEASE_TIME,
+		    DHCP_RESPOND_LEASE);
+		dho = dhcping_respond_u32(dho, DHO_DHCP_RENEWAL_TIME,
+		    DHCP_RESPOND_LEASE / 2);
+		dho = dhcping_respond_u32(dho, DHO_DHCP_REBINDING_TIME,
+		    DHCP_RESPOND_LEASE * 7 / 8);
+	}
+	dho = dhcping_respond_u32(dho, DHO_SUBNET_MASK, DHCP_RESPOND_NETMASK);
+
+	/* relays expect their own information back */
+	opt = dhcping_option(rx, DHO_RELAY_AGENT_INFORMATION, &len);
+	if (opt != NULL) {
+		*dho++ = DHO_RELAY_AGENT_INFORMATION;
+		*dho++ = len;
+		memcpy(dho, opt, len);
+		dho += len;
+	}
+
+	*dho++ = DHO_END;
+	res->len = dhcping_packet_len(res->u.buf, dho);
+
+	memset(&res->sin, 0, sizeof(res->sin));
+	res->sin.sin_family = AF_INET;
+	res->sin.sin_port = htons(DHCP_PORT_NUM);
+	res->sin.sin_addr = req->giaddr;
+
+	return (1);
+}
+
+static uint8_t *
+dhcping_respond_u32(uint8_t *dho, uint8_t code, uint32_t v)
+{
+	v = htonl(v);
+
+	*dho++ = code;
+	*dho++ = sizeof(v);
+	memcpy(dho, &v, sizeof(v));
+
+	return (dho + sizeof(v));
+}
+
+static void
+dhcping_respond_flush(int fd, short revents, void *arg)
+{
+	struct dhcping *dhcping = arg;
+	struct dhcping_respond *respond = &dhcping->respond;
+	struct dhcping_response *head, *res;
+	struct timespec now, wait;
+	struct timeval tv;
+	unsigned int n;
+	int rv;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+		err(1, "clock_gettime");
+
+	while (respond->head != respond->tail) {
+		/* everything behind a reply that isn't due isn't either */
+		head = dhcping_respond_slot(respond, respond->head);
+		for (n = 0; n < DHCP_BATCH &&
+		    respond->head + n != respond->tail; n++) {
+			res = dhcping_respond_slot(respond, respond->head + n);
+			if (timespeccmp(&res->due, &now, >))
+				break;
+		}
+
+		if (n == 0) {
+			timespecsub(&head->due, &now, &wait);
+			tv.tv_sec = wait.tv_sec;
+			tv.tv_usec = (wait.tv_nsec + 999) / 1000;
+			evtimer_add(&respond->timer, &tv);
+			return;
+		}
+
+		rv = dhcping_respond_send(dhcping, n);
+		if (rv == -1) {
+			switch (errno) {
+			case EINTR:
+				continue;
+			case EAGAIN:
+				/* come back when there's room */
+				event_add(&dhcping->output, NULL);
+				return;
+			default:
+				/* the first one failed, the rest go again */
+				respond->errors++;
+				respond->head++;
+				continue;
+			}
+		}
+
+		respond->replies += rv;
+		respond->head += rv;
+	}
+}
+
+#ifdef HAVE_MMSG
+static int
+dhcping_respond_send(struct dhcping *dhcping, unsigned int n)
+{
+	struct dhcping_respond *respond = &dhcping->respond;
+	struct dhcping_response *res;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		res = dhcping_respond_slot(respond, respond->head + i);
+
+		dhcping->txiov[i].iov_base = res->u.buf;
+		dhcping->txiov[i].iov_len = res->len;
+		dhcping->txmsgs[i].msg_hdr.msg_name = &res->sin;
+	}
+
+	return (sendmmsg(dhcping->s, dhcping->txmsgs, n, 0));
+}
+#else
+static int
+dhcping_respond_send(struct dhcping *dhcping, unsigned int n)
+{
+	struct dhcping_respond *respond = &dhcping->respond;
+	struct dhcping_response *res;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		res = dhcping_respond_slot(respond, respond->head + i);
+
+		if (sendto(dhcping->s, res->u.buf, res->len, 0,
+		    (struct sockaddr *)&res->sin, sizeof(res->sin)) == -1)
+			return (i > 0 ? (int)i : -1);
+	}
+
+	return (n);
+}
+#endif
+
+static void
+dhcping_respond_stop(int sig, short revents, void *arg)
+{
+	struct dhcping *dhcping = arg;
+	struct dhcping_respond *respond = &dhcping->respond;
+
+	printf("%llu requests, %llu replies, %llu lost, %llu queue full, "
+	    "%llu ignored, %llu send errors\n",
+	    (unsigned long long)respond->requests,
+	    (unsigned long long)respond->replies,
+	    (unsigned long long)respond->lost,
+	    (unsigned long long)respond->full,
+	    (unsigned long long)respond->ignored,
+	    (unsigned long long)respond->errors);
+
+	exit(0);
+}